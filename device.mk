@@ -440,6 +440,8 @@ PRODUCT_PACKAGES += \
 	android.hardware.usb-service.gs101
 PRODUCT_PACKAGES += \
 	android.hardware.usb.gadget-service.gs101
+PRODUCT_COPY_FILES += \
+	device/google/gs101/usb/usb/usb_compliance_rules.json:$(TARGET_COPY_OUT_VENDOR)/etc/usb_compliance_rules.json
 
 # MIDI feature
 PRODUCT_COPY_FILES += \
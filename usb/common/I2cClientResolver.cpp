@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.I2cClientResolver"
+
+#include "I2cClientResolver.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <utils/Log.h>
+
+#include <cinttypes>
+#include <memory>
+
+#include "LatencyHistogram.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+I2cClientResolver::I2cClientResolver(const char *hsi2cPath, const char *labeledName,
+                                     unsigned int clientId)
+    : mHsi2cPath(hsi2cPath),
+      mLabeledName(labeledName),
+      mClientId(clientId),
+      mResolved(false),
+      mNextScanMs(0),
+      mScans(0) {}
+
+bool I2cClientResolver::exists(const std::string &path) {
+    struct stat st;
+
+    return stat(sysfsPath(path).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Called with mLock held.
+bool I2cClientResolver::resolve() {
+    std::unique_ptr<DIR, int (*)(DIR *)> dp(opendir(sysfsPath(mHsi2cPath).c_str()), closedir);
+    struct dirent *ep;
+    unsigned int busNumber;
+    char unlabeled[16];
+
+    mScans++;
+    if (!dp) {
+        ALOGE("Failed to open %s", mHsi2cPath.c_str());
+        return false;
+    }
+
+    while ((ep = readdir(dp.get()))) {
+        if (ep->d_type != DT_DIR || sscanf(ep->d_name, "i2c-%u", &busNumber) != 1)
+            continue;
+
+        std::string bus = mHsi2cPath + "/" + ep->d_name;
+        snprintf(unlabeled, sizeof(unlabeled), "%u-%04x", busNumber, mClientId);
+
+        for (const std::string &client : {bus + "/" + mLabeledName, bus + "/" + unlabeled}) {
+            if (exists(client)) {
+                mPath = client;
+                return true;
+            }
+        }
+    }
+
+    ALOGE("Failed to find the i2c client path under %s", mHsi2cPath.c_str());
+    return false;
+}
+
+std::string_view I2cClientResolver::path() {
+    if (mResolved.load(std::memory_order_acquire))
+        return mPath;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mResolved.load(std::memory_order_relaxed))
+        return mPath;
+
+    int64_t nowMs = LatencyHistogram::now() / 1000000;
+    if (nowMs < mNextScanMs)
+        return std::string_view{""};
+
+    if (!resolve()) {
+        mNextScanMs = nowMs + kRescanIntervalMs;
+        return std::string_view{""};
+    }
+
+    ALOGI("i2c client path %s", mPath.c_str());
+    mResolved.store(true, std::memory_order_release);
+    return mPath;
+}
+
+SysfsAttribute *I2cClientResolver::attribute(const std::string &name) {
+    std::string_view client = path();
+
+    if (client.empty())
+        return NULL;
+    return mAttributes.get(std::string(client) + "/" + name);
+}
+
+void I2cClientResolver::rescan() {
+    if (mResolved.load(std::memory_order_acquire))
+        return;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    mNextScanMs = 0;
+}
+
+std::string I2cClientResolver::controllerUeventPrefix() const {
+    // DEVPATH has no /sys prefix.
+    return mHsi2cPath.substr(sizeof("/sys") - 1) + "/";
+}
+
+std::string I2cClientResolver::clientUeventPrefix() {
+    std::string_view client = path();
+
+    if (client.empty())
+        return "";
+    return std::string(client.substr(sizeof("/sys") - 1));
+}
+
+void I2cClientResolver::dump(int fd) {
+    dprintf(fd, "i2c client: %s scans:%" PRIu64 "\n",
+            mResolved.load() ? mPath.c_str() : "(not found)", mScans.load());
+    mAttributes.dump(fd);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "SysfsAttribute.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Locates the sysfs directory of the TCPC i2c client, e.g.
+ * /sys/devices/platform/10d50000.hsi2c/i2c-5/i2c-max77759tcpc, and hands out
+ * its attributes kept open. The path does not change after boot, so it is
+ * resolved once and then read without locking.
+ *
+ * While the client is not there yet (late probe), lookups fail without
+ * rescanning the bus directory until either rescan() is called, typically
+ * from an add@ uevent below controllerUeventPrefix(), or kRescanIntervalMs
+ * elapsed for users without a uevent source.
+ */
+class I2cClientResolver {
+  public:
+    static constexpr int64_t kRescanIntervalMs = 1000;
+
+    /*
+     * |hsi2cPath|: sysfs path of the i2c controller, e.g. "/sys/devices/platform/10d50000.hsi2c".
+     * |labeledName|: name of the client directory when the driver labels it.
+     * |clientId|: i2c address of the client, the directory is "<bus>-<clientId>" otherwise.
+     */
+    I2cClientResolver(const char *hsi2cPath, const char *labeledName, unsigned int clientId);
+
+    // Client path, or an empty view while it cannot be found.
+    std::string_view path();
+    // Attribute |name| of the client, kept open. NULL while the client cannot be found.
+    SysfsAttribute *attribute(const std::string &name);
+    // Allows the next lookup to scan the bus again, e.g. on an add@ uevent.
+    void rescan();
+    /*
+     * DEVPATH prefix of the uevents of the whole i2c controller, which also
+     * carries other clients such as the fuel gauge and the chargers. Only
+     * meant to catch the client showing up.
+     */
+    std::string controllerUeventPrefix() const;
+    /*
+     * DEVPATH prefix of the uevents of the client itself and its children,
+     * empty while it cannot be found. There is no trailing '/' as the tcpc
+     * driver reports the contaminant state on the client devpath.
+     */
+    std::string clientUeventPrefix();
+
+    void dump(int fd);
+
+  private:
+    bool resolve();
+    bool exists(const std::string &path);
+
+    const std::string mHsi2cPath;
+    const std::string mLabeledName;
+    const unsigned int mClientId;
+
+    // Protects mPath until mResolved is set, and mNextScanMs
+    std::mutex mLock;
+    std::atomic<bool> mResolved;
+    // Written once, before mResolved is set
+    std::string mPath;
+    // Earliest time of the next scan after a failed one, CLOCK_MONOTONIC ms
+    int64_t mNextScanMs;
+    std::atomic<uint64_t> mScans;
+    SysfsAttributeCache mAttributes;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LatencyHistogram.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <cinttypes>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+LatencyHistogram::LatencyHistogram() : mCount(0), mTotalUs(0), mMaxUs(0) {
+    for (auto &bucket : mBuckets)
+        bucket = 0;
+}
+
+int64_t LatencyHistogram::now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void LatencyHistogram::record(int64_t ns) {
+    uint64_t us = ns > 0 ? ns / 1000 : 0;
+    uint64_t max = mMaxUs.load();
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+    if (bucket >= kBuckets)
+        bucket = kBuckets - 1;
+    mBuckets[bucket]++;
+    mCount++;
+    mTotalUs += us;
+    while (us > max && !mMaxUs.compare_exchange_weak(max, us)) {
+    }
+}
+
+void LatencyHistogram::dump(int fd, const char *name) const {
+    uint64_t count = mCount.load();
+
+    dprintf(fd, "  %s: count:%" PRIu64 " avg:%" PRIu64 "us max:%" PRIu64 "us", name, count,
+            count ? mTotalUs.load() / count : 0, mMaxUs.load());
+    for (int i = 0; i < kBuckets; i++) {
+        uint64_t n = mBuckets[i].load();
+
+        if (n)
+            dprintf(fd, " <%" PRIu64 "us:%" PRIu64, static_cast<uint64_t>(1) << i, n);
+    }
+    dprintf(fd, "\n");
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Lock-free latency histogram with power of two buckets: bucket i counts
+ * samples in [2^(i-1), 2^i) microseconds, bucket 0 samples below 1us. Safe to
+ * record from any thread while another thread dumps it.
+ */
+class LatencyHistogram {
+  public:
+    static constexpr int kBuckets = 32;
+
+    LatencyHistogram();
+
+    void record(int64_t ns);
+    // Prints count, average, max and the non-empty buckets on one line prefixed by |name|.
+    void dump(int fd, const char *name) const;
+
+    // CLOCK_MONOTONIC in nanoseconds, the time base of record().
+    static int64_t now();
+
+  private:
+    std::atomic<uint64_t> mBuckets[kBuckets];
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mTotalUs;
+    std::atomic<uint64_t> mMaxUs;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
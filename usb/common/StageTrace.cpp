@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_HAL
+
+#include "StageTrace.h"
+
+#include <stdio.h>
+#include <utils/Trace.h>
+
+#include <algorithm>
+#include <cinttypes>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+StageTracer::StageTracer(const char *const *stageNames, int stageCount, size_t stageRingSize,
+                         const char *groupName, size_t groupRingSize)
+    : mStageNames(stageNames),
+      mStageCount(stageCount),
+      mGroupName(groupName),
+      mHistograms(new LatencyHistogram[stageCount]),
+      mStages(stageRingSize),
+      mNextStage(0),
+      mInGroup(false),
+      mNextGroup(0) {
+    // Sized once so that recording only copies into existing storage.
+    mCurrentGroup.stageNs.resize(stageCount);
+    mGroups.resize(groupRingSize, mCurrentGroup);
+}
+
+void StageTracer::record(int stage, int64_t startNs, int64_t endNs) {
+    mHistograms[stage].record(endNs - startNs);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    if (!mStages.empty())
+        mStages[mNextStage++ % mStages.size()] = {startNs, endNs - startNs, stage};
+    if (mInGroup)
+        mCurrentGroup.stageNs[stage] += endNs - startNs;
+}
+
+void StageTracer::beginGroup(const std::string &label) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mCurrentGroup.startNs = LatencyHistogram::now();
+    mCurrentGroup.label = label;
+    mCurrentGroup.success = false;
+    std::fill(mCurrentGroup.stageNs.begin(), mCurrentGroup.stageNs.end(), 0);
+    mInGroup = true;
+}
+
+void StageTracer::endGroup(bool success) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (!mInGroup)
+        return;
+    mCurrentGroup.success = success;
+    if (!mGroups.empty())
+        mGroups[mNextGroup++ % mGroups.size()] = mCurrentGroup;
+    mInGroup = false;
+}
+
+void StageTracer::dump(int fd) {
+    dprintf(fd, "latency per stage:\n");
+    for (int i = 0; i < mStageCount; i++)
+        mHistograms[i].dump(fd, mStageNames[i]);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    if (!mStages.empty()) {
+        uint64_t first = mNextStage > mStages.size() ? mNextStage - mStages.size() : 0;
+
+        dprintf(fd, "recent stages (start ms, duration us):\n");
+        for (uint64_t i = first; i < mNextStage; i++) {
+            const StageRecord &record = mStages[i % mStages.size()];
+
+            dprintf(fd, "  %" PRId64 ".%03" PRId64 " %s %" PRId64 "\n", record.startNs / 1000000,
+                    record.startNs / 1000 % 1000, mStageNames[record.stage],
+                    record.durationNs / 1000);
+        }
+    }
+
+    if (!mGroups.empty()) {
+        uint64_t first = mNextGroup > mGroups.size() ? mNextGroup - mGroups.size() : 0;
+
+        dprintf(fd, "recent %s (start ms, stages over 1ms in ms):\n", mGroupName);
+        for (uint64_t i = first; i < mNextGroup; i++) {
+            const GroupRecord &record = mGroups[i % mGroups.size()];
+
+            dprintf(fd, "  %" PRId64 ".%03" PRId64 " %s %s", record.startNs / 1000000,
+                    record.startNs / 1000 % 1000, record.label.c_str(),
+                    record.success ? "ok" : "failed");
+            for (int stage = 0; stage < mStageCount; stage++) {
+                if (record.stageNs[stage] >= 1000000)
+                    dprintf(fd, " %s:%" PRId64, mStageNames[stage],
+                            record.stageNs[stage] / 1000000);
+            }
+            dprintf(fd, "\n");
+        }
+    }
+}
+
+ScopedStageTrace::ScopedStageTrace(StageTracer *tracer, int stage)
+    : mTracer(tracer), mStage(stage), mStartNs(LatencyHistogram::now()) {
+    ATRACE_BEGIN(tracer->stageName(stage));
+}
+
+ScopedStageTrace::~ScopedStageTrace() {
+    ATRACE_END();
+    mTracer->record(mStage, mStartNs, LatencyHistogram::now());
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
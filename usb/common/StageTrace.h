@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "LatencyHistogram.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Latency tracing of the stages of a HAL, shared by the USB HAL and the USB
+ * gadget HAL, which each number their stages with an enum and name them with
+ * a matching array. Every stage traced gets an ATRACE section, a sample in
+ * the histogram of the stage and, if stageRingSize is not 0, an entry in a
+ * ring of the recent stages.
+ *
+ * Stages recorded between beginGroup() and endGroup() are also added up in
+ * the record of that group, e.g. one function switch, and the last
+ * groupRingSize groups are kept. Everything is printed by dump().
+ */
+class StageTracer {
+  public:
+    /*
+     * |stageNames|: |stageCount| names, indexed by stage, must outlive the tracer.
+     * |groupName|: plural name of the groups in dump(), e.g. "function switches".
+     */
+    StageTracer(const char *const *stageNames, int stageCount, size_t stageRingSize,
+                const char *groupName = NULL, size_t groupRingSize = 0);
+
+    const char *stageName(int stage) const { return mStageNames[stage]; }
+    // Records a stage measured by the caller, e.g. one spanning threads. CLOCK_MONOTONIC.
+    void record(int stage, int64_t startNs, int64_t endNs);
+    // Starts a group described by |label|, stages recorded until endGroup() are added to it.
+    void beginGroup(const std::string &label);
+    // Pushes the current group into the ring, |success| tells how it ended.
+    void endGroup(bool success);
+    void dump(int fd);
+
+  private:
+    struct StageRecord {
+        int64_t startNs;
+        int64_t durationNs;
+        int stage;
+    };
+    struct GroupRecord {
+        int64_t startNs;
+        std::string label;
+        bool success;
+        // Time spent in each stage
+        std::vector<int64_t> stageNs;
+    };
+
+    const char *const *mStageNames;
+    const int mStageCount;
+    const char *mGroupName;
+    std::unique_ptr<LatencyHistogram[]> mHistograms;
+
+    // Protects everything below
+    std::mutex mLock;
+    std::vector<StageRecord> mStages;
+    // Total number of stages recorded, mStages[mNextStage % size] is the oldest once wrapped
+    uint64_t mNextStage;
+    bool mInGroup;
+    GroupRecord mCurrentGroup;
+    std::vector<GroupRecord> mGroups;
+    // Total number of groups ended, same indexing as mNextStage
+    uint64_t mNextGroup;
+};
+
+// Traces |stage| of |tracer| for the lifetime of the object.
+class ScopedStageTrace {
+  public:
+    ScopedStageTrace(StageTracer *tracer, int stage);
+    ~ScopedStageTrace();
+
+  private:
+    StageTracer *mTracer;
+    int mStage;
+    int64_t mStartNs;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.SysfsAttribute"
+
+#include "SysfsAttribute.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <cctype>
+#include <cinttypes>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+static std::string sSysfsRoot;
+
+void setSysfsRoot(const std::string &root) {
+    sSysfsRoot = root;
+}
+
+std::string sysfsPath(std::string_view path) {
+    if (sSysfsRoot.empty())
+        return std::string(path);
+    return sSysfsRoot + std::string(path);
+}
+
+static int64_t nowNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Errors returned by a sysfs fd whose kobject was removed, possibly re-created since.
+static bool isStale(int err) {
+    return err == ENODEV || err == ENOENT || err == ENXIO || err == EBADF;
+}
+
+SysfsAttribute::SysfsAttribute(const std::string &path)
+    : mPath(path), mRootedPath(sysfsPath(path)), mCount(0), mErrors(0), mTotalNs(0), mMaxNs(0) {}
+
+template <typename Op>
+ssize_t SysfsAttribute::access(unique_fd *fd, int flags, Op op) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (fd->get() == -1) {
+            fd->reset(TEMP_FAILURE_RETRY(open(mRootedPath.c_str(), flags | O_CLOEXEC)));
+            if (fd->get() == -1)
+                return -1;
+        }
+
+        ssize_t ret = op(fd->get());
+        if (ret >= 0 || !isStale(errno))
+            return ret;
+
+        // The node was removed underneath us, reopen and retry once.
+        fd->reset();
+    }
+    return -1;
+}
+
+void SysfsAttribute::account(int64_t startNs, bool success) {
+    uint64_t elapsed = nowNs() - startNs;
+    uint64_t max = mMaxNs.load();
+
+    mCount++;
+    if (!success)
+        mErrors++;
+    mTotalNs += elapsed;
+    while (elapsed > max && !mMaxNs.compare_exchange_weak(max, elapsed)) {
+    }
+}
+
+bool SysfsAttribute::read(char *buf, size_t size, std::string_view *value) {
+    int64_t start = nowNs();
+    ssize_t n;
+
+    n = access(&mReadFd, O_RDONLY, [buf, size](int fd) {
+        return TEMP_FAILURE_RETRY(pread(fd, buf, size - 1, 0));
+    });
+    account(start, n >= 0);
+    if (n < 0)
+        return false;
+
+    while (n > 0 && isspace(static_cast<unsigned char>(buf[n - 1])))
+        n--;
+    buf[n] = '\0';
+    *value = std::string_view(buf, n);
+    return true;
+}
+
+bool SysfsAttribute::write(std::string_view value) {
+    int64_t start = nowNs();
+    ssize_t n;
+
+    n = access(&mWriteFd, O_WRONLY, [value](int fd) {
+        return TEMP_FAILURE_RETRY(pwrite(fd, value.data(), value.size(), 0));
+    });
+    account(start, n == static_cast<ssize_t>(value.size()));
+    return n == static_cast<ssize_t>(value.size());
+}
+
+void SysfsAttribute::dump(int fd) const {
+    uint64_t count = mCount.load();
+
+    dprintf(fd, "  %s: count:%" PRIu64 " errors:%" PRIu64 " avg:%" PRIu64 "us max:%" PRIu64
+            "us\n", mPath.c_str(), count, mErrors.load(),
+            count ? mTotalNs.load() / count / 1000 : 0, mMaxNs.load() / 1000);
+}
+
+SysfsAttribute *SysfsAttributeCache::get(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mAttributes.find(path);
+    if (it == mAttributes.end())
+        it = mAttributes.emplace(path, std::make_unique<SysfsAttribute>(path)).first;
+    return it->second.get();
+}
+
+bool SysfsAttributeCache::read(const std::string &path, char *buf, size_t size,
+                               std::string_view *value) {
+    return get(path)->read(buf, size, value);
+}
+
+bool SysfsAttributeCache::write(const std::string &path, std::string_view value) {
+    return get(path)->write(value);
+}
+
+void SysfsAttributeCache::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    dprintf(fd, "sysfs attributes:\n");
+    for (const auto &attribute : mAttributes)
+        attribute.second->dump(fd);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+/*
+ * Root under which the HALs look up /sys, /proc and their /vendor/etc
+ * configuration, "" on a device. Tests point it at a fake tree, e.g. a tmpfs
+ * populated with the attributes a scenario needs. Has to be set before any HAL
+ * object is created. /config and /dev/usb-ffs are not rooted, libpixelusb
+ * opens them by absolute path.
+ */
+void setSysfsRoot(const std::string &root);
+// Returns |path| below the current root.
+std::string sysfsPath(std::string_view path);
+
+/*
+ * A sysfs attribute kept open across accesses. Reads and writes go through
+ * pread/pwrite at offset 0, which makes sysfs regenerate the attribute value
+ * on every read, without the open/fstat/close cycle of ReadFileToString. The
+ * file is reopened transparently when the device behind it went away and came
+ * back (ENODEV and friends after a hotplug).
+ *
+ * Only for sysfs: configfs and procfs attributes fill their read buffer once
+ * per open, so a kept fd keeps returning the first value read. Open those
+ * afresh for every access, e.g. with ReadFileToString.
+ */
+class SysfsAttribute {
+  public:
+    // |path| is looked up below the sysfs root, see sysfsPath().
+    explicit SysfsAttribute(const std::string &path);
+
+    /*
+     * Reads the attribute into |buf|, NUL terminated, with trailing whitespace
+     * removed. |value| points into |buf|. Returns false on error.
+     */
+    bool read(char *buf, size_t size, std::string_view *value);
+    bool write(std::string_view value);
+
+    const std::string &path() const { return mPath; }
+    // Prints access count, errors and latency of this attribute.
+    void dump(int fd) const;
+
+  private:
+    // Runs |op| on the fd opened with |flags|, reopening it once if the node went stale.
+    template <typename Op>
+    ssize_t access(unique_fd *fd, int flags, Op op);
+    void account(int64_t startNs, bool success);
+
+    const std::string mPath;
+    // mPath below the sysfs root
+    const std::string mRootedPath;
+    // Protects mReadFd and mWriteFd against concurrent reopening
+    std::mutex mLock;
+    unique_fd mReadFd;
+    unique_fd mWriteFd;
+
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mErrors;
+    std::atomic<uint64_t> mTotalNs;
+    std::atomic<uint64_t> mMaxNs;
+};
+
+// Path indexed set of SysfsAttribute, attributes are created on first use and kept open.
+class SysfsAttributeCache {
+  public:
+    // Never returns NULL; the attribute stays valid for the lifetime of the cache.
+    SysfsAttribute *get(const std::string &path);
+
+    // Convenience wrappers around get(path)->read()/write().
+    bool read(const std::string &path, char *buf, size_t size, std::string_view *value);
+    bool write(const std::string &path, std::string_view value);
+
+    void dump(int fd);
+
+  private:
+    std::mutex mLock;
+    std::map<std::string, std::unique_ptr<SysfsAttribute>, std::less<>> mAttributes;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
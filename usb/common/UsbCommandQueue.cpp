@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.UsbCommandQueue"
+
+#include "UsbCommandQueue.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <cinttypes>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Commands that waited longer than this in the queue are logged.
+constexpr int64_t kSlowWaitNs = 1000000000LL;
+
+static int64_t nowNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+UsbCommandQueue::UsbCommandQueue(const std::string &name)
+    : mName(name),
+      mStop(false),
+      mExecuted(0),
+      mCoalesced(0),
+      mSuperseded(0),
+      mMaxDepth(0),
+      mTotalWaitNs(0),
+      mMaxWaitNs(0),
+      mTotalRunNs(0),
+      mMaxRunNs(0),
+      mRunning(NULL) {
+    if (pthread_create(&mThread, NULL, this->workerThread, this)) {
+        ALOGE("pthread creation failed %d", errno);
+        abort();
+    }
+}
+
+UsbCommandQueue::~UsbCommandQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStop = true;
+    }
+    mCV.notify_one();
+    pthread_join(mThread, NULL);
+}
+
+void UsbCommandQueue::push(Command command) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mCommands.push_back(std::move(command));
+        mMaxDepth = std::max(mMaxDepth, mCommands.size());
+    }
+    mCV.notify_one();
+}
+
+void UsbCommandQueue::enqueue(const char *name, Work work) {
+    push({name, ORDERED, std::move(work), {}, nowNs(), {}});
+}
+
+void UsbCommandQueue::enqueueCoalesced(const char *name, Work execute, Work complete) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = std::find_if(mCommands.begin(), mCommands.end(), [name](const Command &c) {
+            return c.mode == COALESCABLE && !strcmp(c.name, name);
+        });
+
+        // A pending command has not started yet, so its result is still fresh for this request.
+        if (it != mCommands.end()) {
+            if (complete)
+                it->completions.push_back(std::move(complete));
+            mCoalesced++;
+            return;
+        }
+    }
+
+    std::vector<Work> completions;
+    if (complete)
+        completions.push_back(std::move(complete));
+    push({name, COALESCABLE, std::move(execute), std::move(completions), nowNs(), {}});
+}
+
+void UsbCommandQueue::enqueueSuperseding(const char *name, Work execute, Work superseded) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        for (Command &command : mCommands) {
+            if (command.mode != SUPERSEDABLE || strcmp(command.name, name))
+                continue;
+            // Keeps the slot so that the callbacks stay in submission order.
+            command.mode = ORDERED;
+            command.execute = std::move(command.superseded);
+            mSuperseded++;
+        }
+    }
+
+    push({name, SUPERSEDABLE, std::move(execute), {}, nowNs(), std::move(superseded)});
+}
+
+void UsbCommandQueue::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    dprintf(fd, "command queue %s:\n", mName.c_str());
+    dprintf(fd, "  depth: %zu max depth: %zu running: %s\n", mCommands.size(), mMaxDepth,
+            mRunning ? mRunning : "none");
+    dprintf(fd, "  executed: %" PRIu64 " coalesced: %" PRIu64 " superseded: %" PRIu64 "\n",
+            mExecuted, mCoalesced, mSuperseded);
+    dprintf(fd, "  wait avg:%" PRId64 "us max:%" PRId64 "us run avg:%" PRId64 "us max:%" PRId64
+            "us\n", mExecuted ? mTotalWaitNs / (int64_t)mExecuted / 1000 : 0, mMaxWaitNs / 1000,
+            mExecuted ? mTotalRunNs / (int64_t)mExecuted / 1000 : 0, mMaxRunNs / 1000);
+    for (const Command &command : mCommands)
+        dprintf(fd, "  pending: %s waiting %" PRId64 "ms\n", command.name,
+                (nowNs() - command.enqueuedNs) / 1000000);
+}
+
+void *UsbCommandQueue::workerThread(void *param) {
+    UsbCommandQueue *queue = (UsbCommandQueue *)param;
+    std::unique_lock<std::mutex> lock(queue->mLock);
+
+    while (true) {
+        queue->mCV.wait(lock, [queue] { return queue->mStop || !queue->mCommands.empty(); });
+        if (queue->mCommands.empty())
+            break;
+
+        Command command = std::move(queue->mCommands.front());
+        queue->mCommands.pop_front();
+        queue->mRunning = command.name;
+        lock.unlock();
+
+        int64_t start = nowNs();
+        int64_t wait = start - command.enqueuedNs;
+        if (wait > kSlowWaitNs)
+            ALOGW("%s: %s waited %" PRId64 "ms in queue", queue->mName.c_str(), command.name,
+                  wait / 1000000);
+
+        if (command.execute)
+            command.execute();
+        for (const Work &complete : command.completions)
+            complete();
+        int64_t run = nowNs() - start;
+
+        lock.lock();
+        queue->mRunning = NULL;
+        queue->mExecuted++;
+        queue->mTotalWaitNs += wait;
+        queue->mMaxWaitNs = std::max(queue->mMaxWaitNs, wait);
+        queue->mTotalRunNs += run;
+        queue->mMaxRunNs = std::max(queue->mMaxRunNs, run);
+    }
+    return NULL;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
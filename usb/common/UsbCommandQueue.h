@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Ordered executor for the commands of a single port or gadget. AIDL entry
+ * points enqueue their work and return to the binder thread right away; the
+ * worker thread runs the commands one at a time in submission order and
+ * reports the results through the callbacks carried by the command.
+ *
+ * Read-only commands may be coalesced: a command enqueued with
+ * enqueueCoalesced() while another one with the same name is still pending
+ * is merged into it. The merged command runs once and then completes every
+ * request that was merged into it.
+ *
+ * Commands that set state may supersede each other: a command enqueued with
+ * enqueueSuperseding() turns a pending command of the same name into its
+ * |superseded| work, run at the original position, and is queued at the end.
+ * Only the newest of a burst of requests is executed.
+ */
+class UsbCommandQueue {
+  public:
+    using Work = std::function<void()>;
+
+    explicit UsbCommandQueue(const std::string &name);
+    ~UsbCommandQueue();
+
+    // Runs |work| after all previously enqueued commands. |name| must be a string literal.
+    void enqueue(const char *name, Work work);
+    /*
+     * Runs |execute| followed by |complete|, or only |complete| after the
+     * |execute| of a pending command of the same |name| if there is one.
+     * |complete| may be empty.
+     */
+    void enqueueCoalesced(const char *name, Work execute, Work complete);
+    /*
+     * Runs |execute| after all previously enqueued commands. A pending command
+     * of the same |name| runs its |superseded| instead of its |execute|.
+     * |superseded| may be empty.
+     */
+    void enqueueSuperseding(const char *name, Work execute, Work superseded);
+
+    // Prints queue depth, wait and run time statistics.
+    void dump(int fd);
+
+  private:
+    enum Mode {
+        ORDERED,
+        COALESCABLE,
+        SUPERSEDABLE,
+    };
+
+    struct Command {
+        const char *name;
+        Mode mode;
+        Work execute;
+        std::vector<Work> completions;
+        int64_t enqueuedNs;
+        // Run in place of |execute| once a newer SUPERSEDABLE command of the same name arrives
+        Work superseded;
+    };
+
+    static void *workerThread(void *param);
+    void push(Command command);
+
+    const std::string mName;
+    pthread_t mThread;
+    // Protects everything below
+    std::mutex mLock;
+    std::condition_variable mCV;
+    std::deque<Command> mCommands;
+    bool mStop;
+
+    uint64_t mExecuted;
+    uint64_t mCoalesced;
+    uint64_t mSuperseded;
+    size_t mMaxDepth;
+    int64_t mTotalWaitNs;
+    int64_t mMaxWaitNs;
+    int64_t mTotalRunNs;
+    int64_t mMaxRunNs;
+    // Name of the command being run, NULL when idle
+    const char *mRunning;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
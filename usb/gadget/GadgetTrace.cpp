@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GadgetTrace.h"
+
+#include <string>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+namespace {
+
+constexpr const char *kStageNames[TRACE_STAGE_COUNT] = {
+    "queue_wait",
+    "getUsbGadgetIrqPath",
+    "resetGadget",
+    "monitorFfs.reset",
+    "disconnect_wait",
+    "validateAndSetVidPid",
+    "linkFunctions",
+    "pullup",
+    "irq_affinity",
+    "accessory_current_limit",
+    "setCurrentUsbFunctions",
+};
+
+// Number of recent switches kept for dumpsys
+constexpr size_t kRingSize = 16;
+
+}  // namespace
+
+StageTracer *gadgetTracer() {
+    static StageTracer *sTracer =
+            new StageTracer(kStageNames, TRACE_STAGE_COUNT, 0, "function switches", kRingSize);
+    return sTracer;
+}
+
+void beginGadgetSwitchTrace(long functions) {
+    gadgetTracer()->beginGroup("functions:" + std::to_string(functions));
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <StageTrace.h>
+
+#include <cstdint>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+// Phases of setCurrentUsbFunctions.
+enum GadgetTraceStage {
+    // From the binder call to the start of the switch on the command queue
+    TRACE_QUEUE_WAIT,
+    // getUsbGadgetIrqPath, until the IRQ is found
+    TRACE_IRQ_DISCOVERY,
+    // resetGadget, or the partial unlink when segments are kept
+    TRACE_RESET_GADGET,
+    TRACE_MONITOR_RESET,
+    TRACE_DISCONNECT_WAIT,
+    TRACE_VID_PID,
+    // Linking the configfs functions and registering the ffs ones with the monitor
+    TRACE_LINK_FUNCTIONS,
+    // Direct pull up, or waitForPullUp until the ffs descriptors are written
+    TRACE_PULLUP,
+    TRACE_IRQ_AFFINITY,
+    TRACE_CURRENT_LIMIT,
+    // The whole switch, queue wait excluded
+    TRACE_SET_FUNCTIONS,
+    TRACE_STAGE_COUNT,
+};
+
+// Tracer of the GadgetTraceStage phases, keeps a ring of the recent switches.
+StageTracer *gadgetTracer();
+
+/*
+ * Traces a phase for the lifetime of the object: an ATRACE section, a sample
+ * in the per-phase latency histogram and, between beginGadgetSwitchTrace()
+ * and endGadgetSwitchTrace(), time added to the phase in the record of the
+ * current switch. The last switches are kept in a ring for dumpGadgetTrace().
+ */
+class ScopedGadgetTrace : public ScopedStageTrace {
+  public:
+    explicit ScopedGadgetTrace(GadgetTraceStage stage) : ScopedStageTrace(gadgetTracer(), stage) {}
+};
+
+// Records a phase measured by the caller, e.g. one spanning threads. CLOCK_MONOTONIC.
+inline void recordGadgetTrace(GadgetTraceStage stage, int64_t startNs, int64_t endNs) {
+    gadgetTracer()->record(stage, startNs, endNs);
+}
+
+// Starts the record of a switch to |functions|, phases recorded until the end are added to it.
+void beginGadgetSwitchTrace(long functions);
+
+// Pushes the record of the current switch into the ring, |success| tells how it ended.
+inline void endGadgetSwitchTrace(bool success) {
+    gadgetTracer()->endGroup(success);
+}
+
+inline void dumpGadgetTrace(int fd) {
+    gadgetTracer()->dump(fd);
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.gadget.aidl-service.IrqAffinityGovernor"
+
+#include "IrqAffinityGovernor.h"
+
+#include <aidl/android/hardware/usb/gadget/GadgetFunction.h>
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <pixelusb/UsbGadgetAidlCommon.h>
+#include <stdio.h>
+#include <utils/Log.h>
+
+#include <cinttypes>
+#include <cstring>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+using ::android::base::GetBoolProperty;
+using ::android::base::ParseUint;
+using ::android::base::ReadFileToString;
+using ::android::base::Trim;
+using ::android::base::WriteStringToFile;
+
+constexpr char kIrqGovernorProp[] = "persist.vendor.usb.irq_governor";
+constexpr char kNcmIfnamePath[] = FUNCTIONS_PATH "ncm.gs9/ifname";
+constexpr char kNetClassPath[] = "/sys/class/net/";
+
+static const char *const kClusterNames[] = {"little", "mid", "big"};
+// smp_affinity_list of the IRQ for each cluster
+static const char *const kClusterCpus[] = {LITTLE_CORE, MEDIUM_CORE, BIG_CORE};
+
+/*
+ * Interrupts and ncm bytes per second above which the IRQ leaves each cluster
+ * for the next one up, and below which it may step down from it. The down
+ * thresholds are half of the up thresholds of the cluster below so that a
+ * rate near a threshold does not bounce the IRQ.
+ */
+static const uint64_t kUpIrqRate[] = {4000, 16000, UINT64_MAX};
+static const uint64_t kUpNcmRate[] = {2500000, 25000000, UINT64_MAX};
+static const uint64_t kDownIrqRate[] = {0, 2000, 8000};
+static const uint64_t kDownNcmRate[] = {0, 1250000, 12500000};
+
+IrqAffinityGovernor::IrqAffinityGovernor()
+    : mStop(false),
+      mSampling(false),
+      mFunctions(GadgetFunction::NONE),
+      mIrq(0),
+      mInterrupts(kProcInterruptsPath),
+      mCluster(CLUSTER_MID),
+      mQuietSamples(0),
+      mIrqCount(0),
+      mNcmBytes(0),
+      mIrqRate(0),
+      mNcmRate(0),
+      mDecisionCount(0) {
+    if (pthread_create(&mThread, NULL, this->governorThread, this)) {
+        ALOGE("pthread creation failed %d", errno);
+        abort();
+    }
+}
+
+IrqAffinityGovernor::~IrqAffinityGovernor() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStop = true;
+    }
+    mCV.notify_one();
+    pthread_join(mThread, NULL);
+}
+
+void IrqAffinityGovernor::setFunctions(long functions, unsigned int irq) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mFunctions = functions;
+        mIrq = irq;
+        mNcmIfname.clear();
+        mNcmRxBytes.reset();
+        mNcmTxBytes.reset();
+        if (mIrq == 0) {
+            mSampling = false;
+            return;
+        }
+
+        moveTo((functions & GadgetFunction::NCM) ? CLUSTER_BIG : CLUSTER_MID);
+        mSampling = GetBoolProperty(kIrqGovernorProp, false);
+        mQuietSamples = 0;
+        mIrqRate = 0;
+        mNcmRate = 0;
+        mNcmBytes = 0;
+        mLastSample = Clock::now();
+        if (mSampling && !mInterrupts.readCount(mIrq, &mIrqCount)) {
+            ALOGE("irq %u not found in %s", mIrq, kProcInterruptsPath);
+            mSampling = false;
+        }
+    }
+    mCV.notify_one();
+}
+
+bool IrqAffinityGovernor::readNcmBytes(uint64_t *bytes) {
+    char buf[32];
+    std::string_view value;
+    uint64_t rx, tx;
+
+    if (!(mFunctions & GadgetFunction::NCM))
+        return false;
+    if (mNcmIfname.empty()) {
+        if (!ReadFileToString(sysfsPath(kNcmIfnamePath), &mNcmIfname))
+            return false;
+        mNcmIfname = Trim(mNcmIfname);
+        // Shows "(unnamed net_device)" until the function is bound.
+        if (mNcmIfname.empty() || mNcmIfname[0] == '(') {
+            mNcmIfname.clear();
+            return false;
+        }
+        mNcmRxBytes = std::make_unique<SysfsAttribute>(kNetClassPath + mNcmIfname +
+                                                       "/statistics/rx_bytes");
+        mNcmTxBytes = std::make_unique<SysfsAttribute>(kNetClassPath + mNcmIfname +
+                                                       "/statistics/tx_bytes");
+    }
+
+    if (!mNcmRxBytes->read(buf, sizeof(buf), &value) || !ParseUint(std::string(value), &rx))
+        return false;
+    if (!mNcmTxBytes->read(buf, sizeof(buf), &value) || !ParseUint(std::string(value), &tx))
+        return false;
+    *bytes = rx + tx;
+    return true;
+}
+
+void IrqAffinityGovernor::moveTo(Cluster cluster) {
+    std::string affinityPath = sysfsPath(kProcIrqPath) + std::to_string(mIrq) + kSmpAffinityList;
+
+    if (!WriteStringToFile(kClusterCpus[cluster], affinityPath))
+        ALOGI("Cannot move gadget IRQ to %s core, path:%s", kClusterNames[cluster],
+              affinityPath.c_str());
+    mCluster = cluster;
+}
+
+void IrqAffinityGovernor::sample() {
+    Clock::time_point now = Clock::now();
+    int64_t elapsedMs =
+            std::chrono::duration_cast<std::chrono::milliseconds>(now - mLastSample).count();
+    uint64_t irqCount, ncmBytes;
+    Cluster target = mCluster;
+
+    if (elapsedMs <= 0 || !mInterrupts.readCount(mIrq, &irqCount))
+        return;
+    // Counters going backwards were reset, that interval counts as idle.
+    mIrqRate = irqCount > mIrqCount ? (irqCount - mIrqCount) * 1000 / elapsedMs : 0;
+    mIrqCount = irqCount;
+    if (readNcmBytes(&ncmBytes)) {
+        // The first sample after the netdev showed up only sets the baseline.
+        mNcmRate = mNcmBytes && ncmBytes > mNcmBytes ? (ncmBytes - mNcmBytes) * 1000 / elapsedMs
+                                                     : 0;
+        mNcmBytes = ncmBytes;
+    } else {
+        mNcmRate = 0;
+    }
+    mLastSample = now;
+
+    while (target < CLUSTER_BIG &&
+           (mIrqRate >= kUpIrqRate[target] || mNcmRate >= kUpNcmRate[target]))
+        target = static_cast<Cluster>(target + 1);
+
+    if (target == mCluster && mCluster > CLUSTER_LITTLE && mIrqRate < kDownIrqRate[mCluster] &&
+        mNcmRate < kDownNcmRate[mCluster]) {
+        if (++mQuietSamples >= kDownSamples)
+            target = static_cast<Cluster>(mCluster - 1);
+    } else {
+        mQuietSamples = 0;
+    }
+
+    if (target == mCluster)
+        return;
+
+    ALOGI("moving gadget IRQ %u from %s to %s, %" PRIu64 " irq/s %" PRIu64 " ncm bytes/s", mIrq,
+          kClusterNames[mCluster], kClusterNames[target], mIrqRate, mNcmRate);
+    mDecisions[mDecisionCount++ % kDecisionCapacity] = {now, mCluster, target, mIrqRate,
+                                                        mNcmRate};
+    mQuietSamples = 0;
+    moveTo(target);
+}
+
+void *IrqAffinityGovernor::governorThread(void *param) {
+    IrqAffinityGovernor *governor = (IrqAffinityGovernor *)param;
+    std::unique_lock<std::mutex> lock(governor->mLock);
+
+    while (!governor->mStop) {
+        if (!governor->mSampling) {
+            governor->mCV.wait(lock);
+            continue;
+        }
+        // A function switch resets mLastSample, the wait then starts over.
+        Clock::time_point next =
+                governor->mLastSample + std::chrono::milliseconds(kSampleIntervalMs);
+        if (governor->mCV.wait_until(lock, next) == std::cv_status::timeout &&
+            governor->mSampling && Clock::now() >= next)
+            governor->sample();
+    }
+    return NULL;
+}
+
+void IrqAffinityGovernor::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Clock::time_point now = Clock::now();
+    uint64_t first = mDecisionCount > kDecisionCapacity ? mDecisionCount - kDecisionCapacity : 0;
+
+    dprintf(fd, "gadget irq %u: cluster:%s governor:%s ncm:%s\n", mIrq,
+            kClusterNames[mCluster], mSampling ? "on" : "off",
+            mNcmIfname.empty() ? "none" : mNcmIfname.c_str());
+    dprintf(fd, "  last sample: %" PRIu64 " irq/s %" PRIu64 " ncm bytes/s, quiet samples:%d\n",
+            mIrqRate, mNcmRate, mQuietSamples);
+    dprintf(fd, "  decisions: %" PRIu64 "\n", mDecisionCount);
+    for (uint64_t i = first; i < mDecisionCount; i++) {
+        const Decision &decision = mDecisions[i % kDecisionCapacity];
+
+        dprintf(fd, "    %" PRId64 "s ago: %s -> %s at %" PRIu64 " irq/s %" PRIu64
+                " ncm bytes/s\n",
+                static_cast<int64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                        now - decision.timestamp).count()),
+                kClusterNames[decision.from], kClusterNames[decision.to], decision.irqRate,
+                decision.ncmRate);
+    }
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <SysfsAttribute.h>
+#include <pthread.h>
+
+#include "ProcInterrupts.h"
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+constexpr char kProcInterruptsPath[] = "/proc/interrupts";
+constexpr char kProcIrqPath[] = "/proc/irq/";
+constexpr char kSmpAffinityList[] = "/smp_affinity_list";
+
+#define BIG_CORE "6"
+#define MEDIUM_CORE "4"
+#define LITTLE_CORE "0"
+
+/*
+ * Places the dwc3 gadget interrupt on the little, mid or big cluster.
+ *
+ * Every function switch pins the IRQ to the big cluster with NCM and to the
+ * mid cluster otherwise. With persist.vendor.usb.irq_governor set, a thread
+ * then samples the interrupt rate of the IRQ and, with NCM, the byte rate of
+ * the ncm netdev once per kSampleIntervalMs. The IRQ moves up as soon as
+ * either rate crosses the up threshold of its cluster, and one cluster down
+ * once both stayed below the down threshold for kDownSamples samples.
+ */
+class IrqAffinityGovernor {
+  public:
+    enum Cluster {
+        CLUSTER_LITTLE,
+        CLUSTER_MID,
+        CLUSTER_BIG,
+        CLUSTER_COUNT,
+    };
+
+    static constexpr int kSampleIntervalMs = 1000;
+    static constexpr int kDownSamples = 5;
+    static constexpr size_t kDecisionCapacity = 32;
+
+    IrqAffinityGovernor();
+    ~IrqAffinityGovernor();
+
+    // Pins the IRQ numbered |irq|, 0 if unknown, for |functions| and restarts sampling.
+    void setFunctions(long functions, unsigned int irq);
+    // Prints the current placement, the last rates and the recent decisions.
+    void dump(int fd);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Decision {
+        Clock::time_point timestamp;
+        Cluster from;
+        Cluster to;
+        uint64_t irqRate;
+        uint64_t ncmRate;
+    };
+
+    static void *governorThread(void *param);
+    void sample();
+    // Moves the IRQ to |cluster|.
+    void moveTo(Cluster cluster);
+    bool readNcmBytes(uint64_t *bytes);
+
+    pthread_t mThread;
+    // Protects everything below
+    std::mutex mLock;
+    std::condition_variable mCV;
+    bool mStop;
+    // True while the governor is enabled and there is an IRQ to govern
+    bool mSampling;
+    long mFunctions;
+    unsigned int mIrq;
+    ProcInterrupts mInterrupts;
+    Cluster mCluster;
+    // Samples in a row below the down thresholds of mCluster
+    int mQuietSamples;
+
+    // Counters at mLastSample
+    Clock::time_point mLastSample;
+    uint64_t mIrqCount;
+    uint64_t mNcmBytes;
+    // Rates over the last sample interval, per second
+    uint64_t mIrqRate;
+    uint64_t mNcmRate;
+
+    // Resolved on the first sample after the switch, the netdev only exists once bound
+    std::string mNcmIfname;
+    std::unique_ptr<SysfsAttribute> mNcmRxBytes;
+    std::unique_ptr<SysfsAttribute> mNcmTxBytes;
+
+    std::array<Decision, kDecisionCapacity> mDecisions;
+    uint64_t mDecisionCount;
+};
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.gadget.aidl-service.ProcInterrupts"
+
+#include "ProcInterrupts.h"
+
+#include <SysfsAttribute.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Parses |text| as a decimal number, false if it is not one.
+static bool parseNumber(std::string_view text, uint64_t *value) {
+    if (text.empty())
+        return false;
+    *value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9')
+            return false;
+        *value = *value * 10 + (c - '0');
+    }
+    return true;
+}
+
+ProcInterrupts::ProcInterrupts(const char *path) : mPath(path), mRootedPath(sysfsPath(path)) {}
+
+bool ProcInterrupts::parseLine(std::string_view text, Line *line) {
+    size_t pos = 0, end;
+
+    while (pos < text.size() && isSpace(text[pos]))
+        pos++;
+    end = text.find(':', pos);
+    // The header line lists the cpus and has no colon.
+    if (end == std::string_view::npos)
+        return false;
+    line->irq = text.substr(pos, end - pos);
+    line->count = 0;
+
+    pos = end + 1;
+    while (true) {
+        uint64_t value;
+
+        while (pos < text.size() && isSpace(text[pos]))
+            pos++;
+        end = pos;
+        while (end < text.size() && !isSpace(text[end]))
+            end++;
+        if (!parseNumber(text.substr(pos, end - pos), &value))
+            break;
+        line->count += value;
+        pos = end;
+    }
+    line->description = text.substr(pos);
+    return true;
+}
+
+template <typename Visit>
+bool ProcInterrupts::forEachLine(Visit visit) {
+    size_t length = 0;
+    off_t offset = 0;
+    // Set while dropping the rest of a line that did not fit into mBuffer
+    bool truncated = false;
+    Line line;
+
+    if (mFd.get() == -1) {
+        mFd.reset(open(mRootedPath.c_str(), O_RDONLY | O_CLOEXEC));
+        if (mFd.get() == -1) {
+            ALOGE("%s: open %s failed: %s", __func__, mPath, strerror(errno));
+            return false;
+        }
+    }
+
+    while (true) {
+        ssize_t n = TEMP_FAILURE_RETRY(
+                pread(mFd.get(), mBuffer + length, sizeof(mBuffer) - length, offset));
+        const char *start = mBuffer;
+        const char *newline;
+
+        if (n < 0) {
+            ALOGE("%s: read %s failed: %s", __func__, mPath, strerror(errno));
+            return false;
+        }
+        if (n == 0)
+            break;
+        offset += n;
+        length += n;
+
+        while ((newline = static_cast<const char *>(
+                        memchr(start, '\n', mBuffer + length - start))) != NULL) {
+            if (!truncated && parseLine(std::string_view(start, newline - start), &line) &&
+                !visit(line))
+                return true;
+            truncated = false;
+            start = newline + 1;
+        }
+
+        length = mBuffer + length - start;
+        if (length == sizeof(mBuffer)) {
+            truncated = true;
+            length = 0;
+        } else {
+            memmove(mBuffer, start, length);
+        }
+    }
+
+    if (length && !truncated && parseLine(std::string_view(mBuffer, length), &line))
+        visit(line);
+    return true;
+}
+
+bool ProcInterrupts::findIrq(std::string_view name, unsigned int *irq) {
+    bool found = false;
+
+    if (!forEachLine([&](const Line &line) {
+            uint64_t number;
+
+            if (line.description.find(name) == std::string_view::npos ||
+                !parseNumber(line.irq, &number))
+                return true;
+            *irq = number;
+            found = true;
+            return false;
+        }))
+        return false;
+    return found;
+}
+
+bool ProcInterrupts::readCount(unsigned int irq, uint64_t *count) {
+    bool found = false;
+
+    if (!forEachLine([&](const Line &line) {
+            uint64_t number;
+
+            if (!parseNumber(line.irq, &number) || number != irq)
+                return true;
+            *count = line.count;
+            found = true;
+            return false;
+        }))
+        return false;
+    return found;
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+using ::android::base::unique_fd;
+
+/*
+ * Streaming reader of /proc/interrupts. The file is read in chunks into a
+ * fixed buffer and parsed in place one line at a time: the IRQ number, the
+ * per cpu counts, which are summed, and the rest of the line (chip, hwirq,
+ * trigger and action names) as one description. Nothing is copied or
+ * allocated, and the fd stays open across reads since seq_file regenerates
+ * the content when read from offset 0.
+ */
+class ProcInterrupts {
+  public:
+    static constexpr size_t kBufferSize = 4096;
+
+    // |path| is looked up below the sysfs root, see sysfsPath().
+    explicit ProcInterrupts(const char *path);
+
+    // Returns in |irq| the first numbered IRQ whose description contains |name|.
+    bool findIrq(std::string_view name, unsigned int *irq);
+    // Returns in |count| the number of interrupts of |irq| summed over all cpus.
+    bool readCount(unsigned int irq, uint64_t *count);
+
+  private:
+    struct Line {
+        // "449", or "IPI0", "Err" and the like for the architecture specific lines
+        std::string_view irq;
+        uint64_t count;
+        std::string_view description;
+    };
+
+    static bool parseLine(std::string_view text, Line *line);
+    // Calls |visit| with every IRQ line until it returns false.
+    template <typename Visit>
+    bool forEachLine(Visit visit);
+
+    const char *mPath;
+    // mPath below the sysfs root
+    const std::string mRootedPath;
+    unique_fd mFd;
+    char mBuffer[kBufferSize];
+};
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -19,6 +19,7 @@
 #include "UsbGadget.h"
 #include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <sys/inotify.h>
 #include <sys/mount.h>
@@ -26,7 +27,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <cctype>
+#include <cinttypes>
+#include <climits>
+#include <cstring>
+#include <iterator>
+#include <memory>
+
 #include <android-base/properties.h>
+#include <android-base/scopeguard.h>
 
 #include <aidl/android/frameworks/stats/IStats.h>
 
@@ -36,20 +45,46 @@ namespace hardware {
 namespace usb {
 namespace gadget {
 
-string enabledPath;
 constexpr char kHsi2cPath[] = "/sys/devices/platform/10d50000.hsi2c";
 constexpr char kMax77759TcpcDevName[] = "i2c-max77759tcpc";
 constexpr unsigned int kMax77759TcpcClientId = 0x25;
 constexpr char kAccessoryLimitCurrent[] = "usb_limit_accessory_current";
 constexpr char kAccessoryLimitCurrentEnable[] = "usb_limit_accessory_enable";
 constexpr char kUpdateSdpEnumTimeout[] = "update_sdp_enum_timeout";
+// Replaces the fixed disconnect sleep of function switches with a wait on the udc state.
+constexpr char kFastSwitchProp[] = "persist.vendor.usb.fast_switch";
+// Only relinks the configfs functions that changed on a function switch.
+constexpr char kIncrementalRelinkProp[] = "persist.vendor.usb.incremental_relink";
+constexpr char kUdcNotAttached[] = "not attached";
+/*
+ * Least time the gadget stays pulled down when a host was attached. The udc
+ * reports "not attached" as soon as it stops pulling D+ up, which says
+ * nothing about when the host notices: a hub only reports the port change
+ * when the host next polls its status endpoint. Half of the fixed wait, until
+ * the switch latencies in dumpsys show a host that needs more or less.
+ */
+constexpr int64_t kMinDisconnectWaitUs = kDisconnectWaitUs / 2;
+constexpr char kFfsFunctionPrefix[] = "ffs.";
+// Device level attributes resetGadget() clears and the link helpers may set, e.g. os_desc/use.
+static const char *const kDeviceAttributes[] = {DEVICE_CLASS_PATH, DEVICE_SUB_CLASS_PATH,
+                                                DEVICE_PROTOCOL_PATH, DESC_USE_PATH};
+
+static const char *const kDisconnectWaitNames[] = {"fixed", "skipped", "detached", "timeout"};
 
 using ::android::base::GetBoolProperty;
+using ::android::base::make_scope_guard;
 using ::android::hardware::google::pixel::usb::kUvcEnabled;
 
-UsbGadget::UsbGadget() : mGadgetIrqPath(""),
-      mI2cBusNumber(-1),
-      mI2cClientPath("") {
+UsbGadget::UsbGadget(SwitchPolicy policy)
+    : mGadgetIrqPath(""), mGadgetIrq(0), mCurrentUsbFunctions(GadgetFunction::NONE),
+      mCurrentUsbFunctionsApplied(false),
+      mSwitchPolicy(policy),
+      mI2cClient(kHsi2cPath, kMax77759TcpcDevName, kMax77759TcpcClientId),
+      mUdcState(UDC_STATE_PATH), mVbusPresent(VBUS_PRESENT_PATH),
+      mSpeedTracker(UDC_STATE_PATH, SPEED_PATH),
+      mCommandQueue("gadget") {
+    for (auto &count : mKeptSegmentSwitches)
+        count = 0;
     if (access(OS_DESC_PATH, R_OK) != 0) {
         ALOGE("configfs setup not done yet");
         abort();
@@ -57,44 +92,16 @@ UsbGadget::UsbGadget() : mGadgetIrqPath(""),
 }
 
 Status UsbGadget::getUsbGadgetIrqPath() {
-    std::string irqs;
-    size_t read_pos = 0;
-    size_t found_pos = 0;
+    ProcInterrupts interrupts(kProcInterruptsPath);
+    unsigned int irq;
 
-    if (!ReadFileToString(kProcInterruptsPath, &irqs)) {
-        ALOGE("cannot read all interrupts");
+    if (!interrupts.findIrq("dwc3", &irq)) {
+        ALOGI("USB gadget doesn't start");
         return Status::ERROR;
     }
 
-    while (true) {
-        found_pos = irqs.find_first_of("\n", read_pos);
-        if (found_pos == std::string::npos) {
-            ALOGI("the string of all interrupts is unexpected");
-            return Status::ERROR;
-        }
-
-        std::string single_irq = irqs.substr(read_pos, found_pos - read_pos);
-
-        if (single_irq.find("dwc3", 0) != std::string::npos) {
-            unsigned int dwc3_irq_number;
-            size_t dwc3_pos = single_irq.find_first_of(":");
-            if (!ParseUint(single_irq.substr(0, dwc3_pos), &dwc3_irq_number)) {
-                ALOGI("unknown IRQ strings");
-                return Status::ERROR;
-            }
-
-            mGadgetIrqPath = kProcIrqPath + single_irq.substr(0, dwc3_pos) + kSmpAffinityList;
-            break;
-        }
-
-        if (found_pos == irqs.npos) {
-            ALOGI("USB gadget doesn't start");
-            return Status::ERROR;
-        }
-
-        read_pos = found_pos + 1;
-    }
-
+    mGadgetIrq = irq;
+    mGadgetIrqPath = kProcIrqPath + std::to_string(irq) + kSmpAffinityList;
     return Status::SUCCESS;
 }
 
@@ -116,33 +123,11 @@ ScopedAStatus UsbGadget::getCurrentUsbFunctions(const shared_ptr<IUsbGadgetCallb
     return ScopedAStatus::ok();
 }
 
+// The speed is tracked from udc state notifications, see UsbSpeedTracker.
 ScopedAStatus UsbGadget::getUsbSpeed(const shared_ptr<IUsbGadgetCallback> &callback,
         int64_t in_transactionId) {
-    std::string current_speed;
-    if (ReadFileToString(SPEED_PATH, &current_speed)) {
-        current_speed = Trim(current_speed);
-        ALOGI("current USB speed is %s", current_speed.c_str());
-        if (current_speed == "low-speed")
-            mUsbSpeed = UsbSpeed::LOWSPEED;
-        else if (current_speed == "full-speed")
-            mUsbSpeed = UsbSpeed::FULLSPEED;
-        else if (current_speed == "high-speed")
-            mUsbSpeed = UsbSpeed::HIGHSPEED;
-        else if (current_speed == "super-speed")
-            mUsbSpeed = UsbSpeed::SUPERSPEED;
-        else if (current_speed == "super-speed-plus")
-            mUsbSpeed = UsbSpeed::SUPERSPEED_10Gb;
-        else if (current_speed == "UNKNOWN")
-            mUsbSpeed = UsbSpeed::UNKNOWN;
-        else
-            mUsbSpeed = UsbSpeed::UNKNOWN;
-    } else {
-        ALOGE("Fail to read current speed");
-        mUsbSpeed = UsbSpeed::UNKNOWN;
-    }
-
     if (callback) {
-        ScopedAStatus ret = callback->getUsbSpeedCb(mUsbSpeed, in_transactionId);
+        ScopedAStatus ret = callback->getUsbSpeedCb(mSpeedTracker.speed(), in_transactionId);
 
         if (!ret.isOk())
             ALOGE("Call to getUsbSpeedCb failed %s", ret.getDescription().c_str());
@@ -151,12 +136,86 @@ ScopedAStatus UsbGadget::getUsbSpeed(const shared_ptr<IUsbGadgetCallback> &callb
     return ScopedAStatus::ok();
 }
 
-Status UsbGadget::tearDownGadget() {
-    if (Status(resetGadget()) != Status::SUCCESS){
-        return Status::ERROR;
+// Writes |values| back to kDeviceAttributes, false if one is unknown or cannot be written.
+static bool restoreDeviceAttributes(const std::vector<std::string> &values) {
+    for (size_t i = 0; i < std::size(kDeviceAttributes); i++) {
+        if (i >= values.size() || values[i].empty() ||
+            !WriteStringToFile(values[i], kDeviceAttributes[i])) {
+            ALOGE("%s: cannot restore %s", __func__, kDeviceAttributes[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Removes the function<N> links of the configuration with N >= |first|, 0 on
+ * success. unlinkFunctions() of libpixelusb removes them all.
+ */
+static int unlinkFunctionsFrom(int first) {
+    std::unique_ptr<DIR, int (*)(DIR *)> config(opendir(CONFIG_PATH), closedir);
+    struct dirent *entry;
+    size_t prefixLen = strlen(FUNCTION_NAME);
+    unsigned int index;
+
+    if (!config) {
+        ALOGE("%s: opendir %s failed: %s", __func__, CONFIG_PATH, strerror(errno));
+        return -1;
+    }
+
+    // d_type is not filled in by configfs, the links are told apart by name.
+    while ((entry = readdir(config.get())) != NULL) {
+        if (strncmp(entry->d_name, FUNCTION_NAME, prefixLen) ||
+            !ParseUint(entry->d_name + prefixLen, &index) || index < static_cast<unsigned int>(first))
+            continue;
+        std::string link = std::string(CONFIG_PATH) + entry->d_name;
+        if (unlink(link.c_str())) {
+            ALOGE("%s: unlink %s failed: %s", __func__, link.c_str(), strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+Status UsbGadget::tearDownGadget(size_t keptSegments) {
+    int keptLinks = 0;
+
+    {
+        ScopedGadgetTrace trace(TRACE_RESET_GADGET);
+
+        if (keptSegments > 0) {
+            if (!WriteStringToFile("none", PULLUP_PATH))
+                ALOGI("Gadget cannot be pulled down");
+            /*
+             * resetGadget() clears the device attributes and the helpers of the
+             * relinked segments set them again. Start from the values they had
+             * right after the last kept segment was linked, as a full relink would.
+             */
+            if (!restoreDeviceAttributes(mLinkedSegments[keptSegments - 1].deviceAttributes))
+                keptSegments = 0;
+        }
+
+        if (keptSegments == 0) {
+            mLinkedSegments.clear();
+            if (Status(resetGadget()) != Status::SUCCESS){
+                return Status::ERROR;
+            }
+        } else {
+            // Same as resetGadget() except for the links of the kept segments.
+            mLinkedSegments.resize(keptSegments);
+            for (const LinkedSegment &segment : mLinkedSegments)
+                keptLinks += segment.links;
+            if (unlinkFunctionsFrom(keptLinks)) {
+                mLinkedSegments.clear();
+                return Status::ERROR;
+            }
+        }
     }
+    mKeptSegmentSwitches[keptSegments]++;
 
     if (monitorFfs.isMonitorRunning()) {
+        ScopedGadgetTrace monitorTrace(TRACE_MONITOR_RESET);
+
         monitorFfs.reset();
     } else {
         ALOGI("mMonitor not running");
@@ -341,97 +400,322 @@ static Status validateAndSetVidPid(int64_t functions) {
     return ret;
 }
 
-ScopedAStatus UsbGadget::reset(const shared_ptr<IUsbGadgetCallback> &callback,
-        int64_t in_transactionId) {
+Status UsbGadget::applyReset() {
     ALOGI("USB Gadget reset");
 
     if (!WriteStringToFile("none", PULLUP_PATH)) {
         ALOGI("Gadget cannot be pulled down");
-        if (callback)
-            callback->resetCb(Status::ERROR, in_transactionId);
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Gadget cannot be pulled down");
+        return Status::ERROR;
     }
 
     usleep(kDisconnectWaitUs);
 
     if (!WriteStringToFile(kGadgetName, PULLUP_PATH)) {
         ALOGI("Gadget cannot be pulled up");
-        if (callback)
-            callback->resetCb(Status::ERROR, in_transactionId);
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Gadget cannot be pulled up");
+        return Status::ERROR;
     }
-    if (callback)
-        callback->resetCb(Status::SUCCESS, in_transactionId);
+    return Status::SUCCESS;
+}
 
+/*
+ * Runs on mCommandQueue like the function switches, a pull down or up in the
+ * middle of a teardown or relink would enumerate a half linked gadget.
+ */
+ScopedAStatus UsbGadget::reset(const shared_ptr<IUsbGadgetCallback> &callback,
+        int64_t in_transactionId) {
+    mCommandQueue.enqueue("reset", [this, callback, in_transactionId] {
+        Status status = applyReset();
+
+        if (callback == NULL)
+            return;
+        ScopedAStatus ret = callback->resetCb(status, in_transactionId);
+        if (!ret.isOk())
+            ALOGE("Error while calling resetCb %s", ret.getDescription().c_str());
+    });
     return ScopedAStatus::ok();
 }
 
 void UsbGadget::updateSdpEnumTimeout() {
-    string update_sdp_enum_timeout_path;
-    std::string_view i2cPath;
+    SysfsAttribute *sdpEnumTimeout;
 
-    i2cPath = getI2cClientPath();
-    if (i2cPath.empty()) {
+    sdpEnumTimeout = mI2cClient.attribute(kUpdateSdpEnumTimeout);
+    if (sdpEnumTimeout == NULL) {
         ALOGE("%s: Unable to locate i2c bus node", __func__);
         return;
     }
 
-    update_sdp_enum_timeout_path = std::string{i2cPath} + "/" + kUpdateSdpEnumTimeout;
-    if (!WriteStringToFile("1", update_sdp_enum_timeout_path)) {
-        ALOGE("%s: Unable to write to %s.", __func__, update_sdp_enum_timeout_path.c_str());
+    if (!sdpEnumTimeout->write("1")) {
+        ALOGE("%s: Unable to write to %s.", __func__, sdpEnumTimeout->path().c_str());
     } else {
         ALOGI("%s: Updated SDP enumeration timeout value.", __func__);
     }
 }
 
-Status UsbGadget::setupFunctions(long functions,
-        const shared_ptr<IUsbGadgetCallback> &callback, uint64_t timeout,
-        int64_t in_transactionId) {
-    bool ffsEnabled = false;
-    int i = 0;
+bool UsbGadget::udcDetachWait() {
+    if (mSwitchPolicy.udcDetachWait)
+        return *mSwitchPolicy.udcDetachWait;
+    return GetBoolProperty(kFastSwitchProp, false);
+}
 
-    if (Status(addGenericAndroidFunctions(&monitorFfs, functions, &ffsEnabled, &i)) !=
-        Status::SUCCESS)
-        return Status::ERROR;
+bool UsbGadget::incrementalRelink() {
+    if (mSwitchPolicy.incrementalRelink)
+        return *mSwitchPolicy.incrementalRelink;
+    return GetBoolProperty(kIncrementalRelinkProp, false);
+}
+
+bool UsbGadget::hostAttached() {
+    char buf[32];
+    std::string_view value;
+
+    if (mVbusPresent.read(buf, sizeof(buf), &value) && value == "0")
+        return false;
+    if (mUdcState.read(buf, sizeof(buf), &value) && value == kUdcNotAttached)
+        return false;
+    return true;
+}
+
+bool UsbGadget::waitForUdcDetach(int64_t timeoutUs) {
+    // Not mUdcState, POLLPRI needs an fd of its own that was read since the last notification.
+    unique_fd fd(open(sysfsPath(UDC_STATE_PATH).c_str(), O_RDONLY | O_CLOEXEC));
+    int64_t deadline = LatencyHistogram::now() + timeoutUs * 1000;
+    char buf[32];
+
+    if (fd.get() == -1) {
+        ALOGE("%s: open %s failed: %s", __func__, UDC_STATE_PATH, strerror(errno));
+        return false;
+    }
+
+    while (true) {
+        struct pollfd pfd = {.fd = fd.get(), .events = POLLPRI};
+        ssize_t len = TEMP_FAILURE_RETRY(pread(fd.get(), buf, sizeof(buf) - 1, 0));
+        int64_t remaining;
+
+        if (len < 0) {
+            ALOGE("%s: read %s failed: %s", __func__, UDC_STATE_PATH, strerror(errno));
+            return false;
+        }
+        while (len > 0 && isspace(static_cast<unsigned char>(buf[len - 1])))
+            len--;
+        if (std::string_view(buf, len) == kUdcNotAttached)
+            return true;
+
+        remaining = deadline - LatencyHistogram::now();
+        if (remaining <= 0)
+            return false;
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, (remaining + 999999) / 1000000)) < 0) {
+            ALOGE("%s: poll %s failed: %s", __func__, UDC_STATE_PATH, strerror(errno));
+            return false;
+        }
+    }
+}
 
+/*
+ * Gives the host time to sense the disconnect of the gadget that was just
+ * torn down. Without udcDetachWait() this is a fixed
+ * kDisconnectWaitUs. With it, nothing is waited for when there was no host to
+ * begin with, and otherwise until the udc reports "not attached" and at least
+ * kMinDisconnectWaitUs, still bounded by kDisconnectWaitUs.
+ */
+UsbGadget::DisconnectWait UsbGadget::waitForDisconnect(bool hostWasAttached) {
+    int64_t start = LatencyHistogram::now();
+    DisconnectWait result;
+
+    static_assert(std::size(kDisconnectWaitNames) == DISCONNECT_WAIT_COUNT);
+
+    if (!udcDetachWait()) {
+        usleep(kDisconnectWaitUs);
+        result = DISCONNECT_WAIT_FIXED;
+    } else if (!hostWasAttached) {
+        result = DISCONNECT_WAIT_SKIPPED;
+    } else if (waitForUdcDetach(kDisconnectWaitUs)) {
+        int64_t elapsedUs = (LatencyHistogram::now() - start) / 1000;
+
+        if (elapsedUs < kMinDisconnectWaitUs)
+            usleep(kMinDisconnectWaitUs - elapsedUs);
+        result = DISCONNECT_WAIT_DETACHED;
+    } else {
+        result = DISCONNECT_WAIT_TIMEOUT;
+    }
+
+    mDisconnectWaitLatency[result].record(LatencyHistogram::now() - start);
+    return result;
+}
+
+std::vector<std::string> UsbGadget::linkSegmentKeys(long functions,
+                                                    const std::string &vendorFunctions) {
+    std::vector<std::string> keys(SEGMENT_COUNT);
+
+    // The vendor links depend on RNDIS too, which is part of the generic segment before them.
+    keys[SEGMENT_GENERIC] =
+            std::to_string(functions & ~(GadgetFunction::ADB | GadgetFunction::NCM));
+    keys[SEGMENT_VENDOR] = vendorFunctions;
+    keys[SEGMENT_ADB] = (functions & GadgetFunction::ADB) ? "adb" : "";
+    keys[SEGMENT_NCM] = (functions & GadgetFunction::NCM) ? "ncm" : "";
+    return keys;
+}
+
+// Returns the ffs endpoints, other than ep0, that exist below |instanceDir|.
+static std::vector<std::string> ffsEndpoints(const std::string &instanceDir) {
+    std::unique_ptr<DIR, int (*)(DIR *)> dir(opendir(instanceDir.c_str()), closedir);
+    std::vector<std::string> endpoints;
+    struct dirent *entry;
+
+    if (!dir)
+        return endpoints;
+    while ((entry = readdir(dir.get())) != NULL) {
+        if (!strncmp(entry->d_name, "ep", 2) && strcmp(entry->d_name, "ep0"))
+            endpoints.push_back(instanceDir + entry->d_name);
+    }
+    return endpoints;
+}
+
+size_t UsbGadget::reusableSegments(long functions) {
+    std::vector<std::string> keys;
+    size_t kept = 0;
+
+    if (functions == GadgetFunction::NONE || !incrementalRelink())
+        return 0;
+
+    keys = linkSegmentKeys(functions, getVendorFunctions());
+    for (; kept < mLinkedSegments.size(); kept++) {
+        const LinkedSegment &segment = mLinkedSegments[kept];
+
+        if (segment.key != keys[kept])
+            break;
+        // An ffs function whose daemon has not written descriptors would never pull up again.
+        for (const std::string &instance : segment.ffsInstances) {
+            if (ffsEndpoints(std::string(kFfsPath) + instance + "/").empty())
+                return kept;
+        }
+    }
+    return kept;
+}
+
+void UsbGadget::recordLinkedSegment(const std::string &key, int start, int end) {
+    LinkedSegment segment = {key, end - start, {}, {}};
+
+    for (int i = start; i < end; i++) {
+        std::string link = std::string(FUNCTION_PATH) + std::to_string(i);
+        char target[PATH_MAX];
+        ssize_t len = readlink(link.c_str(), target, sizeof(target) - 1);
+        const char *name;
+
+        if (len < 0) {
+            ALOGE("%s: readlink %s failed: %s", __func__, link.c_str(), strerror(errno));
+            continue;
+        }
+        target[len] = '\0';
+        name = strrchr(target, '/');
+        name = name ? name + 1 : target;
+        if (!strncmp(name, kFfsFunctionPrefix, strlen(kFfsFunctionPrefix)))
+            segment.ffsInstances.push_back(name + strlen(kFfsFunctionPrefix));
+    }
+    for (const char *path : kDeviceAttributes) {
+        std::string value;
+
+        // Not a SysfsAttribute, configfs only fills its read buffer once per open.
+        if (!ReadFileToString(path, &value))
+            ALOGE("%s: read %s failed", __func__, path);
+        segment.deviceAttributes.push_back(Trim(value));
+    }
+    mLinkedSegments.push_back(std::move(segment));
+}
+
+void UsbGadget::monitorKeptSegment(const LinkedSegment &segment) {
+    for (const std::string &instance : segment.ffsInstances) {
+        std::string instanceDir = std::string(kFfsPath) + instance + "/";
+
+        if (!monitorFfs.addInotifyFd(instanceDir))
+            ALOGE("%s: cannot watch %s", __func__, instanceDir.c_str());
+        for (const std::string &endpoint : ffsEndpoints(instanceDir))
+            monitorFfs.addEndPoint(endpoint);
+    }
+}
+
+Status UsbGadget::linkFunctions(long functions, bool *ffsEnabled) {
+    ScopedGadgetTrace trace(TRACE_LINK_FUNCTIONS);
     std::string vendorFunctions = getVendorFunctions();
+    std::vector<std::string> keys = linkSegmentKeys(functions, vendorFunctions);
+    size_t kept = mLinkedSegments.size();
+    int i = 0;
+    int start;
 
-    if (vendorFunctions == "dm") {
-        ALOGI("enable usbradio debug functions");
-        if ((functions & GadgetFunction::RNDIS) != 0) {
-            if (linkFunction("acm.gs6", i++))
-                return Status::ERROR;
-            if (linkFunction("dm.gs7", i++))
-                return Status::ERROR;
-        } else {
-            if (linkFunction("dm.gs7", i++))
+    for (const LinkedSegment &segment : mLinkedSegments) {
+        i += segment.links;
+        if (!segment.ffsInstances.empty()) {
+            *ffsEnabled = true;
+            monitorKeptSegment(segment);
+        }
+    }
+    if (kept)
+        ALOGI("kept %d configfs function links", i);
+
+    if (kept <= SEGMENT_GENERIC) {
+        start = i;
+        if (Status(addGenericAndroidFunctions(&monitorFfs, functions, ffsEnabled, &i)) !=
+            Status::SUCCESS)
+            return Status::ERROR;
+        recordLinkedSegment(keys[SEGMENT_GENERIC], start, i);
+    }
+
+    if (kept <= SEGMENT_VENDOR) {
+        start = i;
+        if (vendorFunctions == "dm") {
+            ALOGI("enable usbradio debug functions");
+            if ((functions & GadgetFunction::RNDIS) != 0) {
+                if (linkFunction("acm.gs6", i++))
+                    return Status::ERROR;
+                if (linkFunction("dm.gs7", i++))
+                    return Status::ERROR;
+            } else {
+                if (linkFunction("dm.gs7", i++))
+                    return Status::ERROR;
+                if (linkFunction("acm.gs6", i++))
+                    return Status::ERROR;
+            }
+        } else if (vendorFunctions == "etr_miu") {
+            ALOGI("enable etr_miu functions");
+            if (linkFunction("etr_miu.gs11", i++))
                 return Status::ERROR;
-            if (linkFunction("acm.gs6", i++))
+        } else if (vendorFunctions == "uwb_acm") {
+            ALOGI("enable uwb acm function");
+            if (linkFunction("acm.uwb0", i++))
                 return Status::ERROR;
         }
-    } else if (vendorFunctions == "etr_miu") {
-        ALOGI("enable etr_miu functions");
-        if (linkFunction("etr_miu.gs11", i++))
-            return Status::ERROR;
-    } else if (vendorFunctions == "uwb_acm") {
-        ALOGI("enable uwb acm function");
-        if (linkFunction("acm.uwb0", i++))
-            return Status::ERROR;
+        recordLinkedSegment(keys[SEGMENT_VENDOR], start, i);
     }
 
-    if ((functions & GadgetFunction::ADB) != 0) {
-        ffsEnabled = true;
-        if (Status(addAdb(&monitorFfs, &i)) != Status::SUCCESS)
-            return Status::ERROR;
+    if (kept <= SEGMENT_ADB) {
+        start = i;
+        if ((functions & GadgetFunction::ADB) != 0) {
+            *ffsEnabled = true;
+            if (Status(addAdb(&monitorFfs, &i)) != Status::SUCCESS)
+                return Status::ERROR;
+        }
+        recordLinkedSegment(keys[SEGMENT_ADB], start, i);
     }
 
-    if ((functions & GadgetFunction::NCM) != 0) {
-        ALOGI("setCurrentUsbFunctions ncm");
-        if (linkFunction("ncm.gs9", i++))
-            return Status::ERROR;
+    if (kept <= SEGMENT_NCM) {
+        start = i;
+        if ((functions & GadgetFunction::NCM) != 0) {
+            ALOGI("setCurrentUsbFunctions ncm");
+            if (linkFunction("ncm.gs9", i++))
+                return Status::ERROR;
+        }
+        recordLinkedSegment(keys[SEGMENT_NCM], start, i);
     }
+    return Status::SUCCESS;
+}
+
+Status UsbGadget::setupFunctions(long functions,
+        const shared_ptr<IUsbGadgetCallback> &callback, uint64_t timeout,
+        int64_t in_transactionId) {
+    bool ffsEnabled = false;
+
+    if (linkFunctions(functions, &ffsEnabled) != Status::SUCCESS)
+        return Status::ERROR;
+
+    ScopedGadgetTrace trace(TRACE_PULLUP);
 
     // Pull up the gadget right away when there are no ffs functions.
     if (!ffsEnabled) {
@@ -465,126 +749,68 @@ Status UsbGadget::setupFunctions(long functions,
     return Status::SUCCESS;
 }
 
-int UsbGadget::getI2cBusNumber() {
-    DIR *dp;
-    unsigned int busNumber;
-
-    // Since the i2c bus number doesn't change after boot, we only need to get
-    // it once.
-    if (mI2cBusNumber >= 0) {
-        return mI2cBusNumber;
-    }
-
-    dp = opendir(kHsi2cPath);
-    if (dp != NULL) {
-        struct dirent *ep;
-
-        while ((ep = readdir(dp))) {
-            if (ep->d_type == DT_DIR) {
-                if (sscanf(ep->d_name, "i2c-%u", &busNumber) == 1) {
-                    mI2cBusNumber = busNumber;
-                    break;
-                }
-            }
-        }
-        closedir(dp);
-    }
-
-    if (mI2cBusNumber < 0) {
-        ALOGE("Failed to open %s", kHsi2cPath);
-    }
-    return mI2cBusNumber;
-}
-
-std::string_view UsbGadget::getI2cClientPath() {
-    DIR *dp;
-    char i2cClientPathLabeled[PATH_MAX];
-    char i2cClientPathUnLabeled[PATH_MAX];
-
-    // Since the I2C client path doesn't change after boot, we only need to get
-    // it once.
-    if (!mI2cClientPath.empty()) {
-        return mI2cClientPath;
-    }
-
-    if (getI2cBusNumber() < 0) {
-        return std::string_view{""};
-    }
-
-    snprintf(i2cClientPathLabeled, sizeof(i2cClientPathLabeled),
-             "%s/i2c-%d/%s", kHsi2cPath, mI2cBusNumber,  kMax77759TcpcDevName);
-    snprintf(i2cClientPathUnLabeled, sizeof(i2cClientPathUnLabeled),
-             "%s/i2c-%d/%d-%04x", kHsi2cPath, mI2cBusNumber, mI2cBusNumber,
-             kMax77759TcpcClientId);
-
-    dp = opendir(i2cClientPathLabeled);
-    if (dp != NULL) {
-        mI2cClientPath.assign(i2cClientPathLabeled);
-        closedir(dp);
-        return mI2cClientPath;
-    }
-
-    dp = opendir(i2cClientPathUnLabeled);
-    if (dp != NULL) {
-        mI2cClientPath.assign(i2cClientPathUnLabeled);
-        closedir(dp);
-        return mI2cClientPath;
-    }
-
-    ALOGE("Failed to find the i2c client path under %s", kHsi2cPath);
-    return std::string_view{""};
-}
-
-ScopedAStatus UsbGadget::setCurrentUsbFunctions(long functions,
-                                               const shared_ptr<IUsbGadgetCallback> &callback,
-                                               int64_t timeout,
-                                               int64_t in_transactionId) {
+void UsbGadget::applyUsbFunctions(long functions,
+                                  const shared_ptr<IUsbGadgetCallback> &callback,
+                                  int64_t timeout, int64_t in_transactionId,
+                                  int64_t enqueuedNs) {
     std::unique_lock<std::mutex> lk(mLockSetCurrentFunction);
-    std::string current_usb_power_operation_mode, current_usb_type;
-    std::string usb_limit_sink_enable;
-
-    string accessoryCurrentLimitEnablePath, accessoryCurrentLimitPath;
-    std::string_view i2cPath;
+    bool switched = false;
+    bool hostWasAttached;
+    DisconnectWait disconnectWait = DISCONNECT_WAIT_COUNT;
+
+    beginGadgetSwitchTrace(functions);
+    recordGadgetTrace(TRACE_QUEUE_WAIT, enqueuedNs, LatencyHistogram::now());
+    // Declared before |trace| so that the total is part of the switch record.
+    auto endTrace = make_scope_guard([&] {
+        endGadgetSwitchTrace(switched);
+        if (switched)
+            mSwitchLatency[disconnectWait].record(LatencyHistogram::now() - enqueuedNs);
+    });
+    ScopedGadgetTrace trace(TRACE_SET_FUNCTIONS);
 
     mCurrentUsbFunctions = functions;
     mCurrentUsbFunctionsApplied = false;
 
-    i2cPath = getI2cClientPath();
-    if (!i2cPath.empty()) {
-        accessoryCurrentLimitPath = std::string{i2cPath} + "/" + kAccessoryLimitCurrent;
-        accessoryCurrentLimitEnablePath = std::string{i2cPath} + "/" + kAccessoryLimitCurrentEnable;
-    } else {
-        ALOGE("%s: Unable to locate i2c bus node", __func__);
-    }
-
     // Get the gadget IRQ number before tearDownGadget()
-    if (mGadgetIrqPath.empty())
+    if (mGadgetIrqPath.empty()) {
+        ScopedGadgetTrace irqTrace(TRACE_IRQ_DISCOVERY);
+
         getUsbGadgetIrqPath();
+    }
+
+    // The udc state is only meaningful while the gadget is still bound.
+    hostWasAttached = hostAttached();
 
     // Unlink the gadget and stop the monitor if running.
-    Status status = tearDownGadget();
+    Status status = tearDownGadget(reusableSegments(functions));
     if (status != Status::SUCCESS) {
         goto error;
     }
 
-    ALOGI("Returned from tearDown gadget");
-
     // Leave the gadget pulled down to give time for the host to sense disconnect.
-    usleep(kDisconnectWaitUs);
+    {
+        ScopedGadgetTrace waitTrace(TRACE_DISCONNECT_WAIT);
+
+        disconnectWait = waitForDisconnect(hostWasAttached);
+    }
+    ALOGI("Returned from tearDown gadget, disconnect wait %s",
+          kDisconnectWaitNames[disconnectWait]);
 
     if (functions == GadgetFunction::NONE) {
+        switched = true;
         if (callback == NULL)
-            return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "callback == NULL");
+            return;
         ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions, Status::SUCCESS, in_transactionId);
         if (!ret.isOk())
             ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.getDescription().c_str());
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Error while calling setCurrentUsbFunctionsCb");
+        return;
     }
 
-    status = validateAndSetVidPid(functions);
+    {
+        ScopedGadgetTrace vidPidTrace(TRACE_VID_PID);
 
+        status = validateAndSetVidPid(functions);
+    }
     if (status != Status::SUCCESS) {
         goto error;
     }
@@ -594,56 +820,113 @@ ScopedAStatus UsbGadget::setCurrentUsbFunctions(long functions,
         goto error;
     }
 
-    if (functions & GadgetFunction::NCM) {
-        if (!mGadgetIrqPath.empty()) {
-            if (!WriteStringToFile(BIG_CORE, mGadgetIrqPath))
-                ALOGI("Cannot move gadget IRQ to big core, path:%s", mGadgetIrqPath.c_str());
-        }
-    } else {
-        if (!mGadgetIrqPath.empty()) {
-            if (!WriteStringToFile(MEDIUM_CORE, mGadgetIrqPath))
-                ALOGI("Cannot move gadget IRQ to medium core, path:%s", mGadgetIrqPath.c_str());
-        }
+    {
+        ScopedGadgetTrace irqTrace(TRACE_IRQ_AFFINITY);
+
+        mIrqGovernor.setFunctions(functions, mGadgetIrq);
     }
+    updateAccessoryCurrentLimit(functions);
 
-    if (ReadFileToString(CURRENT_USB_TYPE_PATH, &current_usb_type))
+    switched = true;
+    ALOGI("Usb Gadget setcurrent functions called successfully");
+    return;
+
+error:
+    ALOGI("Usb Gadget setcurrent functions failed");
+    // Whatever got linked is unknown, relink everything next time.
+    mLinkedSegments.clear();
+    if (callback == NULL)
+        return;
+    ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions, status, in_transactionId);
+    if (!ret.isOk())
+        ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.getDescription().c_str());
+}
+
+void UsbGadget::updateAccessoryCurrentLimit(long functions) {
+    ScopedGadgetTrace trace(TRACE_CURRENT_LIMIT);
+    std::string current_usb_power_operation_mode, current_usb_type;
+    SysfsAttribute *accessoryCurrentLimitEnable, *accessoryCurrentLimit;
+
+    accessoryCurrentLimit = mI2cClient.attribute(kAccessoryLimitCurrent);
+    accessoryCurrentLimitEnable = mI2cClient.attribute(kAccessoryLimitCurrentEnable);
+    if (accessoryCurrentLimit == NULL)
+        ALOGE("%s: Unable to locate i2c bus node", __func__);
+
+    if (ReadFileToString(sysfsPath(CURRENT_USB_TYPE_PATH), &current_usb_type))
         current_usb_type = Trim(current_usb_type);
 
-    if (ReadFileToString(CURRENT_USB_POWER_OPERATION_MODE_PATH, &current_usb_power_operation_mode))
+    if (ReadFileToString(sysfsPath(CURRENT_USB_POWER_OPERATION_MODE_PATH), &current_usb_power_operation_mode))
         current_usb_power_operation_mode = Trim(current_usb_power_operation_mode);
 
     if (functions & GadgetFunction::ACCESSORY &&
         current_usb_type == "Unknown SDP [CDP] DCP" &&
         (current_usb_power_operation_mode == "default" ||
         current_usb_power_operation_mode == "1.5A")) {
-        if (accessoryCurrentLimitPath.empty() || !WriteStringToFile("1300000", accessoryCurrentLimitPath)) {
+        if (accessoryCurrentLimit == NULL || !accessoryCurrentLimit->write("1300000")) {
             ALOGI("Write 1.3A to limit current fail");
         } else {
-            if (accessoryCurrentLimitEnablePath.empty() ||
-                !WriteStringToFile("1", accessoryCurrentLimitEnablePath)) {
+            if (accessoryCurrentLimitEnable == NULL || !accessoryCurrentLimitEnable->write("1")) {
                 ALOGI("Enable limit current fail");
             }
         }
     } else {
-        if (accessoryCurrentLimitEnablePath.empty() ||
-            !WriteStringToFile("0", accessoryCurrentLimitEnablePath))
+        if (accessoryCurrentLimitEnable == NULL || !accessoryCurrentLimitEnable->write("0"))
             ALOGI("unvote accessory limit current failed");
     }
+}
 
-    ALOGI("Usb Gadget setcurrent functions called successfully");
+/*
+ * Switches run on mCommandQueue so that the binder thread is not held while
+ * the ffs daemons write their descriptors. A request still waiting in the
+ * queue when a newer one arrives is never applied, its callback reports an
+ * error instead.
+ */
+ScopedAStatus UsbGadget::setCurrentUsbFunctions(long functions,
+                                               const shared_ptr<IUsbGadgetCallback> &callback,
+                                               int64_t timeout,
+                                               int64_t in_transactionId) {
+    int64_t enqueuedNs = LatencyHistogram::now();
+
+    mCommandQueue.enqueueSuperseding(
+            "setCurrentUsbFunctions",
+            [this, functions, callback, timeout, in_transactionId, enqueuedNs] {
+                applyUsbFunctions(functions, callback, timeout, in_transactionId, enqueuedNs);
+            },
+            [functions, callback, in_transactionId] {
+                ALOGI("setCurrentUsbFunctions %ld superseded", functions);
+                if (callback == NULL)
+                    return;
+                ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions, Status::ERROR,
+                                                                       in_transactionId);
+                if (!ret.isOk())
+                    ALOGE("Error while calling setCurrentUsbFunctionsCb %s",
+                          ret.getDescription().c_str());
+            });
     return ScopedAStatus::ok();
+}
 
-error:
-    ALOGI("Usb Gadget setcurrent functions failed");
-    if (callback == NULL)
-        return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Usb Gadget setcurrent functions failed");
-    ScopedAStatus ret = callback->setCurrentUsbFunctionsCb(functions, status, in_transactionId);
-    if (!ret.isOk())
-        ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.getDescription().c_str());
-    return ScopedAStatus::fromServiceSpecificErrorWithMessage(
-                -1, "Error while calling setCurrentUsbFunctionsCb");
+binder_status_t UsbGadget::dump(int fd, const char ** /* args */, uint32_t /* numArgs */) {
+    dumpGadgetTrace(fd);
+    dprintf(fd, "disconnect wait latency (udc detach wait %s):\n",
+            udcDetachWait() ? "on" : "off");
+    for (int i = 0; i < DISCONNECT_WAIT_COUNT; i++)
+        mDisconnectWaitLatency[i].dump(fd, kDisconnectWaitNames[i]);
+    dprintf(fd, "function switch latency from request to done, by disconnect wait:\n");
+    for (int i = 0; i < DISCONNECT_WAIT_COUNT; i++)
+        mSwitchLatency[i].dump(fd, kDisconnectWaitNames[i]);
+    dprintf(fd, "function switches by configfs segments kept (incremental relink %s):",
+            incrementalRelink() ? "on" : "off");
+    for (int i = 0; i <= SEGMENT_COUNT; i++)
+        dprintf(fd, " %d:%" PRIu64, i, mKeptSegmentSwitches[i].load());
+    dprintf(fd, "\n");
+    mUdcState.dump(fd);
+    mVbusPresent.dump(fd);
+    mSpeedTracker.dump(fd);
+    mIrqGovernor.dump(fd);
+    mCommandQueue.dump(fd);
+    return STATUS_OK;
 }
+
 }  // namespace gadget
 }  // namespace usb
 }  // namespace hardware
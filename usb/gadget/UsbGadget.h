@@ -31,11 +31,21 @@
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <utils/Log.h>
+#include <I2cClientResolver.h>
+#include "GadgetTrace.h"
+#include "IrqAffinityGovernor.h"
+#include "UsbSpeedTracker.h"
+#include <LatencyHistogram.h>
+#include <SysfsAttribute.h>
+#include <UsbCommandQueue.h>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace aidl {
 namespace android {
@@ -64,41 +74,52 @@ using ::android::hardware::google::pixel::usb::linkFunction;
 using ::android::hardware::google::pixel::usb::MonitorFfs;
 using ::android::hardware::google::pixel::usb::resetGadget;
 using ::android::hardware::google::pixel::usb::setVidPid;
-using ::android::hardware::google::pixel::usb::unlinkFunctions;
 using ::ndk::ScopedAStatus;
 using ::std::shared_ptr;
 using ::std::string;
 
 constexpr char kGadgetName[] = "11110000.dwc3";
-constexpr char kProcInterruptsPath[] = "/proc/interrupts";
-constexpr char kProcIrqPath[] = "/proc/irq/";
-constexpr char kSmpAffinityList[] = "/smp_affinity_list";
 #ifndef UDC_PATH
 #define UDC_PATH "/sys/class/udc/11110000.dwc3/"
 #endif
 static MonitorFfs monitorFfs(kGadgetName);
+// Mount points of the functionfs instances, named after the instance of the ffs.<instance> function.
+constexpr char kFfsPath[] = "/dev/usb-ffs/";
 
 #define SPEED_PATH UDC_PATH "current_speed"
-
-#define BIG_CORE "6"
-#define MEDIUM_CORE "4"
+#define UDC_STATE_PATH UDC_PATH "state"
 
 #define POWER_SUPPLY_PATH	"/sys/class/power_supply/usb/"
 #define USB_PORT0_PATH		"/sys/class/typec/port0/"
 
 #define CURRENT_MAX_PATH			POWER_SUPPLY_PATH	"current_max"
+#define VBUS_PRESENT_PATH			POWER_SUPPLY_PATH	"present"
 #define CURRENT_USB_TYPE_PATH			POWER_SUPPLY_PATH	"usb_type"
 #define CURRENT_USB_POWER_OPERATION_MODE_PATH	USB_PORT0_PATH		"power_operation_mode"
 
+/*
+ * How function switches shortcut the full teardown and relink. Each part
+ * left unset follows its property, read at every switch.
+ */
+struct SwitchPolicy {
+    // Waits for the udc to detach instead of a fixed sleep, see kFastSwitchProp.
+    std::optional<bool> udcDetachWait;
+    // Keeps the unchanged leading configfs segments linked, see kIncrementalRelinkProp.
+    std::optional<bool> incrementalRelink;
+};
+
 struct UsbGadget : public BnUsbGadget {
-    UsbGadget();
+    // |policy| overrides the switch properties, e.g. for tests.
+    explicit UsbGadget(SwitchPolicy policy = {});
 
     // Makes sure that only one request is processed at a time.
     std::mutex mLockSetCurrentFunction;
     std::string mGadgetIrqPath;
-    long mCurrentUsbFunctions;
-    bool mCurrentUsbFunctionsApplied;
-    UsbSpeed mUsbSpeed;
+    // Number of the dwc3 IRQ, 0 until found
+    unsigned int mGadgetIrq;
+    // Set by the command queue worker, read from binder threads
+    std::atomic<long> mCurrentUsbFunctions;
+    std::atomic<bool> mCurrentUsbFunctionsApplied;
 
     ScopedAStatus setCurrentUsbFunctions(long functions,
             const shared_ptr<IUsbGadgetCallback> &callback,
@@ -119,16 +140,96 @@ struct UsbGadget : public BnUsbGadget {
     // set SDP timeout to a lower value.
     void updateSdpEnumTimeout();
 
-    int getI2cBusNumber();
-    std::string_view getI2cClientPath();
+    binder_status_t dump(int fd, const char **args, uint32_t numArgs) override;
 
   private:
-    int mI2cBusNumber;
-    std::string mI2cClientPath;
-    Status tearDownGadget();
+    // Outcome of the wait for the host to sense the disconnect during a function switch.
+    enum DisconnectWait {
+        // Full kDisconnectWaitUs sleep, udc detach wait disabled.
+        DISCONNECT_WAIT_FIXED,
+        // No VBUS or the udc was not attached, nobody to notify.
+        DISCONNECT_WAIT_SKIPPED,
+        // "not attached" within kDisconnectWaitUs, held for at least kMinDisconnectWaitUs.
+        DISCONNECT_WAIT_DETACHED,
+        // The udc state did not change within kDisconnectWaitUs.
+        DISCONNECT_WAIT_TIMEOUT,
+        DISCONNECT_WAIT_COUNT,
+    };
+
+    bool udcDetachWait();
+    bool incrementalRelink();
+    // False when VBUS is off or the udc reports no host, sampled before the gadget is torn down.
+    bool hostAttached();
+    // Waits up to |timeoutUs| for the udc state to become "not attached", true if it did.
+    bool waitForUdcDetach(int64_t timeoutUs);
+    DisconnectWait waitForDisconnect(bool hostWasAttached);
+
+    /*
+     * setupFunctions() links the configfs functions in four segments, each
+     * created by one helper and always in this order. A function switch keeps
+     * the leading segments that are unchanged and only relinks the rest, which
+     * keeps the interface order the host sees identical to a full relink.
+     */
+    enum LinkSegment {
+        // MTP/PTP/MIDI/ACCESSORY/AUDIO_SOURCE/RNDIS/UVC from addGenericAndroidFunctions
+        SEGMENT_GENERIC,
+        // Functions selected by the vendor functions property
+        SEGMENT_VENDOR,
+        SEGMENT_ADB,
+        SEGMENT_NCM,
+        SEGMENT_COUNT,
+    };
+    struct LinkedSegment {
+        // Describes what was requested for the segment, see linkSegmentKeys()
+        std::string key;
+        // Number of function<N> links of the segment
+        int links;
+        // Instances of the ffs functions linked, e.g. "mtp" for ffs.mtp
+        std::vector<std::string> ffsInstances;
+        // kDeviceAttributes once the segment was linked, "" when unreadable
+        std::vector<std::string> deviceAttributes;
+    };
+
+    static std::vector<std::string> linkSegmentKeys(long functions,
+                                                    const std::string &vendorFunctions);
+    // Number of leading entries of mLinkedSegments a switch to |functions| can keep.
+    size_t reusableSegments(long functions);
+    // Appends the segment made of the links [start, end) to mLinkedSegments.
+    void recordLinkedSegment(const std::string &key, int start, int end);
+    // Hands the ffs functions of a kept segment back to monitorFfs, which was reset.
+    void monitorKeptSegment(const LinkedSegment &segment);
+
+    const SwitchPolicy mSwitchPolicy;
+    // TCPC i2c client, there is no uevent source here so lookups retry on a timer.
+    I2cClientResolver mI2cClient;
+    SysfsAttribute mUdcState;
+    SysfsAttribute mVbusPresent;
+    UsbSpeedTracker mSpeedTracker;
+    // Time spent waiting for the host to sense the disconnect, per outcome
+    LatencyHistogram mDisconnectWaitLatency[DISCONNECT_WAIT_COUNT];
+    // Whole successful switches from setCurrentUsbFunctions(), per disconnect wait outcome
+    LatencyHistogram mSwitchLatency[DISCONNECT_WAIT_COUNT];
+    // Segments currently linked in configfs, cleared whenever their state is uncertain
+    std::vector<LinkedSegment> mLinkedSegments;
+    // Count of switches per number of segments kept
+    std::atomic<uint64_t> mKeptSegmentSwitches[SEGMENT_COUNT + 1];
+    IrqAffinityGovernor mIrqGovernor;
+    // Runs the function switches, declared last so its worker stops before the rest goes away
+    UsbCommandQueue mCommandQueue;
+    // Body of setCurrentUsbFunctions(), run on mCommandQueue, |enqueuedNs| is when it was queued.
+    void applyUsbFunctions(long functions, const shared_ptr<IUsbGadgetCallback> &callback,
+                           int64_t timeout, int64_t in_transactionId, int64_t enqueuedNs);
+    // Body of reset(), run on mCommandQueue.
+    Status applyReset();
+    // Unlinks every function except those of the first |keptSegments| segments.
+    Status tearDownGadget(size_t keptSegments);
     Status getUsbGadgetIrqPath();
+    // Links the segments of |functions| not kept, sets |ffsEnabled| if any is an ffs function.
+    Status linkFunctions(long functions, bool *ffsEnabled);
     Status setupFunctions(long functions, const shared_ptr<IUsbGadgetCallback> &callback,
             uint64_t timeout, int64_t in_transactionId);
+    // Limits the current drawn as an accessory on SDP/CDP/DCP ports, unvotes otherwise.
+    void updateAccessoryCurrentLimit(long functions);
 };
 
 }  // namespace gadget
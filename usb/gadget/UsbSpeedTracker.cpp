@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.gadget.aidl-service.UsbSpeedTracker"
+
+#include "UsbSpeedTracker.h"
+
+#include <LatencyHistogram.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <cctype>
+#include <cinttypes>
+#include <cstring>
+#include <string_view>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+static const struct {
+    const char *name;
+    UsbSpeed speed;
+} kSpeeds[] = {
+    {"low-speed", UsbSpeed::LOWSPEED},
+    {"full-speed", UsbSpeed::FULLSPEED},
+    {"high-speed", UsbSpeed::HIGHSPEED},
+    {"super-speed", UsbSpeed::SUPERSPEED},
+    {"super-speed-plus", UsbSpeed::SUPERSPEED_10Gb},
+};
+
+static UsbSpeed parseSpeed(std::string_view name) {
+    for (const auto &entry : kSpeeds) {
+        if (name == entry.name)
+            return entry.speed;
+    }
+    return UsbSpeed::UNKNOWN;
+}
+
+static const char *speedName(UsbSpeed speed) {
+    for (const auto &entry : kSpeeds) {
+        if (speed == entry.speed)
+            return entry.name;
+    }
+    return "UNKNOWN";
+}
+
+UsbSpeedTracker::UsbSpeedTracker(const std::string &statePath, const std::string &speedPath)
+    : mStatePath(sysfsPath(statePath)),
+      mCurrentSpeed(speedPath),
+      mEventFd(eventfd(0, EFD_CLOEXEC)),
+      mSpeed(UsbSpeed::UNKNOWN),
+      mLinkSpeed(UsbSpeed::UNKNOWN),
+      mLinkLostNs(0),
+      mSpeedChanges(0),
+      mDowngradeCount(0) {
+    if (mEventFd.get() == -1) {
+        ALOGE("eventfd failed: %s", strerror(errno));
+        abort();
+    }
+    // Valid before the first getUsbSpeed() can come in.
+    update();
+    if (pthread_create(&mThread, NULL, this->trackerThread, this)) {
+        ALOGE("pthread creation failed %d", errno);
+        abort();
+    }
+}
+
+UsbSpeedTracker::~UsbSpeedTracker() {
+    uint64_t value = 1;
+
+    if (TEMP_FAILURE_RETRY(write(mEventFd.get(), &value, sizeof(value))) != sizeof(value))
+        ALOGE("%s: eventfd write failed: %s", __func__, strerror(errno));
+    pthread_join(mThread, NULL);
+}
+
+void UsbSpeedTracker::update() {
+    char buf[32];
+    std::string_view value;
+    std::string state = "unavailable";
+    UsbSpeed speed = UsbSpeed::UNKNOWN;
+    int64_t now = LatencyHistogram::now();
+
+    if (mStateFd.get() == -1)
+        mStateFd.reset(open(mStatePath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (mStateFd.get() != -1) {
+        // Also re-arms POLLPRI.
+        ssize_t len = TEMP_FAILURE_RETRY(pread(mStateFd.get(), buf, sizeof(buf) - 1, 0));
+
+        if (len < 0) {
+            ALOGE("%s: read %s failed: %s", __func__, mStatePath.c_str(), strerror(errno));
+            // Likely the udc went away, reopened on the next attempt.
+            mStateFd.reset();
+        } else {
+            while (len > 0 && isspace(static_cast<unsigned char>(buf[len - 1])))
+                len--;
+            state.assign(buf, len);
+        }
+    }
+    if (mCurrentSpeed.read(buf, sizeof(buf), &value))
+        speed = parseSpeed(value);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    UsbSpeed previous = mSpeed.load(std::memory_order_relaxed);
+
+    mState = state;
+    if (speed == previous)
+        return;
+
+    mSpeedChanges++;
+    mSpeed.store(speed, std::memory_order_relaxed);
+    ALOGI("USB speed %s -> %s, udc %s", speedName(previous), speedName(speed), state.c_str());
+
+    if (speed == UsbSpeed::UNKNOWN) {
+        mLinkLostNs = now;
+        return;
+    }
+    if (mLinkSpeed != UsbSpeed::UNKNOWN && speed < mLinkSpeed &&
+        (mLinkLostNs == 0 || now - mLinkLostNs < kDowngradeWindowMs * 1000000)) {
+        ALOGW("USB speed downgraded from %s to %s", speedName(mLinkSpeed), speedName(speed));
+        mDowngrades[mDowngradeCount++ % kDowngradeCapacity] = {now, mLinkSpeed, speed};
+    }
+    mLinkSpeed = speed;
+    mLinkLostNs = 0;
+}
+
+void *UsbSpeedTracker::trackerThread(void *param) {
+    UsbSpeedTracker *tracker = (UsbSpeedTracker *)param;
+
+    while (true) {
+        struct pollfd fds[] = {
+            {.fd = tracker->mEventFd.get(), .events = POLLIN},
+            {.fd = tracker->mStateFd.get(), .events = POLLPRI},
+        };
+        bool opened = tracker->mStateFd.get() != -1;
+
+        if (TEMP_FAILURE_RETRY(poll(fds, opened ? 2 : 1, opened ? -1 : kReopenIntervalMs)) < 0) {
+            ALOGE("%s: poll failed: %s", __func__, strerror(errno));
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            break;
+        // A notification, or time to retry opening the state attribute.
+        tracker->update();
+    }
+    return NULL;
+}
+
+void UsbSpeedTracker::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    uint64_t first = mDowngradeCount > kDowngradeCapacity ? mDowngradeCount - kDowngradeCapacity : 0;
+
+    dprintf(fd, "usb speed: %s udc state: %s changes:%" PRIu64 "\n", speedName(speed()),
+            mState.c_str(), mSpeedChanges);
+    mCurrentSpeed.dump(fd);
+    // Seconds of CLOCK_MONOTONIC, as printed by logcat -v monotonic.
+    dprintf(fd, "  speed downgrades (monotonic s): %" PRIu64 "\n", mDowngradeCount);
+    for (uint64_t i = first; i < mDowngradeCount; i++) {
+        const Downgrade &downgrade = mDowngrades[i % kDowngradeCapacity];
+
+        dprintf(fd, "  %" PRId64 ".%03" PRId64 " %s -> %s\n", downgrade.timestampNs / 1000000000,
+                downgrade.timestampNs / 1000000 % 1000, speedName(downgrade.from),
+                speedName(downgrade.to));
+    }
+}
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
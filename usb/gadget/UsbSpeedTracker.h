@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <SysfsAttribute.h>
+#include <aidl/android/hardware/usb/gadget/UsbSpeed.h>
+#include <android-base/unique_fd.h>
+#include <pthread.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+using ::aidl::android::hardware::usb::gadget::UsbSpeed;
+using ::android::base::unique_fd;
+
+/*
+ * Keeps the link speed of the udc up to date in the background.
+ *
+ * The udc core notifies its state attribute on every transition, and the
+ * speed is final by the time the host addresses the gadget. A thread waits
+ * for POLLPRI on the state attribute and re-reads current_speed on each
+ * notification, so speed() is an atomic load.
+ *
+ * A link coming up slower than the previous one, either directly or within
+ * kDowngradeWindowMs of losing it, is recorded as a downgrade, e.g. a
+ * SuperSpeed link falling back to High-Speed on a marginal cable or dock.
+ */
+class UsbSpeedTracker {
+  public:
+    static constexpr int64_t kDowngradeWindowMs = 5000;
+    // Interval between attempts to open the state attribute while the udc is missing
+    static constexpr int kReopenIntervalMs = 1000;
+    static constexpr size_t kDowngradeCapacity = 16;
+
+    UsbSpeedTracker(const std::string &statePath, const std::string &speedPath);
+    ~UsbSpeedTracker();
+
+    UsbSpeed speed() const { return mSpeed.load(std::memory_order_relaxed); }
+    // Prints the current state and speed, and the recent downgrades.
+    void dump(int fd);
+
+  private:
+    struct Downgrade {
+        // CLOCK_MONOTONIC
+        int64_t timestampNs;
+        UsbSpeed from;
+        UsbSpeed to;
+    };
+
+    static void *trackerThread(void *param);
+    // Re-reads the state and the speed, records a downgrade if there is one.
+    void update();
+
+    const std::string mStatePath;
+    // POLLPRI needs an fd that was read since the last notification, not a shared SysfsAttribute.
+    unique_fd mStateFd;
+    SysfsAttribute mCurrentSpeed;
+    // Wakes the thread up to exit
+    unique_fd mEventFd;
+    pthread_t mThread;
+    std::atomic<UsbSpeed> mSpeed;
+
+    // Protects everything below
+    std::mutex mLock;
+    std::string mState;
+    // Speed of the last link that came up, and when it went down, 0 while up
+    UsbSpeed mLinkSpeed;
+    int64_t mLinkLostNs;
+    uint64_t mSpeedChanges;
+    std::array<Downgrade, kDowngradeCapacity> mDowngrades;
+    uint64_t mDowngradeCount;
+};
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/usb/gadget/BnUsbGadgetCallback.h>
+#include <android-base/file.h>
+#include <android-base/properties.h>
+#include <dirent.h>
+#include <pixelusb/UsbGadgetAidlCommon.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <SysfsAttribute.h>
+#include "IrqAffinityGovernor.h"
+#include "UsbGadget.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+
+using ::aidl::android::hardware::usb::gadget::BnUsbGadgetCallback;
+using ::android::base::GetExecutableDirectory;
+using ::android::base::GetProperty;
+using ::android::base::TemporaryDir;
+
+constexpr char kRndisConfigProp[] = "vendor.usb.rndis.config";
+// /proc/interrupts of a gs101, where the dwc3 IRQ is kDwc3Irq
+constexpr char kInterruptsFixture[] = "/tests/data/gs101_proc_interrupts.txt";
+constexpr unsigned int kDwc3Irq = 459;
+// Given to setCurrentUsbFunctions(), the ffs functions are pulled up well before.
+constexpr int64_t kSwitchTimeoutMs = 2000;
+
+// The ffs functions the HAL links, with the endpoints their daemon brings up besides ep0.
+struct FfsFunction {
+    long function;
+    const char *instance;
+    int endpoints;
+};
+constexpr FfsFunction kFfsFunctions[] = {
+    {GadgetFunction::MTP, "mtp", 3},
+    {GadgetFunction::PTP, "ptp", 3},
+    {GadgetFunction::ADB, "adb", 2},
+};
+
+/*
+ * configfs, sysfs, procfs and the functionfs mount points of a gs101 below a
+ * temporary sysfs root, with nothing attached to the udc. libpixelusb uses
+ * absolute paths, so the fake gadget and functionfs are also bind mounted over
+ * GADGET_PATH and kFfsPath, in a mount namespace of the test process only.
+ * configfs symlinks and attribute writes behave the same on tmpfs, the only
+ * difference the HAL sees is that writes do not truncate, so every attribute
+ * is rewritten whole.
+ */
+class FakeGadgetTree {
+  public:
+    FakeGadgetTree() {
+        std::string rndis = GetProperty(kRndisConfigProp, "gsi.rndis");
+        std::string interrupts;
+
+        for (const char *function : {"ffs.mtp", "ffs.ptp", "ffs.adb", "midi.gs5", "accessory.gs2",
+                                     "audio_source.gs3", "uvc.0", "acm.gs6", "dm.gs7",
+                                     "etr_miu.gs11", "acm.uwb0", "ncm.gs9"})
+            makeDirs(std::string(FUNCTIONS_PATH) + function);
+        makeDirs(std::string(FUNCTIONS_PATH) + rndis);
+        makeDirs(CONFIG_PATH);
+        makeDirs(OS_DESC_PATH);
+        for (const char *attribute : {VENDOR_ID_PATH, PRODUCT_ID_PATH, DEVICE_CLASS_PATH,
+                                      DEVICE_SUB_CLASS_PATH, DEVICE_PROTOCOL_PATH, DESC_USE_PATH})
+            write(attribute, "0");
+        write(PULLUP_PATH, "none");
+
+        write(UDC_STATE_PATH, "not attached");
+        write(SPEED_PATH, "UNKNOWN");
+        write(VBUS_PRESENT_PATH, "0");
+        write(CURRENT_USB_TYPE_PATH, "[SDP] CDP DCP");
+        write(CURRENT_USB_POWER_OPERATION_MODE_PATH, "default");
+
+        if (!ReadFileToString(GetExecutableDirectory() + kInterruptsFixture, &interrupts))
+            abort();
+        write(kProcInterruptsPath, interrupts);
+        write(kProcIrqPath + std::to_string(kDwc3Irq) + kSmpAffinityList, "0-3");
+
+        for (const FfsFunction &ffs : kFfsFunctions)
+            write(std::string(kFfsPath) + ffs.instance + "/ep0", "");
+
+        unshareMounts();
+        for (const char *path : kMountedPaths) {
+            if (mount(rooted(path).c_str(), path, NULL, MS_BIND, NULL))
+                abort();
+        }
+        setSysfsRoot(mRoot.path);
+    }
+
+    ~FakeGadgetTree() {
+        setSysfsRoot("");
+        for (const char *path : kMountedPaths)
+            umount2(path, MNT_DETACH);
+    }
+
+    // Targets of the function<N> links of the configuration, "" where an index is missing.
+    std::vector<std::string> linkedFunctions() {
+        std::unique_ptr<DIR, int (*)(DIR *)> config(opendir(rooted(CONFIG_PATH).c_str()), closedir);
+        std::map<unsigned int, std::string> links;
+        std::vector<std::string> functions;
+        struct dirent *entry;
+        unsigned int index;
+
+        while (config && (entry = readdir(config.get())) != NULL) {
+            std::string target = linkTarget(std::string(CONFIG_PATH) + entry->d_name);
+
+            if (!strncmp(entry->d_name, FUNCTION_NAME, strlen(FUNCTION_NAME)) &&
+                ParseUint(entry->d_name + strlen(FUNCTION_NAME), &index))
+                links[index] = target.substr(target.rfind('/') + 1);
+        }
+        for (const auto &[linkIndex, function] : links) {
+            functions.resize(linkIndex);
+            functions.push_back(function);
+        }
+        return functions;
+    }
+
+    // Full path the link below the root points to, "" if it is not a link.
+    std::string linkTarget(const std::string &path) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(rooted(path).c_str(), target, sizeof(target) - 1);
+
+        return len < 0 ? "" : std::string(target, len);
+    }
+
+    std::string read(const std::string &path) {
+        std::string value;
+
+        ReadFileToString(rooted(path), &value);
+        return Trim(value);
+    }
+
+    void write(const std::string &path, const std::string &value) {
+        makeDirs(path.substr(0, path.rfind('/')));
+        WriteStringToFile(value, rooted(path));
+    }
+
+    void remove(const std::string &path) { unlink(rooted(path).c_str()); }
+
+  private:
+    // The paths libpixelusb opens, covered by their counterpart below the root
+    static constexpr const char *kMountedPaths[] = {GADGET_PATH, kFfsPath};
+
+    // Moves the process to a mount namespace of its own, where mounts do not propagate back.
+    static void unshareMounts() {
+        static const bool unshared = [] {
+            return !unshare(CLONE_NEWNS) && !mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL);
+        }();
+
+        if (!unshared)
+            abort();
+    }
+
+    std::string rooted(const std::string &path) { return mRoot.path + path; }
+
+    void makeDirs(const std::string &path) {
+        std::string dir = rooted(path);
+
+        for (size_t slash = dir.find('/', strlen(mRoot.path) + 1); slash != std::string::npos;
+             slash = dir.find('/', slash + 1))
+            mkdir(dir.substr(0, slash).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+    }
+
+    TemporaryDir mRoot;
+};
+
+// Collects the results of setCurrentUsbFunctions() by transaction id.
+class SwitchCallback : public BnUsbGadgetCallback {
+  public:
+    ScopedAStatus setCurrentUsbFunctionsCb(int64_t /* functions */, Status status,
+                                           int64_t transactionId) override {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mResults[transactionId] = status;
+        mCV.notify_all();
+        return ScopedAStatus::ok();
+    }
+
+    ScopedAStatus getCurrentUsbFunctionsCb(int64_t, Status, int64_t) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus getUsbSpeedCb(UsbSpeed, int64_t) override { return ScopedAStatus::ok(); }
+    ScopedAStatus resetCb(Status, int64_t) override { return ScopedAStatus::ok(); }
+
+    // Result of |transactionId|, ERROR if it is not reported within |timeoutMs|.
+    Status waitFor(int64_t transactionId, int64_t timeoutMs) {
+        std::unique_lock<std::mutex> lock(mLock);
+
+        if (!mCV.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                          [&] { return mResults.count(transactionId); }))
+            return Status::ERROR;
+        return mResults[transactionId];
+    }
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCV;
+    std::map<int64_t, Status> mResults;
+};
+
+/*
+ * UsbGadget on a FakeGadgetTree, with the ffs daemons played by the harness:
+ * a daemon is started when its function gets linked and stopped when its
+ * function is no longer requested, like init does for adbd and mtp through
+ * sys.usb.config. Starting means writing the descriptors, after which the
+ * kernel creates the endpoints, which is all the pull up waits for.
+ */
+class GadgetHarness {
+  public:
+    // Time a daemon takes from its function being linked to its descriptors being written
+    static constexpr int64_t kDaemonStartUs = 5000;
+
+    explicit GadgetHarness(SwitchPolicy policy)
+        : mGadget(ndk::SharedRefBase::make<UsbGadget>(policy)),
+          mCallback(ndk::SharedRefBase::make<SwitchCallback>()),
+          mTransactionId(0) {}
+
+    ~GadgetHarness() {
+        // Stops the command queue and the monitor before the tree goes away.
+        switchTo(GadgetFunction::NONE);
+        mGadget.reset();
+    }
+
+    FakeGadgetTree &tree() { return mTree; }
+
+    /*
+     * Switches to |functions| as the framework would and returns the reported
+     * status. With |startDaemons| false the daemons of the newly linked ffs
+     * functions are left for the caller to start.
+     */
+    Status switchTo(long functions, int64_t timeoutMs = kSwitchTimeoutMs,
+                    bool startDaemons = true) {
+        int64_t transactionId = ++mTransactionId;
+
+        for (const FfsFunction &ffs : kFfsFunctions) {
+            if (!(functions & ffs.function))
+                stopDaemon(ffs);
+        }
+        mGadget->setCurrentUsbFunctions(functions, mCallback, timeoutMs, transactionId);
+        for (const FfsFunction &ffs : kFfsFunctions) {
+            if (startDaemons && (functions & ffs.function) && !mRunning.count(ffs.instance) &&
+                waitForLink(std::string("ffs.") + ffs.instance)) {
+                usleep(kDaemonStartUs);
+                startDaemon(ffs);
+            }
+        }
+        return mCallback->waitFor(transactionId, timeoutMs + kSwitchTimeoutMs);
+    }
+
+    void startDaemon(const FfsFunction &ffs) {
+        std::string instanceDir = std::string(kFfsPath) + ffs.instance + "/";
+
+        // The descriptors and strings the daemon writes to ep0, then the endpoints the kernel adds.
+        mTree.write(instanceDir + "ep0", "descriptors strings");
+        for (int i = 1; i <= ffs.endpoints; i++)
+            mTree.write(instanceDir + "ep" + std::to_string(i), "");
+        mRunning.insert(ffs.instance);
+    }
+
+    void stopDaemon(const FfsFunction &ffs) {
+        std::string instanceDir = std::string(kFfsPath) + ffs.instance + "/";
+
+        for (int i = 1; i <= ffs.endpoints; i++)
+            mTree.remove(instanceDir + "ep" + std::to_string(i));
+        mRunning.erase(ffs.instance);
+    }
+
+  private:
+    // Waits for |function| to be linked, false if it is not within kSwitchTimeoutMs.
+    bool waitForLink(const std::string &function) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kSwitchTimeoutMs);
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            for (const std::string &linked : mTree.linkedFunctions()) {
+                if (linked == function)
+                    return true;
+            }
+            usleep(1000);
+        }
+        return false;
+    }
+
+    // Declared first so that it is there for the whole life of the gadget
+    FakeGadgetTree mTree;
+    std::shared_ptr<UsbGadget> mGadget;
+    std::shared_ptr<SwitchCallback> mCallback;
+    int64_t mTransactionId;
+    // Instances whose daemon wrote its descriptors
+    std::set<std::string> mRunning;
+};
+
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
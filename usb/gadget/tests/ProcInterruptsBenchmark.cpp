@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <benchmark/benchmark.h>
+#include <sys/stat.h>
+
+#include <cstdlib>
+#include <string>
+
+#include <SysfsAttribute.h>
+#include "ProcInterrupts.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+namespace {
+
+using ::android::base::GetExecutableDirectory;
+using ::android::base::ParseUint;
+using ::android::base::ReadFileToString;
+using ::android::base::Split;
+using ::android::base::TemporaryDir;
+using ::android::base::Trim;
+using ::android::base::WriteStringToFile;
+
+/*
+ * /proc/interrupts of a gs101 with 8 cpus and the dwc3 IRQ 459 near the end,
+ * after ~460 GIC lines and before the pinctrl wakeups and the IPIs. The IRQ
+ * layout follows the gs101 device tree, the counts are made up.
+ */
+constexpr char kFixture[] = "/tests/data/gs101_proc_interrupts.txt";
+constexpr char kProcInterruptsPath[] = "/proc/interrupts";
+constexpr unsigned int kDwc3Irq = 459;
+constexpr uint64_t kDwc3Count = 48213577;
+
+// Puts the fixture at /proc/interrupts below a temporary sysfs root.
+class FixtureRoot {
+  public:
+    FixtureRoot() {
+        std::string interrupts;
+
+        if (!ReadFileToString(GetExecutableDirectory() + kFixture, &interrupts))
+            abort();
+        mkdir((std::string(mRoot.path) + "/proc").c_str(), 0755);
+        if (!WriteStringToFile(interrupts, std::string(mRoot.path) + kProcInterruptsPath))
+            abort();
+        setSysfsRoot(mRoot.path);
+    }
+
+    ~FixtureRoot() { setSysfsRoot(""); }
+
+  private:
+    TemporaryDir mRoot;
+};
+
+// getUsbGadgetIrqPath() before ProcInterrupts, for comparison.
+bool findIrqCopyingLines(unsigned int *irq) {
+    std::string irqs;
+    size_t read_pos = 0;
+    size_t found_pos;
+
+    if (!ReadFileToString(sysfsPath(kProcInterruptsPath), &irqs))
+        return false;
+    while ((found_pos = irqs.find_first_of("\n", read_pos)) != std::string::npos) {
+        std::string single_irq = irqs.substr(read_pos, found_pos - read_pos);
+
+        if (single_irq.find("dwc3", 0) != std::string::npos) {
+            std::string irq_str = Trim(single_irq.substr(0, single_irq.find_first_of(":")));
+
+            return ParseUint(irq_str, irq);
+        }
+        read_pos = found_pos + 1;
+    }
+    return false;
+}
+
+// IrqAffinityGovernor::readIrqCount() before ProcInterrupts, for comparison.
+bool readCountSplittingLines(const std::string &irq, uint64_t *count) {
+    std::string interrupts;
+    std::string prefix = irq + ":";
+
+    if (!ReadFileToString(sysfsPath(kProcInterruptsPath), &interrupts))
+        return false;
+    for (const std::string &line : Split(interrupts, "\n")) {
+        std::string trimmed = Trim(line);
+
+        if (trimmed.compare(0, prefix.size(), prefix))
+            continue;
+        *count = 0;
+        for (const std::string &column : Split(trimmed.substr(prefix.size()), " ")) {
+            uint64_t value;
+
+            if (column.empty())
+                continue;
+            if (!ParseUint(column, &value))
+                break;
+            *count += value;
+        }
+        return true;
+    }
+    return false;
+}
+
+void BM_FindIrq(benchmark::State &state) {
+    FixtureRoot root;
+    ProcInterrupts interrupts(kProcInterruptsPath);
+    unsigned int irq = 0;
+
+    for (auto _ : state) {
+        if (!interrupts.findIrq("dwc3", &irq) || irq != kDwc3Irq) {
+            state.SkipWithError("dwc3 not found");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_FindIrq);
+
+void BM_FindIrqCopyingLines(benchmark::State &state) {
+    FixtureRoot root;
+    unsigned int irq = 0;
+
+    for (auto _ : state) {
+        if (!findIrqCopyingLines(&irq) || irq != kDwc3Irq) {
+            state.SkipWithError("dwc3 not found");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_FindIrqCopyingLines);
+
+// One sample of the IRQ governor.
+void BM_ReadCount(benchmark::State &state) {
+    FixtureRoot root;
+    ProcInterrupts interrupts(kProcInterruptsPath);
+    uint64_t count = 0;
+
+    for (auto _ : state) {
+        if (!interrupts.readCount(kDwc3Irq, &count) || count != kDwc3Count) {
+            state.SkipWithError("wrong dwc3 count");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_ReadCount);
+
+void BM_ReadCountSplittingLines(benchmark::State &state) {
+    FixtureRoot root;
+    uint64_t count = 0;
+
+    for (auto _ : state) {
+        if (!readCountSplittingLines(std::to_string(kDwc3Irq), &count) || count != kDwc3Count) {
+            state.SkipWithError("wrong dwc3 count");
+            break;
+        }
+    }
+}
+BENCHMARK(BM_ReadCountSplittingLines);
+
+}  // namespace
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+BENCHMARK_MAIN();
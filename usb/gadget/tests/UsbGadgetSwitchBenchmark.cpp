@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include "FakeGadget.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+namespace {
+
+struct SwitchPair {
+    const char *name;
+    long from;
+    long to;
+};
+
+constexpr SwitchPair kSwitchPairs[] = {
+    {"mtp<->mtp,adb", GadgetFunction::MTP, GadgetFunction::MTP | GadgetFunction::ADB},
+    {"rndis<->ncm", GadgetFunction::RNDIS, GadgetFunction::NCM},
+    {"rndis,adb<->ncm,adb", GadgetFunction::RNDIS | GadgetFunction::ADB,
+     GadgetFunction::NCM | GadgetFunction::ADB},
+    {"adb<->adb,ncm", GadgetFunction::ADB, GadgetFunction::ADB | GadgetFunction::NCM},
+};
+
+/*
+ * Back to back switches between the two function sets of the pair numbered
+ * by the first argument, each iteration being one switch up to its callback.
+ * The second argument is SwitchPolicy::udcDetachWait, which skips the
+ * disconnect wait as no host is attached. The third is
+ * SwitchPolicy::incrementalRelink, so that relink modes are compared under
+ * the same wait. The ffs daemons take GadgetHarness::kDaemonStartUs to write
+ * their descriptors.
+ */
+void BM_FunctionSwitch(benchmark::State &state) {
+    const SwitchPair &pair = kSwitchPairs[state.range(0)];
+    GadgetHarness harness(SwitchPolicy{state.range(1) != 0, state.range(2) != 0});
+    bool to = true;
+
+    state.SetLabel(std::string(pair.name) + (state.range(1) ? " udc wait" : " fixed wait") +
+                   (state.range(2) ? " incremental" : " full"));
+    if (harness.switchTo(pair.from) != Status::SUCCESS) {
+        state.SkipWithError("initial switch failed");
+        return;
+    }
+    for (auto _ : state) {
+        if (harness.switchTo(to ? pair.to : pair.from) != Status::SUCCESS) {
+            state.SkipWithError("switch failed");
+            break;
+        }
+        to = !to;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FunctionSwitch)
+        ->ArgsProduct({benchmark::CreateDenseRange(0, std::size(kSwitchPairs) - 1, 1), {0, 1},
+                       {0, 1}})
+        ->ArgNames({"pair", "udc_wait", "incremental"})
+        ->Iterations(20)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+BENCHMARK_MAIN();
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "FakeGadget.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace gadget {
+namespace {
+
+struct ExpectedGadget {
+    long functions;
+    std::vector<std::string> links;
+    const char *pid;
+    const char *descUse;
+};
+
+std::vector<ExpectedGadget> expectedGadgets() {
+    std::string rndis = GetProperty(kRndisConfigProp, "gsi.rndis");
+
+    return {
+        {GadgetFunction::MTP, {"ffs.mtp"}, "0x4ee1", "1"},
+        {GadgetFunction::MTP | GadgetFunction::ADB, {"ffs.mtp", "ffs.adb"}, "0x4ee2", "1"},
+        {GadgetFunction::PTP | GadgetFunction::ADB, {"ffs.ptp", "ffs.adb"}, "0x4ee6", "1"},
+        {GadgetFunction::RNDIS, {rndis}, "0x4ee3", "0"},
+        {GadgetFunction::RNDIS | GadgetFunction::ADB, {rndis, "ffs.adb"}, "0x4ee4", "1"},
+        {GadgetFunction::NCM, {"ncm.gs9"}, "0x4eeb", "0"},
+        {GadgetFunction::NCM | GadgetFunction::ADB, {"ffs.adb", "ncm.gs9"}, "0x4eec", "1"},
+        {GadgetFunction::MIDI | GadgetFunction::ADB, {"midi.gs5", "ffs.adb"}, "0x4ee9", "1"},
+        {GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE | GadgetFunction::ADB,
+         {"accessory.gs2", "audio_source.gs3", "ffs.adb"}, "0x2d05", "1"},
+        {GadgetFunction::ADB, {"ffs.adb"}, "0x4ee7", "1"},
+    };
+}
+
+// The parameter is SwitchPolicy::incrementalRelink, the disconnect wait being the fixed one.
+class UsbGadgetSwitchTest : public ::testing::TestWithParam<bool> {
+  protected:
+    void SetUp() override {
+        mHarness = std::make_unique<GadgetHarness>(SwitchPolicy{false, GetParam()});
+    }
+    void TearDown() override { mHarness.reset(); }
+
+    // Switches to |expected| and checks the gadget is configured and bound to the udc.
+    void switchAndCheck(const ExpectedGadget &expected) {
+        FakeGadgetTree &tree = mHarness->tree();
+
+        ASSERT_EQ(mHarness->switchTo(expected.functions), Status::SUCCESS) << expected.functions;
+        EXPECT_EQ(tree.linkedFunctions(), expected.links) << expected.functions;
+        for (size_t i = 0; i < expected.links.size(); i++) {
+            EXPECT_EQ(tree.linkTarget(std::string(FUNCTION_PATH) + std::to_string(i)),
+                      FUNCTIONS_PATH + expected.links[i]);
+        }
+        EXPECT_EQ(tree.read(VENDOR_ID_PATH), "0x18d1") << expected.functions;
+        EXPECT_EQ(tree.read(PRODUCT_ID_PATH), expected.pid) << expected.functions;
+        EXPECT_EQ(tree.read(DESC_USE_PATH), expected.descUse) << expected.functions;
+        EXPECT_EQ(tree.read(PULLUP_PATH), kGadgetName) << expected.functions;
+    }
+
+    std::unique_ptr<GadgetHarness> mHarness;
+};
+
+TEST_P(UsbGadgetSwitchTest, LinksTheRequestedFunctions) {
+    for (const ExpectedGadget &expected : expectedGadgets()) {
+        switchAndCheck(expected);
+        ASSERT_EQ(mHarness->switchTo(GadgetFunction::NONE), Status::SUCCESS);
+        EXPECT_TRUE(mHarness->tree().linkedFunctions().empty());
+        EXPECT_EQ(mHarness->tree().read(PULLUP_PATH), "none");
+    }
+}
+
+// Back to back switches, where incremental relinks keep whatever links they can.
+TEST_P(UsbGadgetSwitchTest, LinksTheSameAcrossBackToBackSwitches) {
+    std::vector<ExpectedGadget> expected = expectedGadgets();
+
+    for (const ExpectedGadget &gadget : expected)
+        switchAndCheck(gadget);
+    for (auto gadget = expected.rbegin(); gadget != expected.rend(); gadget++)
+        switchAndCheck(*gadget);
+}
+
+TEST_P(UsbGadgetSwitchTest, KeepsUnchangedLinksOnlyWhenRelinkingIncrementally) {
+    std::string link = std::string(CONFIG_PATH) + FUNCTION_NAME + "0";
+    struct stat before, after;
+
+    ASSERT_EQ(mHarness->switchTo(GadgetFunction::MTP), Status::SUCCESS);
+    ASSERT_EQ(lstat(link.c_str(), &before), 0);
+    ASSERT_EQ(mHarness->switchTo(GadgetFunction::MTP | GadgetFunction::ADB), Status::SUCCESS);
+    ASSERT_EQ(lstat(link.c_str(), &after), 0);
+    // tmpfs reuses inode numbers, a relinked function<N> only differs in its creation time.
+    EXPECT_EQ(before.st_ctim.tv_sec == after.st_ctim.tv_sec &&
+                      before.st_ctim.tv_nsec == after.st_ctim.tv_nsec,
+              GetParam());
+}
+
+TEST_P(UsbGadgetSwitchTest, PullsUpOnceTheDescriptorsAreWritten) {
+    FakeGadgetTree &tree = mHarness->tree();
+    const FfsFunction &adb = kFfsFunctions[2];
+
+    ASSERT_EQ(mHarness->switchTo(GadgetFunction::MTP), Status::SUCCESS);
+    // adbd is not running, so the switch times out with the gadget still pulled down.
+    ASSERT_EQ(mHarness->switchTo(GadgetFunction::MTP | GadgetFunction::ADB, 100, false),
+              Status::ERROR);
+    EXPECT_EQ(tree.read(PULLUP_PATH), "none");
+    EXPECT_EQ(tree.linkedFunctions(), std::vector<std::string>({"ffs.mtp", "ffs.adb"}));
+
+    // The monitor keeps watching and pulls up when adbd shows up later.
+    mHarness->startDaemon(adb);
+    for (int i = 0; i < 200 && tree.read(PULLUP_PATH) != kGadgetName; i++)
+        usleep(10000);
+    EXPECT_EQ(tree.read(PULLUP_PATH), kGadgetName);
+}
+
+INSTANTIATE_TEST_SUITE_P(IncrementalRelink, UsbGadgetSwitchTest, ::testing::Bool(),
+                         [](const ::testing::TestParamInfo<bool> &info) {
+                             return info.param ? "Incremental" : "Full";
+                         });
+
+}  // namespace
+}  // namespace gadget
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,448 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.ComplianceRules"
+
+#include "ComplianceRules.h"
+
+#include <android-base/file.h>
+#include <android/binder_enums.h>
+#include <json/reader.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <memory>
+
+using android::base::ReadFileToString;
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+#define WARNING_SURFACE_DELAY_MS 5000
+#define ENUM_FAIL_DEFAULT_COUNT_THRESHOLD 3
+#define DEVICE_FLAKY_CONNECTION_CONFIGURED_COUNT_THRESHOLD 5
+// Upper bound of the timestamps a windowed condition may need to keep per port
+#define MAX_WINDOW_EVENTS 256
+#define MAX_WINDOW_MS (24 * 3600 * 1000LL)
+
+using std::chrono::milliseconds;
+
+std::vector<ComplianceRule> defaultComplianceRules() {
+    const milliseconds delay(WARNING_SURFACE_DELAY_MS);
+
+    return {
+        {ComplianceWarning::ENUMERATION_FAIL,
+         PortDataRole::DEVICE,
+         delay,
+         {{COMPLIANCE_METRIC_STATE_COUNT, USB_DEVICE_STATE_CONFIGURED, milliseconds(0),
+           COMPLIANCE_OP_EQ, 0},
+          {COMPLIANCE_METRIC_STATE_COUNT, USB_DEVICE_STATE_DEFAULT, milliseconds(0),
+           COMPLIANCE_OP_GT, ENUM_FAIL_DEFAULT_COUNT_THRESHOLD}}},
+        {ComplianceWarning::FLAKY_CONNECTION,
+         PortDataRole::DEVICE,
+         delay,
+         {{COMPLIANCE_METRIC_STATE_COUNT, USB_DEVICE_STATE_CONFIGURED, milliseconds(0),
+           COMPLIANCE_OP_GT, DEVICE_FLAKY_CONNECTION_CONFIGURED_COUNT_THRESHOLD}}},
+        {ComplianceWarning::ENUMERATION_FAIL,
+         PortDataRole::HOST,
+         delay,
+         {{COMPLIANCE_METRIC_STATE_COUNT, USB_DEVICE_STATE_CONFIGURED, milliseconds(0),
+           COMPLIANCE_OP_EQ, 0, true /* allPorts */},
+          {COMPLIANCE_METRIC_STATE_COUNT, USB_DEVICE_STATE_DEFAULT, milliseconds(0),
+           COMPLIANCE_OP_GT, ENUM_FAIL_DEFAULT_COUNT_THRESHOLD}}},
+        // Host ports saw nothing but the "not attached" state after enablement.
+        {ComplianceWarning::MISSING_DATA_LINES,
+         PortDataRole::HOST,
+         delay,
+         {{COMPLIANCE_METRIC_TRANSITIONS, USB_DEVICE_STATE_UNKNOWN, milliseconds(0),
+           COMPLIANCE_OP_EQ, 1, true /* allPorts */},
+          {COMPLIANCE_METRIC_STATE_COUNT, USB_DEVICE_STATE_NOT_ATTACHED, milliseconds(0),
+           COMPLIANCE_OP_EQ, 1, true /* allPorts */}}},
+    };
+}
+
+static bool parseCondition(const Json::Value &value, ComplianceCondition *condition) {
+    static const std::pair<const char *, ComplianceMetric> kMetrics[] = {
+        {"state_count", COMPLIANCE_METRIC_STATE_COUNT},
+        {"transitions", COMPLIANCE_METRIC_TRANSITIONS},
+        {"transition_rate", COMPLIANCE_METRIC_TRANSITION_RATE},
+        {"time_in_state", COMPLIANCE_METRIC_TIME_IN_STATE},
+    };
+    static const std::pair<const char *, ComplianceOp> kOps[] = {
+        {"<", COMPLIANCE_OP_LT},  {"<=", COMPLIANCE_OP_LE}, {"==", COMPLIANCE_OP_EQ},
+        {">=", COMPLIANCE_OP_GE}, {">", COMPLIANCE_OP_GT},
+    };
+    std::string metric = value["metric"].asString();
+    std::string op = value["op"].asString();
+    std::string ports = value.get("ports", "any").asString();
+    bool found;
+
+    found = false;
+    for (const auto &[name, m] : kMetrics) {
+        if (metric == name) {
+            condition->metric = m;
+            found = true;
+        }
+    }
+    if (!found) {
+        ALOGE("unknown metric \"%s\"", metric.c_str());
+        return false;
+    }
+
+    found = false;
+    for (const auto &[name, o] : kOps) {
+        if (op == name) {
+            condition->op = o;
+            found = true;
+        }
+    }
+    if (!found) {
+        ALOGE("unknown op \"%s\"", op.c_str());
+        return false;
+    }
+
+    if (condition->metric == COMPLIANCE_METRIC_STATE_COUNT ||
+        condition->metric == COMPLIANCE_METRIC_TIME_IN_STATE) {
+        // States are named as the sysfs reports them, e.g. "not attached".
+        condition->state = parseUsbDeviceState(value["state"].asString() + "\n");
+        if (condition->state == USB_DEVICE_STATE_UNKNOWN) {
+            ALOGE("unknown state \"%s\"", value["state"].asString().c_str());
+            return false;
+        }
+    }
+
+    if (!value["value"].isIntegral() || value["value"].asInt64() < 0 ||
+        value["value"].asInt64() > INT32_MAX || !value.get("window_ms", 0).isIntegral() ||
+        value.get("window_ms", 0).asInt64() < 0 ||
+        value.get("window_ms", 0).asInt64() > MAX_WINDOW_MS) {
+        ALOGE("invalid value or window_ms");
+        return false;
+    }
+    condition->value = value["value"].asInt64();
+    condition->window = milliseconds(value.get("window_ms", 0).asInt64());
+
+    if (condition->metric == COMPLIANCE_METRIC_TRANSITION_RATE && condition->window.count() == 0) {
+        ALOGE("transition_rate requires window_ms");
+        return false;
+    }
+    if (condition->metric == COMPLIANCE_METRIC_TIME_IN_STATE && condition->window.count() != 0) {
+        ALOGE("time_in_state does not support window_ms");
+        return false;
+    }
+    if (condition->window.count() != 0 &&
+        ComplianceRuleEngine::eventCapacity(*condition) > MAX_WINDOW_EVENTS) {
+        ALOGE("windowed condition needs more than %d events", MAX_WINDOW_EVENTS);
+        return false;
+    }
+
+    if (ports != "any" && ports != "all") {
+        ALOGE("unknown ports \"%s\"", ports.c_str());
+        return false;
+    }
+    condition->allPorts = ports == "all";
+
+    return true;
+}
+
+bool parseComplianceRules(const std::string &json, std::vector<ComplianceRule> *rules) {
+    std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
+    std::vector<ComplianceRule> parsed;
+    Json::Value root;
+    std::string errors;
+
+    if (!reader->parse(json.data(), json.data() + json.size(), &root, &errors)) {
+        ALOGE("failed to parse compliance rules: %s", errors.c_str());
+        return false;
+    }
+    if (!root["rules"].isArray()) {
+        ALOGE("compliance rules: missing \"rules\" array");
+        return false;
+    }
+
+    for (const Json::Value &value : root["rules"]) {
+        ComplianceRule rule;
+        std::string warning = value["warning"].asString();
+        std::string role = value["role"].asString();
+        bool found = false;
+
+        for (ComplianceWarning w : ndk::enum_range<ComplianceWarning>()) {
+            if (warning == toString(w)) {
+                rule.warning = w;
+                found = true;
+            }
+        }
+        if (!found) {
+            ALOGE("unknown warning \"%s\"", warning.c_str());
+            return false;
+        }
+
+        if (role == "device") {
+            rule.role = PortDataRole::DEVICE;
+        } else if (role == "host") {
+            rule.role = PortDataRole::HOST;
+        } else {
+            ALOGE("unknown role \"%s\"", role.c_str());
+            return false;
+        }
+
+        if (!value.get("delay_ms", 0).isIntegral() || value.get("delay_ms", 0).asInt64() < 0) {
+            ALOGE("invalid delay_ms");
+            return false;
+        }
+        rule.delay = milliseconds(value.get("delay_ms", 0).asInt64());
+
+        if (!value["conditions"].isArray() || value["conditions"].empty()) {
+            ALOGE("rule for %s without conditions", warning.c_str());
+            return false;
+        }
+        for (const Json::Value &c : value["conditions"]) {
+            ComplianceCondition condition;
+
+            if (!parseCondition(c, &condition))
+                return false;
+            rule.conditions.push_back(condition);
+        }
+        parsed.push_back(rule);
+    }
+
+    *rules = std::move(parsed);
+    return true;
+}
+
+std::vector<ComplianceRule> loadComplianceRules(const char *path) {
+    std::vector<ComplianceRule> rules = defaultComplianceRules();
+    std::string json;
+
+    if (!ReadFileToString(path, &json)) {
+        ALOGI("%s not found, using default compliance rules", path);
+        return rules;
+    }
+    if (!parseComplianceRules(json, &rules)) {
+        ALOGE("invalid %s, using default compliance rules", path);
+        return rules;
+    }
+
+    ALOGI("loaded %zu compliance rules from %s", rules.size(), path);
+    return rules;
+}
+
+static bool compare(int64_t lhs, ComplianceOp op, int64_t rhs) {
+    switch (op) {
+        case COMPLIANCE_OP_LT:
+            return lhs < rhs;
+        case COMPLIANCE_OP_LE:
+            return lhs <= rhs;
+        case COMPLIANCE_OP_EQ:
+            return lhs == rhs;
+        case COMPLIANCE_OP_GE:
+            return lhs >= rhs;
+        case COMPLIANCE_OP_GT:
+            return lhs > rhs;
+    }
+    return false;
+}
+
+ComplianceRuleEngine::ComplianceRuleEngine(std::vector<ComplianceRule> rules,
+                                           Histories histories)
+    : mRules(std::move(rules)), mStates(mRules.size()), mHistories(histories) {}
+
+size_t ComplianceRuleEngine::eventCapacity(const ComplianceCondition &condition) {
+    /*
+     * Any count above the threshold compares the same way, so the window only
+     * needs to remember one event more than the threshold.
+     */
+    if (condition.metric == COMPLIANCE_METRIC_TRANSITION_RATE)
+        return condition.value * condition.window.count() / 60000 + 2;
+    return condition.value + 1;
+}
+
+void ComplianceRuleEngine::startSession(PortDataRole role, boot_clock::time_point now) {
+    mSessionStart = now;
+    for (auto &inputs : mInputs)
+        inputs.clear();
+
+    if (role == PortDataRole::DEVICE)
+        mPorts = {COMPLIANCE_PORT_DEVICE};
+    else if (role == PortDataRole::HOST)
+        mPorts = {COMPLIANCE_PORT_HOST1, COMPLIANCE_PORT_HOST2};
+    else
+        mPorts.clear();
+
+    for (size_t i = 0; i < mRules.size(); i++) {
+        const ComplianceRule &rule = mRules[i];
+        RuleState &state = mStates[i];
+
+        state = RuleState();
+        if (rule.role != role || mPorts.empty())
+            continue;
+
+        state.active = true;
+        state.dirty = true;
+        // Evaluated once the surface delay elapsed, even if no state ever comes.
+        state.deadline = now + rule.delay;
+        state.evaluators.resize(rule.conditions.size());
+        for (size_t c = 0; c < rule.conditions.size(); c++) {
+            for (CompliancePort port : mPorts) {
+                if (rule.conditions[c].window.count() != 0)
+                    state.evaluators[c][port].events.resize(eventCapacity(rule.conditions[c]));
+                mInputs[port].emplace_back(i, c);
+            }
+        }
+    }
+}
+
+void ComplianceRuleEngine::onStateChange(CompliancePort port, UsbDeviceState state,
+                                         boot_clock::time_point now) {
+    for (const auto &[r, c] : mInputs[port]) {
+        const ComplianceCondition &condition = mRules[r].conditions[c];
+        Evaluator &evaluator = mStates[r].evaluators[c][port];
+
+        if (condition.metric == COMPLIANCE_METRIC_TIME_IN_STATE) {
+            if (evaluator.inState && state != condition.state) {
+                evaluator.timeInState += now - evaluator.entered;
+                evaluator.inState = false;
+            } else if (!evaluator.inState && state == condition.state) {
+                evaluator.entered = now;
+                evaluator.inState = true;
+            } else {
+                continue;
+            }
+        } else {
+            if (condition.metric == COMPLIANCE_METRIC_STATE_COUNT && state != condition.state)
+                continue;
+
+            // Whole session counts are the history counters, already updated.
+            if (!evaluator.events.empty()) {
+                size_t capacity = evaluator.events.size();
+
+                expire(condition, &evaluator, now);
+                if (evaluator.count == capacity) {
+                    evaluator.head = (evaluator.head + 1) % capacity;
+                    evaluator.count--;
+                }
+                evaluator.events[(evaluator.head + evaluator.count) % capacity] = now;
+                evaluator.count++;
+            }
+        }
+        mStates[r].dirty = true;
+    }
+}
+
+void ComplianceRuleEngine::expire(const ComplianceCondition &condition, Evaluator *evaluator,
+                                  boot_clock::time_point now) {
+    while (evaluator->count && evaluator->events[evaluator->head] + condition.window <= now) {
+        evaluator->head = (evaluator->head + 1) % evaluator->events.size();
+        evaluator->count--;
+    }
+}
+
+bool ComplianceRuleEngine::holds(const ComplianceCondition &condition, Evaluator *evaluator,
+                                 const UsbDeviceStateHistory &history, boot_clock::time_point now,
+                                 boot_clock::time_point *deadline) {
+    if (condition.metric == COMPLIANCE_METRIC_TIME_IN_STATE) {
+        boot_clock::duration time = evaluator->timeInState;
+        int64_t ms;
+
+        if (evaluator->inState)
+            time += now - evaluator->entered;
+        ms = std::chrono::duration_cast<milliseconds>(time).count();
+        // The result flips once the current stay crosses the threshold.
+        if (evaluator->inState && ms <= condition.value)
+            *deadline = std::min(*deadline, now + milliseconds(condition.value - ms + 1));
+        return compare(ms, condition.op, condition.value);
+    }
+
+    if (evaluator->events.empty()) {
+        uint32_t count = condition.metric == COMPLIANCE_METRIC_STATE_COUNT
+                                 ? history.count(condition.state)
+                                 : history.total();
+
+        return compare(count, condition.op, condition.value);
+    }
+
+    expire(condition, evaluator, now);
+    if (evaluator->count)
+        *deadline = std::min(*deadline, evaluator->events[evaluator->head] + condition.window);
+
+    if (condition.metric == COMPLIANCE_METRIC_TRANSITION_RATE)
+        return compare(evaluator->count * 60000LL, condition.op,
+                       condition.value * condition.window.count());
+    return compare(evaluator->count, condition.op, condition.value);
+}
+
+void ComplianceRuleEngine::evaluateRule(size_t index, boot_clock::time_point now) {
+    const ComplianceRule &rule = mRules[index];
+    RuleState &state = mStates[index];
+    bool raised = true;
+
+    state.dirty = false;
+    state.deadline = boot_clock::time_point::max();
+
+    if (now < mSessionStart + rule.delay) {
+        state.raised = false;
+        state.deadline = mSessionStart + rule.delay;
+        return;
+    }
+
+    // Every condition is looked at to collect the deadlines of all of them.
+    for (size_t c = 0; c < rule.conditions.size(); c++) {
+        const ComplianceCondition &condition = rule.conditions[c];
+        bool any = false;
+        bool all = true;
+
+        for (CompliancePort port : mPorts) {
+            bool result = holds(condition, &state.evaluators[c][port], *mHistories[port], now,
+                                &state.deadline);
+
+            any |= result;
+            all &= result;
+        }
+        raised &= condition.allPorts ? all : any;
+    }
+    state.raised = raised;
+}
+
+std::set<ComplianceWarning> ComplianceRuleEngine::evaluate(boot_clock::time_point now) {
+    std::set<ComplianceWarning> warnings;
+
+    for (size_t i = 0; i < mRules.size(); i++) {
+        if (!mStates[i].active)
+            continue;
+        if (mStates[i].dirty || mStates[i].deadline <= now)
+            evaluateRule(i, now);
+        if (mStates[i].raised)
+            warnings.insert(mRules[i].warning);
+    }
+
+    return warnings;
+}
+
+boot_clock::time_point ComplianceRuleEngine::nextDeadline() const {
+    boot_clock::time_point deadline = boot_clock::time_point::max();
+
+    for (const RuleState &state : mStates) {
+        if (state.active)
+            deadline = std::min(deadline, state.deadline);
+    }
+    return deadline;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
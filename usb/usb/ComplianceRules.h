@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/usb/ComplianceWarning.h>
+#include <aidl/android/hardware/usb/PortDataRole.h>
+#include <android-base/chrono_utils.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "UsbDeviceStateHistory.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::aidl::android::hardware::usb::ComplianceWarning;
+using ::aidl::android::hardware::usb::PortDataRole;
+using ::android::base::boot_clock;
+
+// Usb devices whose state streams feed the rules.
+enum CompliancePort {
+    COMPLIANCE_PORT_DEVICE,
+    COMPLIANCE_PORT_HOST1,
+    COMPLIANCE_PORT_HOST2,
+    COMPLIANCE_PORT_COUNT,
+};
+
+enum ComplianceMetric {
+    // Number of times |state| was entered
+    COMPLIANCE_METRIC_STATE_COUNT,
+    // Number of state transitions
+    COMPLIANCE_METRIC_TRANSITIONS,
+    // State transitions per minute over the window, requires a window
+    COMPLIANCE_METRIC_TRANSITION_RATE,
+    // Milliseconds spent in |state| since the session started, the current stay included
+    COMPLIANCE_METRIC_TIME_IN_STATE,
+};
+
+enum ComplianceOp {
+    COMPLIANCE_OP_LT,
+    COMPLIANCE_OP_LE,
+    COMPLIANCE_OP_EQ,
+    COMPLIANCE_OP_GE,
+    COMPLIANCE_OP_GT,
+};
+
+struct ComplianceCondition {
+    ComplianceMetric metric;
+    // Only used by COMPLIANCE_METRIC_STATE_COUNT and COMPLIANCE_METRIC_TIME_IN_STATE
+    UsbDeviceState state = USB_DEVICE_STATE_UNKNOWN;
+    // Sliding window over the recent events, 0 for the whole session. Counts only.
+    std::chrono::milliseconds window{0};
+    ComplianceOp op;
+    int64_t value;
+    // Whether every port of the role has to satisfy the condition, rather than any of them
+    bool allPorts = false;
+};
+
+// A warning is raised when all conditions hold for the current data session.
+struct ComplianceRule {
+    ComplianceWarning warning;
+    PortDataRole role;
+    // The rule is not evaluated before the session is this old
+    std::chrono::milliseconds delay{0};
+    std::vector<ComplianceCondition> conditions;
+};
+
+// Vendor rule file, replacing the default rules when present.
+constexpr char kComplianceRulesPath[] = "/vendor/etc/usb_compliance_rules.json";
+
+// The rules the HAL shipped with before they became configurable.
+std::vector<ComplianceRule> defaultComplianceRules();
+/*
+ * Parses a JSON rule file of the form:
+ *
+ * {"rules": [{"warning": "ENUMERATION_FAIL", "role": "device", "delay_ms": 5000,
+ *             "conditions": [{"metric": "state_count", "state": "configured",
+ *                             "op": "==", "value": 0, "window_ms": 0, "ports": "any"}]}]}
+ *
+ * Returns false, leaving |rules| untouched, if anything is invalid.
+ */
+bool parseComplianceRules(const std::string &json, std::vector<ComplianceRule> *rules);
+// Rules from |path|, or the default rules if it is absent or invalid.
+std::vector<ComplianceRule> loadComplianceRules(const char *path);
+
+/*
+ * Evaluates compliance rules incrementally over the state streams of the
+ * ports. Whole session counts are read from the per-state counters of the
+ * state history of each port. Other conditions keep a small evaluator per
+ * port that is updated in O(1) per state change; windowed counts keep at most
+ * as many timestamps as needed to decide the comparison. A rule is only re-evaluated when one of
+ * its inputs changed or when the passage of time may change its result
+ * (surface delay, window expiry, time in state crossing its threshold), which
+ * nextDeadline() reports so that the caller can arm a timer.
+ *
+ * Not thread safe, meant to be driven from the uevent hub thread.
+ */
+class ComplianceRuleEngine {
+  public:
+    using Histories = std::array<const UsbDeviceStateHistory *, COMPLIANCE_PORT_COUNT>;
+
+    /*
+     * |histories| are the state histories of the ports, cleared by the caller
+     * when a session starts and pushed to before each onStateChange().
+     */
+    ComplianceRuleEngine(std::vector<ComplianceRule> rules, Histories histories);
+
+    // Resets all evaluators and activates the rules of |role|.
+    void startSession(PortDataRole role, boot_clock::time_point now);
+    void onStateChange(CompliancePort port, UsbDeviceState state, boot_clock::time_point now);
+    // Re-evaluates the rules that need it and returns the warnings currently raised.
+    std::set<ComplianceWarning> evaluate(boot_clock::time_point now);
+    // Earliest time a result may change without a new state, time_point::max() if none.
+    boot_clock::time_point nextDeadline() const;
+
+    // Number of timestamps a windowed condition keeps per port.
+    static size_t eventCapacity(const ComplianceCondition &condition);
+
+  private:
+    struct Evaluator {
+        // Timestamps in |events|, windowed counts only
+        uint32_t count = 0;
+        // Ring of the timestamps still in the window, bounded by the condition
+        std::vector<boot_clock::time_point> events;
+        size_t head = 0;
+        // TIME_IN_STATE
+        boot_clock::duration timeInState{0};
+        bool inState = false;
+        boot_clock::time_point entered;
+    };
+    struct RuleState {
+        bool active = false;
+        bool dirty = false;
+        bool raised = false;
+        boot_clock::time_point deadline = boot_clock::time_point::max();
+        std::vector<std::array<Evaluator, COMPLIANCE_PORT_COUNT>> evaluators;
+    };
+
+    static void expire(const ComplianceCondition &condition, Evaluator *evaluator,
+                       boot_clock::time_point now);
+    static bool holds(const ComplianceCondition &condition, Evaluator *evaluator,
+                      const UsbDeviceStateHistory &history, boot_clock::time_point now,
+                      boot_clock::time_point *deadline);
+    void evaluateRule(size_t index, boot_clock::time_point now);
+
+    std::vector<ComplianceRule> mRules;
+    std::vector<RuleState> mStates;
+    Histories mHistories;
+    // (rule, condition) pairs fed by each port during the current session
+    std::array<std::vector<std::pair<size_t, size_t>>, COMPLIANCE_PORT_COUNT> mInputs;
+    std::vector<CompliancePort> mPorts;
+    boot_clock::time_point mSessionStart;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DevpathPattern.h"
+
+#include <cstring>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Regex operators that would need more than one character per position.
+constexpr char kUnsupported[] = "*+?{}()|^$";
+
+bool DevpathPattern::compile(std::string_view pattern) {
+    bool literal = true;
+
+    mPositions.clear();
+    mLiteralPrefix.clear();
+
+    for (size_t i = 0; i < pattern.size(); i++) {
+        std::bitset<256> set;
+        char c = pattern[i];
+
+        if (c == '\\') {
+            if (++i == pattern.size())
+                return false;
+            set.set(static_cast<unsigned char>(pattern[i]));
+        } else if (c == '.') {
+            set.set();
+        } else if (c == '[') {
+            bool negate = i + 1 < pattern.size() && pattern[i + 1] == '^';
+            size_t j = negate ? i + 2 : i + 1;
+
+            // A ']' right after the opening bracket is a literal.
+            for (bool first = true; j < pattern.size() && (first || pattern[j] != ']');
+                 first = false) {
+                unsigned char lo = pattern[j], hi = lo;
+
+                if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+                    hi = pattern[j + 2];
+                    j += 2;
+                }
+                if (lo > hi)
+                    return false;
+                for (unsigned int ch = lo; ch <= hi; ch++)
+                    set.set(ch);
+                j++;
+            }
+            if (j == pattern.size())
+                return false;
+            if (negate)
+                set.flip();
+            i = j;
+        } else if (strchr(kUnsupported, c) || c == ']') {
+            return false;
+        } else {
+            set.set(static_cast<unsigned char>(c));
+        }
+
+        if (literal && set.count() == 1) {
+            unsigned int ch = 0;
+
+            while (!set.test(ch))
+                ch++;
+            mLiteralPrefix += static_cast<char>(ch);
+        } else {
+            literal = false;
+        }
+        mPositions.push_back(set);
+    }
+
+    return true;
+}
+
+bool DevpathPattern::matches(std::string_view devpath) const {
+    if (devpath.size() < mPositions.size())
+        return false;
+    // Most uevents already differ in the literal part.
+    if (memcmp(devpath.data(), mLiteralPrefix.data(), mLiteralPrefix.size()))
+        return false;
+
+    for (size_t i = mLiteralPrefix.size(); i < mPositions.size(); i++) {
+        if (!mPositions[i].test(static_cast<unsigned char>(devpath[i])))
+            return false;
+    }
+    return true;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <bitset>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * DEVPATH prefix matcher compiled from a small regex subset: literal
+ * characters, '.' for any character, bracket classes such as "[0-9]" or
+ * "[^/]", and '\' escapes. Every position of the pattern matches exactly one
+ * character, so the compiled form is a chain of 256-bit character sets and a
+ * match is one bit test per character, without backtracking or allocation.
+ *
+ * Matching is anchored at the start of DEVPATH. For patterns starting with
+ * "/devices" this is equivalent to std::regex_search, since every DEVPATH
+ * starts there, and children of the matched device match too.
+ */
+class DevpathPattern {
+  public:
+    // Returns false if |pattern| uses syntax outside of the subset above.
+    bool compile(std::string_view pattern);
+    // True if |devpath| starts with a match of the pattern. An empty pattern matches anything.
+    bool matches(std::string_view devpath) const;
+
+    bool empty() const { return mPositions.empty(); }
+    // Leading characters that only match themselves, e.g. for the uevent socket filter.
+    const std::string &literalPrefix() const { return mLiteralPrefix; }
+
+  private:
+    std::vector<std::bitset<256>> mPositions;
+    std::string mLiteralPrefix;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.UdcTracker"
+
+#include "UdcTracker.h"
+
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * TODO: upstream udc driver emits KOBJ_CHANGE event BEFORE unbind is actually
+ * executed. Read the bind status once the udc had time to settle.
+ */
+#define UDC_UEVENT_SETTLE_MS 50
+#define FUNCTION_MAX_LEN 64
+
+constexpr char kUdcClassPath[] = "/sys/class/udc";
+
+UdcTracker::UdcTracker(UeventHub *ueventHub, const std::string &udcUeventPattern,
+                       BindCallback callback)
+    : mUeventHub(ueventHub),
+      mUdcUeventPattern(udcUeventPattern),
+      mCallback(std::move(callback)),
+      mSubscription(-1),
+      mBound(false) {
+    if (!mPattern.compile(udcUeventPattern)) {
+        ALOGE("invalid udc pattern %s", udcUeventPattern.c_str());
+        abort();
+    }
+
+    unique_fd timerFd(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (timerFd.get() == -1) {
+        ALOGE("create udc timerFd failed");
+        abort();
+    }
+    mTimerFd = std::move(timerFd);
+}
+
+UdcTracker::~UdcTracker() {
+    stop();
+}
+
+void UdcTracker::start() {
+    UeventFilter filter;
+
+    if (mUeventHub->addFd(mTimerFd.get(), EPOLLIN, [this](uint32_t) { handleTimerEvent(); }))
+        abort();
+
+    filter.actions = {"add", "remove", "change"};
+    filter.devpathPattern = mUdcUeventPattern;
+    mSubscription =
+        mUeventHub->subscribe(filter, [this](const Uevent &event) { handleUevent(event); });
+
+    scan();
+    for (const auto &[devpath, udc] : mUdcs)
+        mBound |= udc.bound;
+}
+
+void UdcTracker::stop() {
+    if (mSubscription == -1)
+        return;
+
+    mUeventHub->unsubscribe(mSubscription);
+    mUeventHub->removeFd(mTimerFd.get());
+    mSubscription = -1;
+}
+
+// Picks up the udcs registered before the tracker was started.
+void UdcTracker::scan() {
+    std::unique_ptr<DIR, int (*)(DIR *)> dir(opendir(sysfsPath(kUdcClassPath).c_str()), closedir);
+    struct dirent *entry;
+
+    if (!dir) {
+        ALOGI("Cannot open %s", kUdcClassPath);
+        return;
+    }
+
+    while ((entry = readdir(dir.get())) != NULL) {
+        std::string link = sysfsPath(std::string(kUdcClassPath) + "/" + entry->d_name);
+        char target[PATH_MAX];
+        ssize_t n;
+        size_t devices;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        // e.g. ../../devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3
+        n = readlink(link.c_str(), target, sizeof(target) - 1);
+        if (n < 0)
+            continue;
+        target[n] = '\0';
+
+        std::string_view devpath(target);
+        devices = devpath.find("/devices/");
+        if (devices == std::string_view::npos)
+            continue;
+        devpath.remove_prefix(devices);
+
+        if (!mPattern.matches(devpath))
+            continue;
+        if (Udc *udc = track(std::string(devpath)))
+            readBindStatus(std::string(devpath), udc);
+    }
+}
+
+UdcTracker::Udc *UdcTracker::track(const std::string &devpath) {
+    auto it = mUdcs.find(devpath);
+
+    if (it == mUdcs.end()) {
+        // Only udc class devices have a function attribute.
+        if (access(sysfsPath("/sys" + devpath + "/function").c_str(), R_OK))
+            return NULL;
+
+        it = mUdcs.emplace(devpath, Udc()).first;
+        it->second.function = std::make_unique<SysfsAttribute>("/sys" + devpath + "/function");
+        ALOGI("tracking udc %s", devpath.c_str());
+    }
+    return &it->second;
+}
+
+void UdcTracker::readBindStatus(const std::string &devpath, Udc *udc) {
+    char buf[FUNCTION_MAX_LEN];
+    std::string_view function;
+
+    /*
+     * /sys/class/udc/<udc>/function prints out name of currently running USB gadget driver
+     * Ref: https://www.kernel.org/doc/Documentation/ABI/stable/sysfs-class-udc
+     * Empty name string means the udc device is not bound and gadget is pulldown.
+     */
+    udc->pending = false;
+    if (!udc->function->read(buf, sizeof(buf), &function)) {
+        ALOGE("failed to read %s", udc->function->path().c_str());
+        return;
+    }
+
+    if (udc->bound != !function.empty())
+        ALOGI("udc %s %s", devpath.c_str(), function.empty() ? "unbound" : "bound");
+    udc->bound = !function.empty();
+}
+
+void UdcTracker::handleUevent(const Uevent &event) {
+    std::string devpath(event.devpath);
+
+    if (event.action == "remove") {
+        if (mUdcs.erase(devpath)) {
+            ALOGI("udc %s gone", devpath.c_str());
+            update();
+        }
+        return;
+    }
+
+    Udc *udc = track(devpath);
+    if (!udc)
+        return;
+
+    if (event.action == "change") {
+        struct itimerspec delay = itimerspec();
+
+        // Every change@ re-arms the timer, a burst is re-checked once.
+        udc->pending = true;
+        delay.it_value.tv_nsec = UDC_UEVENT_SETTLE_MS * 1000000L;
+        if (timerfd_settime(mTimerFd.get(), 0, &delay, NULL) == 0)
+            return;
+        ALOGE("udc timerfd_settime failed err:%d", errno);
+    }
+
+    readBindStatus(devpath, udc);
+    update();
+}
+
+void UdcTracker::handleTimerEvent() {
+    uint64_t numExpiration;
+
+    // A re-armed timer may have already been drained, nothing to do then.
+    if (read(mTimerFd.get(), &numExpiration, sizeof(numExpiration)) != sizeof(numExpiration))
+        return;
+
+    for (auto &[devpath, udc] : mUdcs) {
+        if (udc.pending)
+            readBindStatus(devpath, &udc);
+    }
+    update();
+}
+
+void UdcTracker::update() {
+    bool bound = false;
+
+    for (const auto &[devpath, udc] : mUdcs)
+        bound |= udc.bound;
+
+    if (bound == mBound)
+        return;
+
+    mBound = bound;
+    mCallback(bound);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "DevpathPattern.h"
+#include "SysfsAttribute.h"
+#include "UeventHub.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+/*
+ * Follows the lifecycle of the udc devices whose DEVPATH matches a pattern and
+ * whether the configfs gadget driver is bound to any of them. Udcs found in
+ * /sys/class/udc by start(), or announced later by add@, are tracked until
+ * remove@, each with its "function" attribute kept open so a bind status
+ * check is a single pread. A change@ uevent, sent by the udc core on gadget
+ * bind and unbind, re-reads the attribute after a short settle delay; the
+ * delays of a burst of change@ uevents are merged. The udc class device
+ * itself never emits bind@ or unbind@.
+ *
+ * All uevent and timer handling runs on the uevent hub thread.
+ */
+class UdcTracker {
+  public:
+    // Called on the hub thread when bound() changes.
+    using BindCallback = std::function<void(bool bound)>;
+
+    UdcTracker(UeventHub *ueventHub, const std::string &udcUeventPattern, BindCallback callback);
+    ~UdcTracker();
+
+    /*
+     * Subscribes to the udc uevents, then discovers the present udcs, so that
+     * a udc showing up in between is not missed. Called before the hub is
+     * started, bound() is valid once this returns.
+     */
+    void start();
+    // Stops following uevents; the callback is not invoked once this returns. Idempotent.
+    void stop();
+    // Whether the gadget driver is bound to any tracked udc.
+    bool bound() const { return mBound; }
+
+  private:
+    struct Udc {
+        std::unique_ptr<SysfsAttribute> function;
+        bool bound = false;
+        // A change@ was seen and the bind status has not been re-read yet
+        bool pending = false;
+    };
+
+    void scan();
+    Udc *track(const std::string &devpath);
+    void readBindStatus(const std::string &devpath, Udc *udc);
+    void handleUevent(const Uevent &event);
+    void handleTimerEvent();
+    void update();
+
+    UeventHub *mUeventHub;
+    DevpathPattern mPattern;
+    std::string mUdcUeventPattern;
+    BindCallback mCallback;
+    unique_fd mTimerFd;
+    int mSubscription;
+    // Tracked udcs by DEVPATH
+    std::map<std::string, Udc> mUdcs;
+    bool mBound;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UeventClassifier.h"
+
+#include <cstring>
+#include <string_view>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+namespace {
+
+struct UeventKey {
+    std::string_view prefix;
+    UeventClass cls;
+};
+
+/*
+ * Line prefixes that classify a uevent. Entries are matched as prefixes of a
+ * single uevent line; ordering does not matter since all matches accumulate.
+ */
+constexpr UeventKey kUeventKeys[] = {
+    {"DEVTYPE=typec_", UEVENT_CLASS_TYPEC},
+    {"DRIVER=max77759tcpc", UEVENT_CLASS_TCPC_DRIVER},
+    {"DRIVER=pogo-transport", UEVENT_CLASS_POGO},
+    {"DRIVER=google,usbc_port_cooling_dev", UEVENT_CLASS_OVERHEAT},
+    {"POWER_SUPPLY_NAME=usb", UEVENT_CLASS_POWER_SUPPLY_USB},
+};
+
+constexpr std::string_view kPartnerAddPrefix = "add";
+constexpr std::string_view kPartnerSuffix = "-partner";
+
+// Bitmap of the first characters of all keys, used to reject most lines with one lookup.
+struct FirstCharMap {
+    bool map[256] = {};
+
+    constexpr FirstCharMap() {
+        for (const auto &key : kUeventKeys)
+            map[static_cast<unsigned char>(key.prefix[0])] = true;
+    }
+};
+
+constexpr FirstCharMap kFirstChars;
+
+bool startsWith(std::string_view line, std::string_view prefix) {
+    return line.size() >= prefix.size() && !memcmp(line.data(), prefix.data(), prefix.size());
+}
+
+bool endsWith(std::string_view line, std::string_view suffix) {
+    return line.size() >= suffix.size() &&
+           !memcmp(line.data() + line.size() - suffix.size(), suffix.data(), suffix.size());
+}
+
+}  // namespace
+
+uint32_t classifyUevent(const char *msg, size_t len) {
+    uint32_t cls = UEVENT_CLASS_NONE;
+    const char *end = msg + len;
+    const char *cp = msg;
+
+    while (cp < end && *cp) {
+        const char *nul = static_cast<const char *>(memchr(cp, '\0', end - cp));
+        std::string_view line(cp, (nul ? nul : end) - cp);
+
+        if (kFirstChars.map[static_cast<unsigned char>(line[0])]) {
+            for (const auto &key : kUeventKeys) {
+                if (startsWith(line, key.prefix)) {
+                    cls |= key.cls;
+                    break;
+                }
+            }
+        } else if (startsWith(line, kPartnerAddPrefix) && endsWith(line, kPartnerSuffix)) {
+            cls |= UEVENT_CLASS_PARTNER_ADD;
+        }
+
+        if (!nul)
+            break;
+        cp = nul + 1;
+    }
+
+    return cls;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Classes of kernel uevents the USB HAL reacts to. A single uevent can fall
+ * into more than one class, so classifyUevent() returns a bitmask.
+ */
+enum UeventClass : uint32_t {
+    UEVENT_CLASS_NONE = 0,
+    // "add@<devpath>-partner": a port partner came online.
+    UEVENT_CLASS_PARTNER_ADD = 1 << 0,
+    // DEVTYPE=typec_*: typec port, partner, cable or altmode change.
+    UEVENT_CLASS_TYPEC = 1 << 1,
+    // DRIVER=max77759tcpc
+    UEVENT_CLASS_TCPC_DRIVER = 1 << 2,
+    // DRIVER=pogo-transport
+    UEVENT_CLASS_POGO = 1 << 3,
+    // POWER_SUPPLY_NAME=usb
+    UEVENT_CLASS_POWER_SUPPLY_USB = 1 << 4,
+    // DRIVER=google,usbc_port_cooling_dev
+    UEVENT_CLASS_OVERHEAT = 1 << 5,
+};
+
+// Uevent classes that require the port status to be re-queried.
+constexpr uint32_t kUeventClassPortStatus = UEVENT_CLASS_TYPEC | UEVENT_CLASS_TCPC_DRIVER |
+                                            UEVENT_CLASS_POGO | UEVENT_CLASS_POWER_SUPPLY_USB;
+
+/*
+ * Classifies a raw uevent as received from the netlink socket: a sequence of
+ * NUL-separated lines, the first being "<action>@<devpath>". The buffer is
+ * walked exactly once against a table built at compile time; no memory is
+ * allocated. |len| is the number of valid bytes in |msg|, the message does
+ * not need to be NUL-terminated.
+ */
+uint32_t classifyUevent(const char *msg, size_t len);
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.usb.aidl-service.UeventHub"
+
+#include "UeventHub.h"
+
+#include <android-base/parseint.h>
+#include <cutils/uevent.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <set>
+
+#include "LatencyHistogram.h"
+#include "UeventClassifier.h"
+#include "UsbTrace.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+#define UEVENT_MSG_LEN 2048
+
+using ::android::base::ParseUint;
+
+// Actions the kernel emits, see kobject_actions[] in lib/kobject_uevent.c
+constexpr const char *kUeventActions[] = {"add",    "remove",  "change", "move",
+                                          "online", "offline", "bind",   "unbind"};
+
+namespace {
+
+/*
+ * Minimal classic BPF assembler for the uevent socket filter. Kernel uevents
+ * start with "<action>@<devpath>", so a devpath prefix sits at a fixed offset
+ * once the action is known. Jumps go forward to labels that are resolved in
+ * finish(); cBPF jump offsets are 8 bits wide.
+ */
+class SocketFilterBuilder {
+  public:
+    int newLabel() {
+        mLabels.push_back(-1);
+        return mLabels.size() - 1;
+    }
+
+    void bind(int label) { mLabels[label] = mProg.size(); }
+
+    // Falls through if |str| is found at |offset|, jumps to |mismatch| otherwise.
+    void compare(size_t offset, std::string_view str, int mismatch) {
+        while (!str.empty()) {
+            size_t width = str.size() >= 4 ? 4 : str.size() >= 2 ? 2 : 1;
+            uint32_t value = 0;
+
+            // BPF_ABS loads are big endian.
+            for (size_t i = 0; i < width; i++)
+                value = (value << 8) | static_cast<uint8_t>(str[i]);
+
+            uint16_t size = width == 4 ? BPF_W : width == 2 ? BPF_H : BPF_B;
+            mProg.push_back(BPF_STMT(BPF_LD | size | BPF_ABS, static_cast<uint32_t>(offset)));
+            mFixups.push_back({mProg.size(), mismatch});
+            mProg.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0));
+
+            offset += width;
+            str.remove_prefix(width);
+        }
+    }
+
+    void ret(uint32_t value) { mProg.push_back(BPF_STMT(BPF_RET | BPF_K, value)); }
+
+    // Resolves labels. Returns false if a jump does not fit or the program is too long.
+    bool finish(std::vector<struct sock_filter> *prog) {
+        for (const auto &fixup : mFixups) {
+            int distance = mLabels[fixup.second] - static_cast<int>(fixup.first) - 1;
+            if (distance < 0 || distance > 255)
+                return false;
+            mProg[fixup.first].jf = distance;
+        }
+        if (mProg.size() > BPF_MAXINSNS)
+            return false;
+        *prog = std::move(mProg);
+        return true;
+    }
+
+  private:
+    std::vector<struct sock_filter> mProg;
+    std::vector<int> mLabels;
+    // Index of the jump instruction and label of its false branch
+    std::vector<std::pair<size_t, int>> mFixups;
+};
+
+}  // namespace
+
+bool Uevent::parse(const char *msg, size_t len) {
+    const char *end = msg + len;
+    const char *cp = msg;
+
+    numKeys = 0;
+    action = std::string_view();
+    devpath = std::string_view();
+    classes = classifyUevent(msg, len);
+
+    while (cp < end && *cp) {
+        const char *nul = static_cast<const char *>(memchr(cp, '\0', end - cp));
+        std::string_view line(cp, (nul ? nul : end) - cp);
+
+        if (cp == msg) {
+            size_t at = line.find('@');
+            if (at == std::string_view::npos)
+                return false;
+            action = line.substr(0, at);
+            devpath = line.substr(at + 1);
+        } else if (numKeys < kMaxKeys) {
+            size_t eq = line.find('=');
+            if (eq != std::string_view::npos) {
+                keys[numKeys] = line.substr(0, eq);
+                values[numKeys] = line.substr(eq + 1);
+                numKeys++;
+            }
+        }
+
+        if (!nul)
+            break;
+        cp = nul + 1;
+    }
+
+    return !action.empty();
+}
+
+std::string_view Uevent::get(std::string_view key) const {
+    for (size_t i = 0; i < numKeys; i++) {
+        if (keys[i] == key)
+            return values[i];
+    }
+    return std::string_view();
+}
+
+bool UeventHub::Subscription::matches(const Uevent &event) const {
+    if (filter.classes && !(filter.classes & event.classes))
+        return false;
+
+    if (!filter.actions.empty() &&
+        std::find(filter.actions.begin(), filter.actions.end(), event.action) ==
+            filter.actions.end())
+        return false;
+
+    if (!filter.devpathPrefixes.empty() &&
+        std::none_of(filter.devpathPrefixes.begin(), filter.devpathPrefixes.end(),
+                     [&event](const std::string &prefix) {
+                         return event.devpath.substr(0, prefix.size()) == prefix;
+                     }))
+        return false;
+
+    if (!devpathPattern.matches(event.devpath))
+        return false;
+
+    for (const auto &kv : filter.keyValues) {
+        if (event.get(kv.first) != kv.second)
+            return false;
+    }
+
+    return true;
+}
+
+UeventHub::UeventHub(unique_fd ueventFd)
+    : mInjected(ueventFd.get() != -1),
+      mNextId(0),
+      mSubscriptions(std::make_shared<const SubscriptionList>()),
+      mReceived(0),
+      mDispatched(0),
+      mFiltered(0),
+      mLastSeqnum(0),
+      mFilterLen(0),
+      mStarted(false),
+      mStopped(false) {
+    struct epoll_event ev;
+
+    unique_fd epollFd(epoll_create(8));
+    if (epollFd.get() == -1) {
+        ALOGE("epoll_create failed; errno=%d", errno);
+        abort();
+    }
+
+    if (!mInjected)
+        ueventFd.reset(uevent_open_socket(64 * 1024, true));
+    if (ueventFd.get() == -1) {
+        ALOGE("uevent_open_socket failed");
+        abort();
+    }
+    fcntl(ueventFd, F_SETFL, O_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = ueventFd.get();
+    if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, ueventFd.get(), &ev) != 0) {
+        ALOGE("epoll_ctl failed; errno=%d", errno);
+        abort();
+    }
+
+    unique_fd stopFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (stopFd.get() == -1) {
+        ALOGE("eventfd failed; errno=%d", errno);
+        abort();
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = stopFd.get();
+    if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, stopFd.get(), &ev) != 0) {
+        ALOGE("epoll_ctl failed; errno=%d", errno);
+        abort();
+    }
+
+    mEpollFd = std::move(epollFd);
+    mUeventFd = std::move(ueventFd);
+    mStopFd = std::move(stopFd);
+
+    {
+        // Nobody is subscribed yet, keep the socket quiet until somebody does.
+        std::lock_guard<std::mutex> lock(mLock);
+        updateSocketFilter();
+    }
+}
+
+UeventHub::~UeventHub() {
+    stop();
+}
+
+void UeventHub::start() {
+    if (mStarted || mStopped)
+        return;
+
+    // Held until mThread is set, dispatch takes it before any handler can call isHubThread().
+    std::lock_guard<std::mutex> dispatch(mDispatchLock);
+    if (pthread_create(&mThread, NULL, this->hubThread, this)) {
+        ALOGE("pthread creation failed %d", errno);
+        abort();
+    }
+    mStarted = true;
+}
+
+void UeventHub::stop() {
+    uint64_t value = 1;
+
+    if (mStopped.exchange(true) || !mStarted)
+        return;
+    if (isHubThread()) {
+        ALOGE("UeventHub stopped from its own thread");
+        abort();
+    }
+
+    if (TEMP_FAILURE_RETRY(write(mStopFd.get(), &value, sizeof(value))) != sizeof(value)) {
+        ALOGE("failed to wake up the hub thread; errno=%d", errno);
+        abort();
+    }
+    pthread_join(mThread, NULL);
+    ALOGI("uevent hub stopped");
+}
+
+int UeventHub::subscribe(const UeventFilter &filter, UeventHandler handler) {
+    auto subscription = std::make_shared<Subscription>();
+
+    subscription->filter = filter;
+    if (!subscription->devpathPattern.compile(filter.devpathPattern)) {
+        ALOGE("unsupported devpath pattern %s", filter.devpathPattern.c_str());
+        abort();
+    }
+    if (filter.devpathPrefixes.empty() && !subscription->devpathPattern.literalPrefix().empty())
+        subscription->filter.devpathPrefixes = {subscription->devpathPattern.literalPrefix()};
+    subscription->handler = std::move(handler);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    subscription->id = mNextId++;
+    auto subscriptions = std::make_shared<SubscriptionList>(*mSubscriptions);
+    subscriptions->push_back(subscription);
+    std::atomic_store(&mSubscriptions, std::shared_ptr<const SubscriptionList>(subscriptions));
+    updateSocketFilter();
+
+    return subscription->id;
+}
+
+void UeventHub::unsubscribe(int id) {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto subscriptions = std::make_shared<SubscriptionList>(*mSubscriptions);
+        subscriptions->erase(std::remove_if(subscriptions->begin(), subscriptions->end(),
+                                            [id](const auto &s) { return s->id == id; }),
+                             subscriptions->end());
+        std::atomic_store(&mSubscriptions, std::shared_ptr<const SubscriptionList>(subscriptions));
+        updateSocketFilter();
+    }
+
+    // Wait for an in-flight dispatch that may still reference the handler.
+    if (!isHubThread()) {
+        std::lock_guard<std::mutex> dispatch(mDispatchLock);
+    }
+}
+
+int UeventHub::addFd(int fd, uint32_t events, FdHandler handler) {
+    struct epoll_event ev;
+
+    {
+        std::lock_guard<std::mutex> lock(mFdLock);
+        mFdHandlers[fd] = std::make_shared<FdHandler>(std::move(handler));
+    }
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &ev) != 0) {
+        ALOGE("epoll_ctl failed; errno=%d", errno);
+        std::lock_guard<std::mutex> lock(mFdLock);
+        mFdHandlers.erase(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void UeventHub::removeFd(int fd) {
+    epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, fd, NULL);
+
+    {
+        std::lock_guard<std::mutex> lock(mFdLock);
+        mFdHandlers.erase(fd);
+    }
+    // Wait for an in-flight handler that may still use the fd.
+    if (!isHubThread()) {
+        std::lock_guard<std::mutex> dispatch(mDispatchLock);
+    }
+}
+
+void UeventHub::updateSocketFilter() {
+    std::set<std::string> prefixes;
+    std::vector<struct sock_filter> prog;
+    SocketFilterBuilder builder;
+
+    for (const auto &subscription : *mSubscriptions) {
+        // A subscriber without prefixes needs to see every uevent.
+        if (subscription->filter.devpathPrefixes.empty()) {
+            setsockopt(mUeventFd.get(), SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+            mFilterLen = 0;
+            ALOGI("uevent socket filter detached");
+            return;
+        }
+        prefixes.insert(subscription->filter.devpathPrefixes.begin(),
+                        subscription->filter.devpathPrefixes.end());
+    }
+
+    for (const char *action : kUeventActions) {
+        std::string header = std::string(action) + "@";
+        int nextAction = builder.newLabel();
+
+        builder.compare(0, header, nextAction);
+        for (const auto &prefix : prefixes) {
+            int nextPrefix = builder.newLabel();
+            builder.compare(header.size(), prefix, nextPrefix);
+            builder.ret(0xffffffff);
+            builder.bind(nextPrefix);
+        }
+        builder.ret(0);
+        builder.bind(nextAction);
+    }
+    builder.ret(0);
+
+    if (!builder.finish(&prog)) {
+        ALOGE("uevent socket filter too large, filtering in userspace only");
+        setsockopt(mUeventFd.get(), SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+        mFilterLen = 0;
+        return;
+    }
+
+    struct sock_fprog fprog = {
+        .len = static_cast<unsigned short>(prog.size()),
+        .filter = prog.data(),
+    };
+    if (setsockopt(mUeventFd.get(), SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog))) {
+        ALOGE("SO_ATTACH_FILTER failed; errno=%d", errno);
+        mFilterLen = 0;
+        return;
+    }
+
+    mFilterLen = prog.size();
+    ALOGI("uevent socket filter attached: %zu prefixes, %zu instructions", prefixes.size(),
+          mFilterLen);
+}
+
+void UeventHub::dump(int fd) {
+    size_t filterLen;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        filterLen = mFilterLen;
+    }
+    dprintf(fd, "uevent hub:\n");
+    dprintf(fd, "  socket filter: %zu instructions\n", filterLen);
+    dprintf(fd, "  received: %" PRIu64 " dispatched: %" PRIu64 " filtered in kernel: %" PRIu64
+            "\n", mReceived.load(), mDispatched.load(), mFiltered.load());
+}
+
+bool UeventHub::isHubThread() const {
+    return mStarted && pthread_equal(pthread_self(), mThread);
+}
+
+void UeventHub::handleUevent() {
+    char msg[UEVENT_MSG_LEN + 2];
+    Uevent event;
+    int n;
+
+    int64_t timestampNs = LatencyHistogram::now();
+    {
+        ScopedUsbTrace trace(TRACE_UEVENT_RECV);
+
+        if (mInjected)
+            n = TEMP_FAILURE_RETRY(recv(mUeventFd.get(), msg, UEVENT_MSG_LEN, 0));
+        else
+            n = uevent_kernel_multicast_recv(mUeventFd.get(), msg, UEVENT_MSG_LEN);
+    }
+    if (n <= 0)
+        return;
+    if (n >= UEVENT_MSG_LEN) /* overflow -- discard */
+        return;
+
+    msg[n] = '\0';
+    msg[n + 1] = '\0';
+
+    {
+        ScopedUsbTrace trace(TRACE_UEVENT_CLASSIFY);
+
+        if (!event.parse(msg, n))
+            return;
+    }
+    event.timestampNs = timestampNs;
+
+    mReceived++;
+    /*
+     * SEQNUM is global across all uevents, a gap between two received uevents
+     * is the number of uevents the socket filter dropped in between.
+     */
+    uint64_t seqnum;
+    if (ParseUint(std::string(event.get("SEQNUM")), &seqnum)) {
+        if (mLastSeqnum && seqnum > mLastSeqnum + 1)
+            mFiltered += seqnum - mLastSeqnum - 1;
+        mLastSeqnum = seqnum;
+    }
+
+    bool dispatched = false;
+    // Load under mDispatchLock so that a returned unsubscribe() is never followed by a call.
+    std::lock_guard<std::mutex> dispatch(mDispatchLock);
+    std::shared_ptr<const SubscriptionList> subscriptions = std::atomic_load(&mSubscriptions);
+    for (const auto &subscription : *subscriptions) {
+        if (subscription->matches(event)) {
+            subscription->handler(event);
+            dispatched = true;
+        }
+    }
+    if (dispatched)
+        mDispatched++;
+}
+
+void *UeventHub::hubThread(void *param) {
+    UeventHub *hub = (UeventHub *)param;
+    struct epoll_event events[64];
+    int nevents = 0;
+
+    while (true) {
+        nevents = epoll_wait(hub->mEpollFd.get(), events, 64, -1);
+        if (nevents == -1) {
+            if (errno == EINTR)
+                continue;
+            ALOGE("usb epoll_wait failed; errno=%d", errno);
+            break;
+        }
+
+        for (int n = 0; n < nevents; ++n) {
+            // Handlers still pending in this batch are dropped, stop() wants them gone.
+            if (events[n].data.fd == hub->mStopFd.get())
+                return NULL;
+            if (events[n].data.fd == hub->mUeventFd.get()) {
+                hub->handleUevent();
+                continue;
+            }
+
+            std::lock_guard<std::mutex> dispatch(hub->mDispatchLock);
+            std::shared_ptr<FdHandler> handler;
+            {
+                std::lock_guard<std::mutex> lock(hub->mFdLock);
+                auto it = hub->mFdHandlers.find(events[n].data.fd);
+                if (it != hub->mFdHandlers.end())
+                    handler = it->second;
+            }
+            // The fd may have been removed by a handler earlier in this batch.
+            if (handler)
+                (*handler)(events[n].events);
+        }
+    }
+    return NULL;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
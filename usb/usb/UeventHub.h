@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "DevpathPattern.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+/*
+ * Read-only key/value view of a single kernel uevent. All string_views point
+ * into the hub's receive buffer and are only valid for the duration of the
+ * handler call.
+ */
+struct Uevent {
+    static constexpr size_t kMaxKeys = 64;
+
+    // Parses a raw uevent "<action>@<devpath>\0KEY=VALUE\0...". Returns false if malformed.
+    bool parse(const char *msg, size_t len);
+    // Returns the value of |key|, or an empty view if the key is absent.
+    std::string_view get(std::string_view key) const;
+
+    std::string_view action;
+    std::string_view devpath;
+    // Bitmask of UeventClass, see UeventClassifier.h
+    uint32_t classes;
+    // CLOCK_MONOTONIC time at which the hub started receiving the uevent
+    int64_t timestampNs;
+    size_t numKeys;
+    std::string_view keys[kMaxKeys];
+    std::string_view values[kMaxKeys];
+};
+
+/*
+ * Subscription filter. A uevent is delivered to a subscriber when it passes
+ * every non-empty criterion.
+ */
+struct UeventFilter {
+    // Bitmask of UeventClass; the uevent has to fall into at least one of them.
+    uint32_t classes = 0;
+    // Accepted actions, e.g. "add", "bind", "change".
+    std::vector<std::string> actions;
+    // DevpathPattern matched against DEVPATH, compiled once at subscription time.
+    std::string devpathPattern;
+    /*
+     * Literal DEVPATH prefixes, e.g. "/devices/platform/google,pogo". Besides
+     * being checked in userspace they feed the socket filter attached to the
+     * uevent socket, so uevents none of the subscribers care about never
+     * reach the process. Defaults to the literal prefix of devpathPattern. A
+     * subscription without prefixes disables the socket filter.
+     */
+    std::vector<std::string> devpathPrefixes;
+    // KEY=VALUE pairs that all have to be present.
+    std::vector<std::pair<std::string, std::string>> keyValues;
+};
+
+/*
+ * UeventHub owns the only kernel uevent socket of the USB HAL process together
+ * with a single epoll loop. Each uevent is received and parsed once and then
+ * dispatched to the subscribers whose filter it passes. Other file
+ * descriptors (timerfds, sysfs attributes watched for POLLPRI) can be added to
+ * the same loop so that a consumer does not need a thread of its own.
+ *
+ * All handlers run on the hub thread, from start() until stop() or the
+ * destructor ends it.
+ */
+class UeventHub {
+  public:
+    using UeventHandler = std::function<void(const Uevent &)>;
+    using FdHandler = std::function<void(uint32_t events)>;
+
+    /*
+     * Opens the kernel uevent socket, unless |ueventFd| is valid. An injected
+     * fd (e.g. one end of a socketpair) receives uevents in the kernel wire
+     * format with plain recv() and skips the sender credential check, which
+     * lets tests replay captured uevent sequences.
+     *
+     * Nothing is dispatched until start(), so the owner can subscribe and
+     * set up the state its handlers use first.
+     */
+    explicit UeventHub(unique_fd ueventFd = unique_fd());
+    // Stops the hub thread, see stop().
+    ~UeventHub();
+
+    // Starts the hub thread. Called once; uevents received before are dispatched then.
+    void start();
+    /*
+     * Wakes up the hub thread through an eventfd and joins it. Once this
+     * returns no handler is running or will be invoked again; subscribing
+     * and adding fds remain valid but have no effect. Idempotent, must not
+     * be called from a handler.
+     */
+    void stop();
+
+    // Returns a subscription id to be passed to unsubscribe().
+    int subscribe(const UeventFilter &filter, UeventHandler handler);
+    /*
+     * Once this returns the handler is not running and will not be invoked
+     * again, unless called from the handler itself.
+     */
+    void unsubscribe(int id);
+
+    // Watches |fd| for |events| (EPOLLIN, EPOLLPRI, ...). The caller keeps ownership of |fd|.
+    int addFd(int fd, uint32_t events, FdHandler handler);
+    // Same guarantee as unsubscribe(): once this returns |fd| can be closed.
+    void removeFd(int fd);
+
+    // Prints uevent delivery statistics.
+    void dump(int fd);
+
+  private:
+    struct Subscription {
+        int id;
+        UeventFilter filter;
+        DevpathPattern devpathPattern;
+        UeventHandler handler;
+
+        bool matches(const Uevent &event) const;
+    };
+    using SubscriptionList = std::vector<std::shared_ptr<const Subscription>>;
+
+    static void *hubThread(void *param);
+    void handleUevent();
+    bool isHubThread() const;
+    // Rebuilds the socket filter from mSubscriptions. Called with mLock held.
+    void updateSocketFilter();
+
+    pthread_t mThread;
+    unique_fd mEpollFd;
+    unique_fd mUeventFd;
+    // eventfd written by stop() to wake up and end the hub thread
+    unique_fd mStopFd;
+    // Set when mUeventFd was injected rather than opened as a netlink socket
+    bool mInjected;
+    // Protects mSubscriptions, mNextId and mFilterLen
+    std::mutex mLock;
+    int mNextId;
+    // Copied on write so that dispatch never holds mLock while calling handlers.
+    std::shared_ptr<const SubscriptionList> mSubscriptions;
+    // Held while a uevent or fd handler is being dispatched.
+    std::mutex mDispatchLock;
+    // Protects mFdHandlers
+    std::mutex mFdLock;
+    std::map<int, std::shared_ptr<FdHandler>> mFdHandlers;
+
+    // Uevents received from the socket, i.e. accepted by the socket filter
+    std::atomic<uint64_t> mReceived;
+    // Received uevents that matched at least one subscription
+    std::atomic<uint64_t> mDispatched;
+    // Uevents the socket filter dropped, derived from gaps in SEQNUM
+    std::atomic<uint64_t> mFiltered;
+    uint64_t mLastSeqnum;
+    // Number of instructions in the attached socket filter, 0 when none is attached
+    size_t mFilterLen;
+    // Set by start(), mThread is only valid once set
+    std::atomic<bool> mStarted;
+    std::atomic<bool> mStopped;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -20,22 +20,24 @@
 #include <android-base/properties.h>
 #include <android-base/strings.h>
 #include <assert.h>
+#include <ctype.h>
 #include <cstring>
 #include <dirent.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <regex>
 #include <thread>
 #include <unordered_map>
 
-#include <cutils/uevent.h>
-#include <sys/epoll.h>
 #include <utils/Errors.h>
 #include <utils/StrongPointer.h>
 
 #include "Usb.h"
+#include "UeventClassifier.h"
+#include "UeventHub.h"
+#include "UsbTrace.h"
 
 #include <aidl/android/frameworks/stats/IStats.h>
 #include <android_hardware_usb_flags.h>
@@ -56,10 +58,7 @@ namespace aidl {
 namespace android {
 namespace hardware {
 namespace usb {
-// Set by the signal handler to destroy the thread
-volatile bool destroyThread;
 
-string enabledPath;
 constexpr char kHsi2cPath[] = "/sys/devices/platform/10d50000.hsi2c";
 constexpr char kComplianceWarningsPath[] = "device/non_compliant_reasons";
 constexpr char kComplianceWarningBC12[] = "bc12";
@@ -77,7 +76,6 @@ constexpr char kSinkLimitCurrent[] = "usb_limit_sink_current";
 constexpr char kTypecPath[] = "/sys/class/typec";
 constexpr char kDisableContatminantDetection[] = "vendor.usb.contaminantdisable";
 constexpr char kOverheatStatsPath[] = "/sys/devices/platform/google,usbc_port_cooling_dev/";
-constexpr char kOverheatStatsDev[] = "DRIVER=google,usbc_port_cooling_dev";
 constexpr char kThermalZoneForTrip[] = "VIRTUAL-USB-THROTTLING";
 constexpr char kThermalZoneForTempReadPrimary[] = "usb_pwr_therm2";
 constexpr char kThermalZoneForTempReadSecondary1[] = "usb_pwr_therm";
@@ -85,25 +83,37 @@ constexpr char kThermalZoneForTempReadSecondary2[] = "qi_therm";
 constexpr char kPogoUsbActive[] = "/sys/devices/platform/google,pogo/pogo_usb_active";
 constexpr char KPogoMoveDataToUsb[] = "/sys/devices/platform/google,pogo/move_data_to_usb";
 constexpr char kPowerSupplyUsbType[] = "/sys/class/power_supply/usb/usb_type";
-constexpr char kUdcUeventRegex[] =
+constexpr char kUdcUeventPattern[] =
     "/devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3";
 constexpr char kUdcStatePath[] =
     "/sys/devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3/state";
-constexpr char kHost1UeventRegex[] =
+constexpr char kHost1UeventPattern[] =
     "/devices/platform/11110000.usb/11110000.dwc3/xhci-hcd-exynos.[0-9].auto/usb2/2-0:1.0";
 constexpr char kHost1StatePath[] = "/sys/bus/usb/devices/usb2/2-0:1.0/usb2-port1/state";
-constexpr char kHost2UeventRegex[] =
+constexpr char kHost2UeventPattern[] =
     "/devices/platform/11110000.usb/11110000.dwc3/xhci-hcd-exynos.[0-9].auto/usb3/3-0:1.0";
 constexpr char kHost2StatePath[] = "/sys/bus/usb/devices/usb3/3-0:1.0/usb3-port1/state";
 constexpr char kDataRolePath[] = "/sys/devices/platform/11110000.usb/new_data_role";
+// DEVPATH prefixes of the uevents the port status depends on besides the TCPC client's own
+constexpr char kPogoUeventPrefix[] = "/devices/platform/google,pogo";
+constexpr char kOverheatUeventPrefix[] = "/devices/platform/google,usbc_port_cooling_dev";
 constexpr int kSamplingIntervalSec = 5;
+// Port name used by the framework for queries covering every port
+constexpr char kAllPorts[] = "all";
+// The only typec port; port status queries are ordered with its commands
+constexpr char kQueryPort[] = "port0";
+// Large enough for any of the single value attributes read through mSysfsAttributes
+constexpr size_t kSysfsBufLen = 128;
 void queryVersionHelper(android::hardware::usb::Usb *usb,
-                        std::vector<PortStatus> *currentPortStatus);
+                        std::vector<PortStatus> *currentPortStatus,
+                        uint32_t changed = PORT_STATUS_ALL, bool forceNotify = false,
+                        int64_t eventNs = 0);
 
-ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
+void Usb::enableUsbDataCommand(const string& in_portName, bool in_enable,
         int64_t in_transactionId) {
     bool result = true;
     std::vector<PortStatus> currentPortStatus;
+    // Not through mSysfsAttributes, configfs only refills its read buffer once per open.
     string pullup;
 
     ALOGI("Userspace turn %s USB data signaling. opID:%ld", in_enable ? "on" : "off",
@@ -111,43 +121,43 @@ ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
 
     if (in_enable) {
         if (!mUsbDataEnabled) {
-            if (ReadFileToString(PULLUP_PATH, &pullup)) {
+            if (ReadFileToString(sysfsPath(PULLUP_PATH), &pullup)) {
                 pullup = Trim(pullup);
                 if (pullup != kGadgetName) {
-                    if (!WriteStringToFile(kGadgetName, PULLUP_PATH)) {
+                    if (!WriteStringToFile(kGadgetName, sysfsPath(PULLUP_PATH))) {
                         ALOGE("Gadget cannot be pulled up");
                         result = false;
                     }
                 }
             }
 
-            if (!WriteStringToFile("1", USB_DATA_PATH)) {
+            if (!mSysfsAttributes.write(USB_DATA_PATH, "1")) {
                 ALOGE("Not able to turn on usb connection notification");
                 result = false;
             }
         }
     } else {
-        if (ReadFileToString(PULLUP_PATH, &pullup)) {
+        if (ReadFileToString(sysfsPath(PULLUP_PATH), &pullup)) {
             pullup = Trim(pullup);
             if (pullup == kGadgetName) {
-                if (!WriteStringToFile("none", PULLUP_PATH)) {
+                if (!WriteStringToFile("none", sysfsPath(PULLUP_PATH))) {
                     ALOGE("Gadget cannot be pulled down");
                     result = false;
                 }
             }
         }
 
-        if (!WriteStringToFile("1", ID_PATH)) {
+        if (!mSysfsAttributes.write(ID_PATH, "1")) {
             ALOGE("Not able to turn off host mode");
             result = false;
         }
 
-        if (!WriteStringToFile("0", VBUS_PATH)) {
+        if (!mSysfsAttributes.write(VBUS_PATH, "0")) {
             ALOGE("Not able to set Vbus state");
             result = false;
         }
 
-        if (!WriteStringToFile("0", USB_DATA_PATH)) {
+        if (!mSysfsAttributes.write(USB_DATA_PATH, "0")) {
             ALOGE("Not able to turn off usb connection notification");
             result = false;
         }
@@ -156,22 +166,19 @@ ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
     if (result) {
         mUsbDataEnabled = in_enable;
     }
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyEnableUsbDataStatus(
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL) {
+        ScopedAStatus ret = callback->notifyEnableUsbDataStatus(
             in_portName, in_enable, result ? Status::SUCCESS : Status::ERROR, in_transactionId);
         if (!ret.isOk())
             ALOGE("notifyEnableUsbDataStatus error %s", ret.getDescription().c_str());
     } else {
         ALOGE("Not notifying the userspace. Callback is not set");
     }
-    pthread_mutex_unlock(&mLock);
-    queryVersionHelper(this, &currentPortStatus);
-
-    return ScopedAStatus::ok();
+    queryVersionHelper(this, &currentPortStatus, PORT_STATUS_USB_DATA);
 }
 
-ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
+void Usb::enableUsbDataWhileDockedCommand(const string& in_portName,
         int64_t in_transactionId) {
     bool success = true;
     bool notSupported = true;
@@ -180,18 +187,18 @@ ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
     ALOGI("Userspace enableUsbDataWhileDocked  opID:%ld", in_transactionId);
 
     int flags = O_RDONLY;
-    ::android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(KPogoMoveDataToUsb, flags)));
+    ::android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(sysfsPath(KPogoMoveDataToUsb).c_str(), flags)));
     if (fd != -1) {
         notSupported = false;
-        success = WriteStringToFile("1", KPogoMoveDataToUsb);
+        success = WriteStringToFile("1", sysfsPath(KPogoMoveDataToUsb));
         if (!success) {
             ALOGE("Write to move_data_to_usb failed");
         }
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyEnableUsbDataWhileDockedStatus(
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL) {
+        ScopedAStatus ret = callback->notifyEnableUsbDataWhileDockedStatus(
                 in_portName, notSupported ? Status::NOT_SUPPORTED :
                 success ? Status::SUCCESS : Status::ERROR, in_transactionId);
         if (!ret.isOk())
@@ -199,180 +206,102 @@ ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
     } else {
         ALOGE("Not notifying the userspace. Callback is not set");
     }
-    pthread_mutex_unlock(&mLock);
-    queryVersionHelper(this, &currentPortStatus);
-
-    return ScopedAStatus::ok();
+    queryVersionHelper(this, &currentPortStatus, PORT_STATUS_USB_DATA);
 }
 
-ScopedAStatus Usb::resetUsbPort(const std::string& in_portName, int64_t in_transactionId) {
+void Usb::resetUsbPortCommand(const std::string& in_portName, int64_t in_transactionId) {
     bool result = true;
     std::vector<PortStatus> currentPortStatus;
 
     ALOGI("Userspace reset USB Port. opID:%ld", in_transactionId);
 
-    if (!WriteStringToFile("none", PULLUP_PATH)) {
+    if (!WriteStringToFile("none", sysfsPath(PULLUP_PATH))) {
         ALOGI("Gadget cannot be pulled down");
         result = false;
     }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ::ndk::ScopedAStatus ret = mCallback->notifyResetUsbPortStatus(
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL) {
+        ::ndk::ScopedAStatus ret = callback->notifyResetUsbPortStatus(
             in_portName, result ? Status::SUCCESS : Status::ERROR, in_transactionId);
         if (!ret.isOk())
             ALOGE("notifyTransactionStatus error %s", ret.getDescription().c_str());
     } else {
         ALOGE("Not notifying the userspace. Callback is not set");
     }
-    pthread_mutex_unlock(&mLock);
-
-    return ::ndk::ScopedAStatus::ok();
-}
-
-int Usb::getI2cBusNumber() {
-    DIR *dp;
-    unsigned int busNumber;
-
-    // Since the i2c bus number doesn't change after boot, we only need to get
-    // it once.
-    if (mI2cBusNumber >= 0) {
-        return mI2cBusNumber;
-    }
-
-    dp = opendir(kHsi2cPath);
-    if (dp != NULL) {
-        struct dirent *ep;
-
-        while ((ep = readdir(dp))) {
-            if (ep->d_type == DT_DIR) {
-                if (sscanf(ep->d_name, "i2c-%u", &busNumber) == 1) {
-                    mI2cBusNumber = busNumber;
-                    break;
-                }
-            }
-        }
-        closedir(dp);
-    }
-
-    if (mI2cBusNumber < 0) {
-        ALOGE("Failed to open %s", kHsi2cPath);
-    }
-    return mI2cBusNumber;
-}
-
-std::string_view Usb::getI2cClientPath() {
-    DIR *dp;
-    char i2cClientPathLabeled[PATH_MAX];
-    char i2cClientPathUnLabeled[PATH_MAX];
-
-    // Since the I2C client path doesn't change after boot, we only need to get
-    // it once.
-    if (!mI2cClientPath.empty()) {
-        return mI2cClientPath;
-    }
-
-    if (getI2cBusNumber() < 0) {
-        return std::string_view{""};
-    }
-
-    snprintf(i2cClientPathLabeled, sizeof(i2cClientPathLabeled),
-             "%s/i2c-%d/%s", kHsi2cPath, mI2cBusNumber,  kMax77759TcpcDevName);
-    snprintf(i2cClientPathUnLabeled, sizeof(i2cClientPathUnLabeled),
-             "%s/i2c-%d/%d-%04x", kHsi2cPath, mI2cBusNumber, mI2cBusNumber,
-             kMax77759TcpcClientId);
-
-    dp = opendir(i2cClientPathLabeled);
-    if (dp != NULL) {
-        mI2cClientPath.assign(i2cClientPathLabeled);
-        closedir(dp);
-        return mI2cClientPath;
-    }
-
-    dp = opendir(i2cClientPathUnLabeled);
-    if (dp != NULL) {
-        mI2cClientPath.assign(i2cClientPathUnLabeled);
-        closedir(dp);
-        return mI2cClientPath;
-    }
-
-    ALOGE("Failed to find the i2c client path under %s", kHsi2cPath);
-    return std::string_view{""};
 }
 
-Status queryMoistureDetectionStatus(android::hardware::usb::Usb *usb,
-                                    std::vector<PortStatus> *currentPortStatus)
+Status queryMoistureDetectionStatus(android::hardware::usb::Usb *usb, PortStatus *port)
 {
-    string enabled, status, DetectedPath;
-    std::string_view i2cPath;
-
-    (*currentPortStatus)[0].supportedContaminantProtectionModes
-            .push_back(ContaminantProtectionMode::FORCE_DISABLE);
-    (*currentPortStatus)[0].contaminantProtectionStatus = ContaminantProtectionStatus::NONE;
-    (*currentPortStatus)[0].contaminantDetectionStatus = ContaminantDetectionStatus::DISABLED;
-    (*currentPortStatus)[0].supportsEnableContaminantPresenceDetection = true;
-    (*currentPortStatus)[0].supportsEnableContaminantPresenceProtection = false;
-
-    i2cPath = usb->getI2cClientPath();
-    if (i2cPath.empty()) {
+    SysfsAttribute *enabledAttribute, *statusAttribute;
+    char buf[kSysfsBufLen];
+    std::string_view enabled, status;
+
+    port->supportedContaminantProtectionModes.clear();
+    port->supportedContaminantProtectionModes.push_back(ContaminantProtectionMode::FORCE_DISABLE);
+    port->contaminantProtectionStatus = ContaminantProtectionStatus::NONE;
+    port->contaminantDetectionStatus = ContaminantDetectionStatus::DISABLED;
+    port->supportsEnableContaminantPresenceDetection = true;
+    port->supportsEnableContaminantPresenceProtection = false;
+
+    enabledAttribute = usb->mI2cClient.attribute(kContaminantDetectionPath);
+    if (enabledAttribute == NULL) {
         ALOGE("%s: Unable to locate i2c bus node", __func__);
         return Status::ERROR;
     }
-    enabledPath = std::string{i2cPath} + "/" + kContaminantDetectionPath;
-    if (!ReadFileToString(enabledPath, &enabled)) {
+    if (!enabledAttribute->read(buf, sizeof(buf), &enabled)) {
         ALOGE("Failed to open moisture_detection_enabled");
         return Status::ERROR;
     }
 
-    enabled = Trim(enabled);
     if (enabled == "1") {
-        DetectedPath = std::string{i2cPath} + "/" + kStatusPath;
-        if (!ReadFileToString(DetectedPath, &status)) {
+        statusAttribute = usb->mI2cClient.attribute(kStatusPath);
+        if (statusAttribute == NULL) {
+            ALOGE("%s: Unable to locate i2c bus node", __func__);
+            return Status::ERROR;
+        }
+        if (!statusAttribute->read(buf, sizeof(buf), &status)) {
             ALOGE("Failed to open moisture_detected");
             return Status::ERROR;
         }
-        status = Trim(status);
         if (status == "1") {
-            (*currentPortStatus)[0].contaminantDetectionStatus =
-                ContaminantDetectionStatus::DETECTED;
-            (*currentPortStatus)[0].contaminantProtectionStatus =
-                ContaminantProtectionStatus::FORCE_DISABLE;
+            port->contaminantDetectionStatus = ContaminantDetectionStatus::DETECTED;
+            port->contaminantProtectionStatus = ContaminantProtectionStatus::FORCE_DISABLE;
         } else {
-            (*currentPortStatus)[0].contaminantDetectionStatus =
-                ContaminantDetectionStatus::NOT_DETECTED;
+            port->contaminantDetectionStatus = ContaminantDetectionStatus::NOT_DETECTED;
         }
     }
 
     ALOGI("ContaminantDetectionStatus:%d ContaminantProtectionStatus:%d",
-            (*currentPortStatus)[0].contaminantDetectionStatus,
-            (*currentPortStatus)[0].contaminantProtectionStatus);
+            port->contaminantDetectionStatus, port->contaminantProtectionStatus);
 
     return Status::SUCCESS;
 }
 
-Status queryNonCompliantChargerStatus(std::vector<PortStatus> *currentPortStatus) {
+Status queryNonCompliantChargerStatus(PortStatusCache *cache) {
     string reasons, path;
 
-    for (int i = 0; i < currentPortStatus->size(); i++) {
-        (*currentPortStatus)[i].supportsComplianceWarnings = true;
-        path = string(kTypecPath) + "/" + (*currentPortStatus)[i].portName + "/" +
+    cache->complianceWarnings.assign(cache->typec.size(), {});
+    for (int i = 0; i < cache->typec.size(); i++) {
+        path = string(kTypecPath) + "/" + cache->typec[i].portName + "/" +
                 string(kComplianceWarningsPath);
-        if (ReadFileToString(path.c_str(), &reasons)) {
+        if (ReadFileToString(sysfsPath(path), &reasons)) {
+            std::vector<ComplianceWarning> &warnings = cache->complianceWarnings[i];
             std::vector<string> reasonsList = Tokenize(reasons.c_str(), "[], \n\0");
             for (string reason : reasonsList) {
                 if (!strncmp(reason.c_str(), kComplianceWarningDebugAccessory,
                             strlen(kComplianceWarningDebugAccessory))) {
-                    (*currentPortStatus)[i].complianceWarnings.push_back(ComplianceWarning::DEBUG_ACCESSORY);
+                    warnings.push_back(ComplianceWarning::DEBUG_ACCESSORY);
                     continue;
                 }
                 if (!strncmp(reason.c_str(), kComplianceWarningBC12,
                             strlen(kComplianceWarningBC12))) {
-                    (*currentPortStatus)[i].complianceWarnings.push_back(ComplianceWarning::BC_1_2);
+                    warnings.push_back(ComplianceWarning::BC_1_2);
                     continue;
                 }
                 if (!strncmp(reason.c_str(), kComplianceWarningMissingRp,
                             strlen(kComplianceWarningMissingRp))) {
-                    (*currentPortStatus)[i].complianceWarnings.push_back(ComplianceWarning::MISSING_RP);
+                    warnings.push_back(ComplianceWarning::MISSING_RP);
                     continue;
                 }
                 if (!strncmp(reason.c_str(), kComplianceWarningOther,
@@ -382,23 +311,14 @@ Status queryNonCompliantChargerStatus(std::vector<PortStatus> *currentPortStatus
                     if (usb_flags::enable_usb_data_compliance_warning() &&
                         usb_flags::enable_input_power_limited_warning()) {
                         ALOGI("Report through INPUT_POWER_LIMITED warning");
-                        (*currentPortStatus)[i].complianceWarnings.push_back(
-                            ComplianceWarning::INPUT_POWER_LIMITED);
+                        warnings.push_back(ComplianceWarning::INPUT_POWER_LIMITED);
                         continue;
                     } else {
-                        (*currentPortStatus)[i].complianceWarnings.push_back(
-                            ComplianceWarning::OTHER);
+                        warnings.push_back(ComplianceWarning::OTHER);
                         continue;
                     }
                 }
             }
-            if ((*currentPortStatus)[i].complianceWarnings.size() > 0 &&
-                 (*currentPortStatus)[i].currentPowerRole == PortPowerRole::NONE) {
-                (*currentPortStatus)[i].currentMode = PortMode::UFP;
-                (*currentPortStatus)[i].currentPowerRole = PortPowerRole::SINK;
-                (*currentPortStatus)[i].currentDataRole = PortDataRole::NONE;
-                (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::CONNECTED;
-            }
         }
     }
     return Status::SUCCESS;
@@ -450,12 +370,24 @@ void extractRole(string *roleName) {
     }
 }
 
+std::string_view extractRole(std::string_view roleName) {
+    std::size_t first, last;
+
+    first = roleName.find("[");
+    last = roleName.find("]");
+
+    if (first != std::string_view::npos && last != std::string_view::npos) {
+        return roleName.substr(first + 1, last - first - 1);
+    }
+    return roleName;
+}
+
 void switchToDrp(const string &portName) {
     string filename = appendRoleNodeHelper(string(portName.c_str()), PortRole::mode);
     FILE *fp;
 
     if (filename != "") {
-        fp = fopen(filename.c_str(), "w");
+        fp = fopen(sysfsPath(filename).c_str(), "w");
         if (fp != NULL) {
             int ret = fputs("dual", fp);
             fclose(fp);
@@ -469,9 +401,69 @@ void switchToDrp(const string &portName) {
     }
 }
 
+// Arms POLLPRI on a typec role attribute; any change wakes up the role switch waiting on mPartnerCV.
+static void watchRoleAttribute(struct Usb *usb, const string &path, unique_fd *fd) {
+    char buf[32];
+
+    fd->reset(TEMP_FAILURE_RETRY(open(sysfsPath(path).c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd->get() == -1) {
+        ALOGE("Cannot open %s to watch role changes", path.c_str());
+        return;
+    }
+    // sysfs only reports a change after the attribute has been read once.
+    pread(fd->get(), buf, sizeof(buf), 0);
+
+    int attrFd = fd->get();
+    if (usb->mUeventHub.addFd(attrFd, EPOLLPRI, [usb, attrFd](uint32_t) {
+            char value[32];
+
+            // Re-arm, the attribute keeps polling as changed until read.
+            pread(attrFd, value, sizeof(value), 0);
+            pthread_mutex_lock(&usb->mPartnerLock);
+            usb->mRoleChanged = true;
+            pthread_cond_signal(&usb->mPartnerCV);
+            pthread_mutex_unlock(&usb->mPartnerLock);
+        }) != 0) {
+        fd->reset();
+    }
+}
+
+static void unwatchRoleAttribute(struct Usb *usb, unique_fd *fd) {
+    if (fd->get() != -1) {
+        usb->mUeventHub.removeFd(fd->get());
+        fd->reset();
+    }
+}
+
+// True once the partner is attached again and the port reports |powerRole|.
+static bool roleReached(const string &portName, const string &powerRole, int powerRoleFd) {
+    string partner = sysfsPath("/sys/class/typec/" + portName + "-partner");
+    char buf[32];
+    ssize_t n;
+
+    if (access(partner.c_str(), F_OK) || powerRoleFd == -1)
+        return false;
+
+    n = TEMP_FAILURE_RETRY(pread(powerRoleFd, buf, sizeof(buf), 0));
+    if (n <= 0)
+        return false;
+    while (n > 0 && isspace(static_cast<unsigned char>(buf[n - 1])))
+        n--;
+    return extractRole(std::string_view(buf, n)) == powerRole;
+}
+
+/*
+ * Writes the port type and waits for the partner to come back in the
+ * requested role. Partner add uevents and POLLPRI changes of the power_role
+ * and data_role attributes drive the wait: it ends as soon as the partner
+ * directory exists and power_role reads the target role after one of them.
+ * PORT_TYPE_TIMEOUT only bounds the worst case.
+ */
 bool switchMode(const string &portName, const PortRole &in_role, struct Usb *usb) {
     string filename = appendRoleNodeHelper(string(portName.c_str()), in_role.getTag());
-    string written;
+    // Port types "source" and "sink" settle in the power role of the same name.
+    string target = convertRoletoString(in_role);
+    unique_fd powerRoleFd, dataRoleFd;
     FILE *fp;
     bool roleSwitch = false;
 
@@ -480,35 +472,43 @@ bool switchMode(const string &portName, const PortRole &in_role, struct Usb *usb
         return false;
     }
 
-    fp = fopen(filename.c_str(), "w");
+    // Watch before writing so that no change is missed.
+    watchRoleAttribute(usb, appendRoleNodeHelper(portName, PortRole::powerRole), &powerRoleFd);
+    watchRoleAttribute(usb, appendRoleNodeHelper(portName, PortRole::dataRole), &dataRoleFd);
+
+    fp = fopen(sysfsPath(filename).c_str(), "w");
     if (fp != NULL) {
         // Hold the lock here to prevent loosing connected signals
         // as once the file is written the partner added signal
         // can arrive anytime.
         pthread_mutex_lock(&usb->mPartnerLock);
         usb->mPartnerUp = false;
-        int ret = fputs(convertRoletoString(in_role).c_str(), fp);
+        usb->mRoleChanged = false;
+        int ret = fputs(target.c_str(), fp);
         fclose(fp);
 
         if (ret != EOF) {
             struct timespec to;
-            struct timespec now;
-
-        wait_again:
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            to.tv_sec = now.tv_sec + PORT_TYPE_TIMEOUT;
-            to.tv_nsec = now.tv_nsec;
-
-            int err = pthread_cond_timedwait(&usb->mPartnerCV, &usb->mPartnerLock, &to);
-            // There are no uevent signals which implies role swap timed out.
-            if (err == ETIMEDOUT) {
-                ALOGI("uevents wait timedout");
-                // Validity check.
-            } else if (!usb->mPartnerUp) {
-                goto wait_again;
-                // Role switch succeeded since usb->mPartnerUp is true.
-            } else {
-                roleSwitch = true;
+
+            clock_gettime(CLOCK_MONOTONIC, &to);
+            to.tv_sec += PORT_TYPE_TIMEOUT;
+
+            while (true) {
+                // The port has to have gone through a change since the write.
+                if ((usb->mPartnerUp || usb->mRoleChanged) &&
+                    roleReached(portName, target, powerRoleFd.get())) {
+                    roleSwitch = true;
+                    break;
+                }
+                usb->mPartnerUp = false;
+                usb->mRoleChanged = false;
+
+                int err = pthread_cond_timedwait(&usb->mPartnerCV, &usb->mPartnerLock, &to);
+                // No partner or role change event, the role swap timed out.
+                if (err == ETIMEDOUT) {
+                    ALOGI("role change wait timedout");
+                    break;
+                }
             }
         } else {
             ALOGI("Role switch failed while wrting to file");
@@ -516,6 +516,10 @@ bool switchMode(const string &portName, const PortRole &in_role, struct Usb *usb
         pthread_mutex_unlock(&usb->mPartnerLock);
     }
 
+    // Outside of mPartnerLock, the attribute handlers take it.
+    unwatchRoleAttribute(usb, &powerRoleFd);
+    unwatchRoleAttribute(usb, &dataRoleFd);
+
     if (!roleSwitch)
         switchToDrp(string(portName.c_str()));
 
@@ -525,16 +529,21 @@ bool switchMode(const string &portName, const PortRole &in_role, struct Usb *usb
 void updatePortStatus(android::hardware::usb::Usb *usb) {
     std::vector<PortStatus> currentPortStatus;
 
-    queryVersionHelper(usb, &currentPortStatus);
+    // Only the data session compliance warnings changed, no sysfs part to refresh.
+    queryVersionHelper(usb, &currentPortStatus, 0);
 }
 
-Usb::Usb()
+Usb::Usb() : Usb(unique_fd()) {}
+
+Usb::Usb(unique_fd ueventFd)
     : mLock(PTHREAD_MUTEX_INITIALIZER),
       mRoleSwitchLock(PTHREAD_MUTEX_INITIALIZER),
       mPartnerLock(PTHREAD_MUTEX_INITIALIZER),
       mPartnerUp(false),
-      mUsbDataSessionMonitor(kUdcUeventRegex, kUdcStatePath, kHost1UeventRegex, kHost1StatePath,
-                             kHost2UeventRegex, kHost2StatePath, kDataRolePath,
+      mRoleChanged(false),
+      mUeventHub(std::move(ueventFd)),
+      mUsbDataSessionMonitor(&mUeventHub, kUdcUeventPattern, kUdcStatePath, kHost1UeventPattern, kHost1StatePath,
+                             kHost2UeventPattern, kHost2StatePath, kDataRolePath,
                              std::bind(&updatePortStatus, this)),
       mOverheat(ZoneInfo(TemperatureType::USB_PORT, kThermalZoneForTrip,
                          ThrottlingSeverity::CRITICAL),
@@ -545,8 +554,13 @@ Usb::Usb()
                  ZoneInfo(TemperatureType::UNKNOWN, kThermalZoneForTempReadSecondary2,
                           ThrottlingSeverity::NONE)}, kSamplingIntervalSec),
       mUsbDataEnabled(true),
-      mI2cBusNumber(-1),
-      mI2cClientPath("") {
+      mI2cClient(kHsi2cPath, kMax77759TcpcDevName, kMax77759TcpcClientId),
+      mSnapshot(std::make_shared<PortStatusSnapshot>()),
+      mTracedEventNs(0),
+      mForcePortStatusNotify(false),
+      mPortStatusNotifier("port status notifier"),
+      mUeventSubscription(-1),
+      mI2cClientSubscription(-1) {
     pthread_condattr_t attr;
     if (pthread_condattr_init(&attr)) {
         ALOGE("pthread_condattr_init failed: %s", strerror(errno));
@@ -565,13 +579,52 @@ Usb::Usb()
         abort();
     }
 
+    /*
+     * A TCPC probing late shows up with an add uevent, look for the i2c
+     * client again then. That takes every uevent of the i2c controller, so
+     * only until the client is found.
+     */
+    if (mI2cClient.path().empty()) {
+        UeventFilter filter;
+        filter.actions = {"add"};
+        filter.devpathPrefixes = {mI2cClient.controllerUeventPrefix()};
+        mI2cClientSubscription =
+            mUeventHub.subscribe(filter, [this](const Uevent &) { handleI2cClientAdded(); });
+    }
+
     ALOGI("feature flag enable_usb_data_compliance_warning: %d",
           usb_flags::enable_usb_data_compliance_warning());
     ALOGI("feature flag enable_input_power_limited_warning: %d",
           usb_flags::enable_input_power_limited_warning());
+
+    // Last: the handlers registered above use members constructed after the hub and the monitor.
+    mUeventHub.start();
 }
 
-ScopedAStatus Usb::switchRole(const string& in_portName, const PortRole& in_role,
+Usb::~Usb() {
+    /*
+     * Stop uevent and sysfs event delivery before any member goes away: hub
+     * handlers feed the command queues and the notifier, which are destroyed
+     * first. The queues then drain the commands already accepted.
+     */
+    mUeventHub.stop();
+}
+
+void Usb::recordRoleSwitchLatency(const PortRole &role, bool success, int64_t ns) {
+    // Named after the typec attribute the role is written to.
+    string transition = role.getTag() == PortRole::mode        ? "port_type:"
+                        : role.getTag() == PortRole::powerRole ? "power_role:"
+                                                               : "data_role:";
+
+    transition += convertRoletoString(role);
+
+    if (!success)
+        transition += " (failed)";
+    std::lock_guard<std::mutex> lock(mRoleSwitchStatsLock);
+    mRoleSwitchLatency[transition].record(ns);
+}
+
+void Usb::switchRoleCommand(const string& in_portName, const PortRole& in_role,
         int64_t in_transactionId) {
     string filename = appendRoleNodeHelper(string(in_portName.c_str()), in_role.getTag());
     string written;
@@ -580,21 +633,22 @@ ScopedAStatus Usb::switchRole(const string& in_portName, const PortRole& in_role
 
     if (filename == "") {
         ALOGE("Fatal: invalid node type");
-        return ScopedAStatus::ok();
+        return;
     }
 
     pthread_mutex_lock(&mRoleSwitchLock);
 
     ALOGI("filename write: %s role:%s", filename.c_str(), convertRoletoString(in_role).c_str());
+    int64_t start = LatencyHistogram::now();
 
     if (in_role.getTag() == PortRole::mode) {
         roleSwitch = switchMode(in_portName, in_role, this);
     } else {
-        fp = fopen(filename.c_str(), "w");
+        fp = fopen(sysfsPath(filename).c_str(), "w");
         if (fp != NULL) {
             int ret = fputs(convertRoletoString(in_role).c_str(), fp);
             fclose(fp);
-            if ((ret != EOF) && ReadFileToString(filename, &written)) {
+            if ((ret != EOF) && ReadFileToString(sysfsPath(filename), &written)) {
                 written = Trim(written);
                 extractRole(&written);
                 ALOGI("written: %s", written.c_str());
@@ -610,62 +664,59 @@ ScopedAStatus Usb::switchRole(const string& in_portName, const PortRole& in_role
             ALOGE("fopen failed");
         }
     }
+    recordRoleSwitchLatency(in_role, roleSwitch, LatencyHistogram::now() - start);
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-         ScopedAStatus ret = mCallback->notifyRoleSwitchStatus(
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL) {
+         ScopedAStatus ret = callback->notifyRoleSwitchStatus(
             in_portName, in_role, roleSwitch ? Status::SUCCESS : Status::ERROR, in_transactionId);
         if (!ret.isOk())
             ALOGE("RoleSwitchStatus error %s", ret.getDescription().c_str());
     } else {
         ALOGE("Not notifying the userspace. Callback is not set");
     }
-    pthread_mutex_unlock(&mLock);
     pthread_mutex_unlock(&mRoleSwitchLock);
-
-    return ScopedAStatus::ok();
 }
 
-ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
+void Usb::limitPowerTransferCommand(const string& in_portName, bool in_limit,
         int64_t in_transactionId) {
     bool sessionFail = false, success;
     std::vector<PortStatus> currentPortStatus;
-    string sinkLimitEnablePath, currentLimitPath, sourceLimitEnablePath;
-    std::string_view i2cPath;
-
-    pthread_mutex_lock(&mLock);
-    i2cPath = getI2cClientPath();
-    if (!i2cPath.empty()) {
-        sinkLimitEnablePath = std::string{i2cPath} + "/" + kSinkLimitEnable;
-        sourceLimitEnablePath = std::string{i2cPath} + "/" + kSourceLimitEnable;
-        currentLimitPath = std::string{i2cPath} + "/" + kSinkLimitCurrent;
+    SysfsAttribute *sinkLimitEnable, *sourceLimitEnable, *currentLimit;
 
+    sinkLimitEnable = mI2cClient.attribute(kSinkLimitEnable);
+    sourceLimitEnable = mI2cClient.attribute(kSourceLimitEnable);
+    currentLimit = mI2cClient.attribute(kSinkLimitCurrent);
+    // Any of them is NULL while the client is unknown or a rescan is throttled.
+    if (sinkLimitEnable != NULL && sourceLimitEnable != NULL && currentLimit != NULL) {
         if (in_limit) {
-            success = WriteStringToFile("0", currentLimitPath);
+            success = currentLimit->write("0");
             if (!success) {
                 ALOGE("Failed to set sink current limit");
                 sessionFail = true;
             }
         }
-        success = WriteStringToFile(in_limit ? "1" : "0", sinkLimitEnablePath);
+        success = sinkLimitEnable->write(in_limit ? "1" : "0");
         if (!success) {
             ALOGE("Failed to %s sink current limit: %s", in_limit ? "enable" : "disable",
-                  sinkLimitEnablePath.c_str());
+                  sinkLimitEnable->path().c_str());
             sessionFail = true;
         }
-        success = WriteStringToFile(in_limit ? "1" : "0", sourceLimitEnablePath);
+        success = sourceLimitEnable->write(in_limit ? "1" : "0");
         if (!success) {
             ALOGE("Failed to %s source current limit: %s", in_limit ? "enable" : "disable",
-                  sourceLimitEnablePath.c_str());
+                  sourceLimitEnable->path().c_str());
                   sessionFail = true;
         }
     } else {
         sessionFail = true;
         ALOGE("%s: Unable to locate i2c bus node", __func__);
     }
+
     ALOGI("limitPowerTransfer limit:%c opId:%ld", in_limit ? 'y' : 'n', in_transactionId);
-    if (mCallback != NULL && in_transactionId >= 0) {
-        ScopedAStatus ret = mCallback->notifyLimitPowerTransferStatus(
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL && in_transactionId >= 0) {
+        ScopedAStatus ret = callback->notifyLimitPowerTransferStatus(
                 in_portName, in_limit, sessionFail ? Status::ERROR : Status::SUCCESS,
                 in_transactionId);
         if (!ret.isOk())
@@ -674,51 +725,48 @@ ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
         ALOGE("Not notifying the userspace. Callback is not set");
     }
 
-    pthread_mutex_unlock(&mLock);
-    queryVersionHelper(this, &currentPortStatus);
-
-    return ScopedAStatus::ok();
+    queryVersionHelper(this, &currentPortStatus, PORT_STATUS_POWER_LIMIT);
 }
 
-Status queryPowerTransferStatus(android::hardware::usb::Usb *usb,
-                                std::vector<PortStatus> *currentPortStatus) {
-    string limitedPath, enabled;
-    std::string_view i2cPath;
+Status queryPowerTransferStatus(android::hardware::usb::Usb *usb, PortStatus *port) {
+    SysfsAttribute *limited;
+    char buf[kSysfsBufLen];
+    std::string_view enabled;
 
-    i2cPath = usb->getI2cClientPath();
-    if (i2cPath.empty()) {
+    limited = usb->mI2cClient.attribute(kSinkLimitEnable);
+    if (limited == NULL) {
         ALOGE("%s: Unable to locate i2c bus node", __func__);
         return Status::ERROR;
     }
-    limitedPath = std::string{i2cPath} + "/" + kSinkLimitEnable;
-    if (!ReadFileToString(limitedPath, &enabled)) {
+    if (!limited->read(buf, sizeof(buf), &enabled)) {
         ALOGE("Failed to open limit_sink_enable");
         return Status::ERROR;
     }
 
-    enabled = Trim(enabled);
-    (*currentPortStatus)[0].powerTransferLimited = enabled == "1";
+    port->powerTransferLimited = enabled == "1";
 
-    ALOGI("powerTransferLimited:%d", (*currentPortStatus)[0].powerTransferLimited ? 1 : 0);
+    ALOGI("powerTransferLimited:%d", port->powerTransferLimited ? 1 : 0);
     return Status::SUCCESS;
 }
 
-Status getAccessoryConnected(const string &portName, string *accessory) {
+Status getAccessoryConnected(android::hardware::usb::Usb *usb, const string &portName,
+                             char *buf, size_t size, std::string_view *accessory) {
     string filename = "/sys/class/typec/" + portName + "-partner/accessory_mode";
 
-    if (!ReadFileToString(filename, accessory)) {
+    if (!usb->mSysfsAttributes.read(filename, buf, size, accessory)) {
         ALOGE("getAccessoryConnected: Failed to open filesystem node: %s", filename.c_str());
         return Status::ERROR;
     }
-    *accessory = Trim(*accessory);
 
     return Status::SUCCESS;
 }
 
-Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *currentRole) {
+Status getCurrentRoleHelper(android::hardware::usb::Usb *usb, const string &portName,
+                            bool connected, PortRole *currentRole) {
     string filename;
-    string roleName;
-    string accessory;
+    char buf[kSysfsBufLen];
+    std::string_view roleName;
+    std::string_view accessory;
 
     // Mode
 
@@ -739,7 +787,8 @@ Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *cu
         return Status::SUCCESS;
 
     if (currentRole->getTag() == PortRole::mode) {
-        if (getAccessoryConnected(portName, &accessory) != Status::SUCCESS) {
+        if (getAccessoryConnected(usb, portName, buf, sizeof(buf), &accessory) !=
+            Status::SUCCESS) {
             return Status::ERROR;
         }
         if (accessory == "analog_audio") {
@@ -751,13 +800,12 @@ Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *cu
         }
     }
 
-    if (!ReadFileToString(filename, &roleName)) {
+    if (!usb->mSysfsAttributes.read(filename, buf, sizeof(buf), &roleName)) {
         ALOGE("getCurrentRole: Failed to open filesystem node: %s", filename.c_str());
         return Status::ERROR;
     }
 
-    roleName = Trim(roleName);
-    extractRole(&roleName);
+    roleName = extractRole(roleName);
 
     if (roleName == "source") {
         currentRole->set<PortRole::powerRole>(PortPowerRole::SOURCE);
@@ -785,7 +833,7 @@ Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *cu
 Status getTypeCPortNamesHelper(std::unordered_map<string, bool> *names) {
     DIR *dp;
 
-    dp = opendir(kTypecPath);
+    dp = opendir(sysfsPath(kTypecPath).c_str());
     if (dp != NULL) {
         struct dirent *ep;
 
@@ -810,12 +858,12 @@ Status getTypeCPortNamesHelper(std::unordered_map<string, bool> *names) {
     return Status::ERROR;
 }
 
-bool canSwitchRoleHelper(const string &portName) {
+bool canSwitchRoleHelper(android::hardware::usb::Usb *usb, const string &portName) {
     string filename = "/sys/class/typec/" + portName + "-partner/supports_usb_power_delivery";
-    string supportsPD;
+    char buf[kSysfsBufLen];
+    std::string_view supportsPD;
 
-    if (ReadFileToString(filename, &supportsPD)) {
-        supportsPD = Trim(supportsPD);
+    if (usb->mSysfsAttributes.read(filename, buf, sizeof(buf), &supportsPD)) {
         if (supportsPD == "yes") {
             return true;
         }
@@ -824,95 +872,60 @@ bool canSwitchRoleHelper(const string &portName) {
     return false;
 }
 
-Status getPortStatusHelper(android::hardware::usb::Usb *usb,
-        std::vector<PortStatus> *currentPortStatus) {
+Status getPortStatusHelper(android::hardware::usb::Usb *usb, PortStatusCache *cache) {
     std::unordered_map<string, bool> names;
     Status result = getTypeCPortNamesHelper(&names);
     int i = -1;
 
+    cache->typec.clear();
+    cache->connected.clear();
     if (result == Status::SUCCESS) {
-        currentPortStatus->resize(names.size());
+        cache->typec.resize(names.size());
+        cache->connected.resize(names.size());
         for (std::pair<string, bool> port : names) {
             i++;
             ALOGI("%s", port.first.c_str());
-            (*currentPortStatus)[i].portName = port.first;
+            cache->typec[i].portName = port.first;
+            cache->connected[i] = port.second;
 
             PortRole currentRole;
             currentRole.set<PortRole::powerRole>(PortPowerRole::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS){
-                (*currentPortStatus)[i].currentPowerRole = currentRole.get<PortRole::powerRole>();
+            if (getCurrentRoleHelper(usb, port.first, port.second, &currentRole) == Status::SUCCESS){
+                cache->typec[i].currentPowerRole = currentRole.get<PortRole::powerRole>();
             } else {
                 ALOGE("Error while retrieving portNames");
                 goto done;
             }
 
             currentRole.set<PortRole::dataRole>(PortDataRole::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
-                (*currentPortStatus)[i].currentDataRole = currentRole.get<PortRole::dataRole>();
+            if (getCurrentRoleHelper(usb, port.first, port.second, &currentRole) == Status::SUCCESS) {
+                cache->typec[i].currentDataRole = currentRole.get<PortRole::dataRole>();
             } else {
                 ALOGE("Error while retrieving current port role");
                 goto done;
             }
 
             currentRole.set<PortRole::mode>(PortMode::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
-                (*currentPortStatus)[i].currentMode = currentRole.get<PortRole::mode>();
+            if (getCurrentRoleHelper(usb, port.first, port.second, &currentRole) == Status::SUCCESS) {
+                cache->typec[i].currentMode = currentRole.get<PortRole::mode>();
             } else {
                 ALOGE("Error while retrieving current data role");
                 goto done;
             }
 
-            (*currentPortStatus)[i].canChangeMode = true;
-            (*currentPortStatus)[i].canChangeDataRole =
-                port.second ? canSwitchRoleHelper(port.first) : false;
-            (*currentPortStatus)[i].canChangePowerRole =
-                port.second ? canSwitchRoleHelper(port.first) : false;
-
-            (*currentPortStatus)[i].supportedModes.push_back(PortMode::DRP);
-
-            bool dataEnabled = true;
-            string pogoUsbActive = "0";
-            if (ReadFileToString(string(kPogoUsbActive), &pogoUsbActive) &&
-                stoi(Trim(pogoUsbActive)) == 1) {
-                (*currentPortStatus)[i].usbDataStatus.push_back(UsbDataStatus::DISABLED_DOCK);
-                dataEnabled = false;
-            }
-            if (!usb->mUsbDataEnabled) {
-                (*currentPortStatus)[i].usbDataStatus.push_back(UsbDataStatus::DISABLED_FORCE);
-                dataEnabled = false;
-            }
-            if (dataEnabled) {
-                (*currentPortStatus)[i].usbDataStatus.push_back(UsbDataStatus::ENABLED);
-            }
+            cache->typec[i].canChangeMode = true;
+            cache->typec[i].canChangeDataRole =
+                port.second ? canSwitchRoleHelper(usb, port.first) : false;
+            cache->typec[i].canChangePowerRole =
+                port.second ? canSwitchRoleHelper(usb, port.first) : false;
 
-            // When connected return powerBrickStatus
-            if (port.second) {
-                string usbType;
-                if ((*currentPortStatus)[i].currentPowerRole == PortPowerRole::SOURCE) {
-                    (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
-                } else if (ReadFileToString(string(kPowerSupplyUsbType), &usbType)) {
-                    if (strstr(usbType.c_str(), "[D")) {
-                        (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::CONNECTED;
-                    } else if (strstr(usbType.c_str(), "[U")) {
-                        (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::UNKNOWN;
-                    } else {
-                        (*currentPortStatus)[i].powerBrickStatus =
-                                PowerBrickStatus::NOT_CONNECTED;
-                    }
-                } else {
-                    ALOGE("Error while reading usb_type");
-                }
-            } else {
-                (*currentPortStatus)[i].powerBrickStatus = PowerBrickStatus::NOT_CONNECTED;
-            }
+            cache->typec[i].supportedModes.push_back(PortMode::DRP);
 
-            ALOGI("%d:%s connected:%d canChangeMode:%d canChagedata:%d canChangePower:%d "
-                  "usbDataEnabled:%d",
+            ALOGI("%d:%s connected:%d canChangeMode:%d canChagedata:%d canChangePower:%d",
                 i, port.first.c_str(), port.second,
-                (*currentPortStatus)[i].canChangeMode,
-                (*currentPortStatus)[i].canChangeDataRole,
-                (*currentPortStatus)[i].canChangePowerRole,
-                dataEnabled ? 1 : 0);
+                cache->typec[i].canChangeMode,
+                cache->typec[i].canChangeDataRole,
+                cache->typec[i].canChangePowerRole);
         }
 
         return Status::SUCCESS;
@@ -921,6 +934,56 @@ done:
     return Status::ERROR;
 }
 
+void queryUsbDataStatus(android::hardware::usb::Usb *usb, PortStatusCache *cache) {
+    bool dataEnabled = true;
+    char buf[kSysfsBufLen];
+    std::string_view pogoUsbActive;
+
+    cache->usbDataStatus.clear();
+    if (usb->mSysfsAttributes.read(kPogoUsbActive, buf, sizeof(buf), &pogoUsbActive) &&
+        pogoUsbActive == "1") {
+        cache->usbDataStatus.push_back(UsbDataStatus::DISABLED_DOCK);
+        dataEnabled = false;
+    }
+    if (!usb->mUsbDataEnabled) {
+        cache->usbDataStatus.push_back(UsbDataStatus::DISABLED_FORCE);
+        dataEnabled = false;
+    }
+    if (dataEnabled) {
+        cache->usbDataStatus.push_back(UsbDataStatus::ENABLED);
+    }
+
+    ALOGI("usbDataEnabled:%d", dataEnabled ? 1 : 0);
+}
+
+void queryPowerBrickStatus(android::hardware::usb::Usb *usb, PortStatusCache *cache) {
+    char buf[kSysfsBufLen];
+    std::string_view usbType;
+    bool usbTypeRead = false;
+
+    cache->powerBrickStatus.assign(cache->typec.size(), PowerBrickStatus::UNKNOWN);
+    for (int i = 0; i < cache->typec.size(); i++) {
+        // When connected return powerBrickStatus
+        if (!cache->connected[i]) {
+            cache->powerBrickStatus[i] = PowerBrickStatus::NOT_CONNECTED;
+        } else if (cache->typec[i].currentPowerRole == PortPowerRole::SOURCE) {
+            cache->powerBrickStatus[i] = PowerBrickStatus::NOT_CONNECTED;
+        } else if (usbTypeRead ||
+                   usb->mSysfsAttributes.read(kPowerSupplyUsbType, buf, sizeof(buf), &usbType)) {
+            usbTypeRead = true;
+            if (usbType.find("[D") != std::string_view::npos) {
+                cache->powerBrickStatus[i] = PowerBrickStatus::CONNECTED;
+            } else if (usbType.find("[U") != std::string_view::npos) {
+                cache->powerBrickStatus[i] = PowerBrickStatus::UNKNOWN;
+            } else {
+                cache->powerBrickStatus[i] = PowerBrickStatus::NOT_CONNECTED;
+            }
+        } else {
+            ALOGE("Error while reading usb_type");
+        }
+    }
+}
+
 void queryUsbDataSession(android::hardware::usb::Usb *usb,
                           std::vector<PortStatus> *currentPortStatus) {
     std::vector<ComplianceWarning> warnings;
@@ -933,66 +996,183 @@ void queryUsbDataSession(android::hardware::usb::Usb *usb,
         warnings.end());
 }
 
-void queryVersionHelper(android::hardware::usb::Usb *usb,
-                        std::vector<PortStatus> *currentPortStatus) {
-    Status status;
-    pthread_mutex_lock(&usb->mLock);
-    status = getPortStatusHelper(usb, currentPortStatus);
-    queryMoistureDetectionStatus(usb, currentPortStatus);
-    queryPowerTransferStatus(usb, currentPortStatus);
-    queryNonCompliantChargerStatus(currentPortStatus);
+// Builds the port status reported to the framework from the cached parts.
+void composePortStatus(android::hardware::usb::Usb *usb, const PortStatusCache &cache,
+                       std::vector<PortStatus> *currentPortStatus) {
+    *currentPortStatus = cache.typec;
+
+    for (int i = 0; i < currentPortStatus->size(); i++) {
+        PortStatus &port = (*currentPortStatus)[i];
+
+        port.usbDataStatus = cache.usbDataStatus;
+        port.powerBrickStatus = cache.powerBrickStatus[i];
+
+        port.supportsComplianceWarnings = true;
+        port.complianceWarnings = cache.complianceWarnings[i];
+        if (port.complianceWarnings.size() > 0 && port.currentPowerRole == PortPowerRole::NONE) {
+            port.currentMode = PortMode::UFP;
+            port.currentPowerRole = PortPowerRole::SINK;
+            port.currentDataRole = PortDataRole::NONE;
+            port.powerBrickStatus = PowerBrickStatus::CONNECTED;
+        }
+    }
+
+    if (currentPortStatus->empty())
+        return;
+
+    PortStatus &port0 = (*currentPortStatus)[0];
+    port0.supportedContaminantProtectionModes = cache.port0.supportedContaminantProtectionModes;
+    port0.contaminantProtectionStatus = cache.port0.contaminantProtectionStatus;
+    port0.contaminantDetectionStatus = cache.port0.contaminantDetectionStatus;
+    port0.supportsEnableContaminantPresenceDetection =
+        cache.port0.supportsEnableContaminantPresenceDetection;
+    port0.supportsEnableContaminantPresenceProtection =
+        cache.port0.supportsEnableContaminantPresenceProtection;
+    port0.powerTransferLimited = cache.port0.powerTransferLimited;
+
+    ScopedUsbTrace trace(TRACE_USB_DATA_SESSION);
     queryUsbDataSession(usb, currentPortStatus);
-    if (usb->mCallback != NULL) {
-        ScopedAStatus ret = usb->mCallback->notifyPortStatusChange(*currentPortStatus,
-            status);
-        if (!ret.isOk())
-            ALOGE("queryPortStatus error %s", ret.getDescription().c_str());
-    } else {
+}
+
+/*
+ * Sends the current snapshot through notifyPortStatusChange unless it equals
+ * the one last sent to the same callback and no caller asked to force it.
+ * Only runs on mPortStatusNotifier, which keeps notifications in order
+ * without holding any lock across the binder call.
+ */
+static void notifyPortStatusChange(android::hardware::usb::Usb *usb) {
+    shared_ptr<const PortStatusSnapshot> snapshot = usb->getSnapshot();
+    shared_ptr<const PortStatusSnapshot> &notified = usb->mNotifiedSnapshot;
+    bool force = usb->mForcePortStatusNotify.exchange(false);
+
+    if (snapshot->callback == NULL) {
         ALOGI("Notifying userspace skipped. Callback is NULL");
+    } else if (!force && notified != NULL && notified->callback == snapshot->callback &&
+               notified->status == snapshot->status &&
+               notified->portStatus == snapshot->portStatus) {
+        ALOGV("Port status unchanged, notification skipped");
+    } else {
+        {
+            ScopedUsbTrace trace(TRACE_NOTIFY_CALLBACK);
+            ScopedAStatus ret = snapshot->callback->notifyPortStatusChange(
+                snapshot->portStatus, snapshot->status);
+            if (!ret.isOk())
+                ALOGE("queryPortStatus error %s", ret.getDescription().c_str());
+        }
+        notified = snapshot;
+        // Snapshots published without a uevent carry the last one over, count it once.
+        if (snapshot->eventNs && snapshot->eventNs != usb->mTracedEventNs) {
+            recordUsbTrace(TRACE_UEVENT_TO_CALLBACK, snapshot->eventNs,
+                           LatencyHistogram::now());
+            usb->mTracedEventNs = snapshot->eventNs;
+        }
+    }
+}
+
+/*
+ * Refreshes the |changed| parts of the cached port status and publishes the
+ * composed status as a new snapshot. The callback is notified asynchronously
+ * if the status differs from the one last sent, or if |forceNotify| is set.
+ */
+void queryVersionHelper(android::hardware::usb::Usb *usb,
+                        std::vector<PortStatus> *currentPortStatus,
+                        uint32_t changed, bool forceNotify, int64_t eventNs) {
+    PortStatusCache *cache = &usb->mPortStatusCache;
+
+    pthread_mutex_lock(&usb->mLock);
+    changed |= PORT_STATUS_ALL & ~cache->valid;
+    // Per port parts have to follow the port list.
+    if (changed & PORT_STATUS_TYPEC)
+        changed |= PORT_STATUS_POWER_BRICK | PORT_STATUS_COMPLIANCE;
+    cache->valid |= changed;
+
+    if (changed & PORT_STATUS_TYPEC) {
+        ScopedUsbTrace trace(TRACE_TYPEC_STATUS);
+        cache->typecStatus = getPortStatusHelper(usb, cache);
+    }
+    if (changed & PORT_STATUS_USB_DATA)
+        queryUsbDataStatus(usb, cache);
+    if (changed & PORT_STATUS_POWER_BRICK)
+        queryPowerBrickStatus(usb, cache);
+    if (changed & PORT_STATUS_CONTAMINANT) {
+        ScopedUsbTrace trace(TRACE_MOISTURE_DETECTION);
+        queryMoistureDetectionStatus(usb, &cache->port0);
+    }
+    if (changed & PORT_STATUS_POWER_LIMIT) {
+        ScopedUsbTrace trace(TRACE_POWER_TRANSFER);
+        queryPowerTransferStatus(usb, &cache->port0);
+    }
+    if (changed & PORT_STATUS_COMPLIANCE) {
+        ScopedUsbTrace trace(TRACE_NON_COMPLIANT_CHARGER);
+        queryNonCompliantChargerStatus(cache);
+    }
+
+    composePortStatus(usb, *cache, currentPortStatus);
+
+    shared_ptr<const PortStatusSnapshot> previous = usb->getSnapshot();
+    bool unchanged = previous->status == cache->typecStatus &&
+                     previous->portStatus == *currentPortStatus;
+    if (!unchanged) {
+        auto snapshot = std::make_shared<PortStatusSnapshot>();
+
+        snapshot->portStatus = *currentPortStatus;
+        snapshot->status = cache->typecStatus;
+        snapshot->callback = previous->callback;
+        snapshot->eventNs = eventNs ? eventNs : previous->eventNs;
+        std::atomic_store(&usb->mSnapshot, shared_ptr<const PortStatusSnapshot>(snapshot));
     }
     pthread_mutex_unlock(&usb->mLock);
+
+    if (forceNotify)
+        usb->mForcePortStatusNotify = true;
+    // A pending notification of an unchanged status already covers this one.
+    else if (unchanged && !usb->mForcePortStatusNotify)
+        return;
+    usb->mPortStatusNotifier.enqueueCoalesced(
+        "notifyPortStatusChange", [usb] { notifyPortStatusChange(usb); }, nullptr);
 }
 
-ScopedAStatus Usb::queryPortStatus(int64_t in_transactionId) {
+void Usb::queryPortStatusCommand() {
     std::vector<PortStatus> currentPortStatus;
 
-    queryVersionHelper(this, &currentPortStatus);
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyQueryPortStatus(
-            "all", Status::SUCCESS, in_transactionId);
+    queryVersionHelper(this, &currentPortStatus, PORT_STATUS_ALL, true);
+}
+
+void Usb::notifyQueryPortStatus(int64_t in_transactionId) {
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL) {
+        ScopedAStatus ret = callback->notifyQueryPortStatus(
+            kAllPorts, Status::SUCCESS, in_transactionId);
         if (!ret.isOk())
             ALOGE("notifyQueryPortStatus error %s", ret.getDescription().c_str());
     } else {
         ALOGE("Not notifying the userspace. Callback is not set");
     }
-    pthread_mutex_unlock(&mLock);
-
-    return ScopedAStatus::ok();
 }
 
-ScopedAStatus Usb::enableContaminantPresenceDetection(const string& in_portName,
+void Usb::enableContaminantPresenceDetectionCommand(const string& in_portName,
         bool in_enable, int64_t in_transactionId) {
     string disable = GetProperty(kDisableContatminantDetection, "");
     std::vector<PortStatus> currentPortStatus;
+    SysfsAttribute *enabled;
     bool success = true;
 
-    if (disable != "true")
-        success = WriteStringToFile(in_enable ? "1" : "0", enabledPath);
+    if (disable != "true") {
+        enabled = mI2cClient.attribute(kContaminantDetectionPath);
+        success = enabled != NULL && enabled->write(in_enable ? "1" : "0");
+    }
 
-    pthread_mutex_lock(&mLock);
-    if (mCallback != NULL) {
-        ScopedAStatus ret = mCallback->notifyContaminantEnabledStatus(
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL) {
+        ScopedAStatus ret = callback->notifyContaminantEnabledStatus(
             in_portName, in_enable, success ? Status::SUCCESS : Status::ERROR, in_transactionId);
         if (!ret.isOk())
             ALOGE("notifyContaminantEnabledStatus error %s", ret.getDescription().c_str());
     } else {
         ALOGE("Not notifying the userspace. Callback is not set");
     }
-    pthread_mutex_unlock(&mLock);
 
-    queryVersionHelper(this, &currentPortStatus);
-    return ScopedAStatus::ok();
+    queryVersionHelper(this, &currentPortStatus, PORT_STATUS_CONTAMINANT);
 }
 
 void report_overheat_event(android::hardware::usb::Usb *usb) {
@@ -1001,19 +1181,20 @@ void report_overheat_event(android::hardware::usb::Usb *usb) {
 
     overheat_info.set_plug_temperature_deci_c(usb->mPluggedTemperatureCelsius * 10);
     overheat_info.set_max_temperature_deci_c(usb->mOverheat.getMaxOverheatTemperature() * 10);
-    if (ReadFileToString(string(kOverheatStatsPath) + "trip_time", &contents)) {
+    if (ReadFileToString(sysfsPath(string(kOverheatStatsPath) + "trip_time"), &contents)) {
         overheat_info.set_time_to_overheat_secs(stoi(Trim(contents)));
     } else {
         ALOGE("Unable to read trip_time");
         return;
     }
-    if (ReadFileToString(string(kOverheatStatsPath) + "hysteresis_time", &contents)) {
+    if (ReadFileToString(sysfsPath(string(kOverheatStatsPath) + "hysteresis_time"),
+                         &contents)) {
         overheat_info.set_time_to_hysteresis_secs(stoi(Trim(contents)));
     } else {
         ALOGE("Unable to read hysteresis_time");
         return;
     }
-    if (ReadFileToString(string(kOverheatStatsPath) + "cleared_time", &contents)) {
+    if (ReadFileToString(sysfsPath(string(kOverheatStatsPath) + "cleared_time"), &contents)) {
         overheat_info.set_time_to_inactive_secs(stoi(Trim(contents)));
     } else {
         ALOGE("Unable to read cleared_time");
@@ -1028,177 +1209,313 @@ void report_overheat_event(android::hardware::usb::Usb *usb) {
     }
 }
 
-struct data {
-    int uevent_fd;
-    ::aidl::android::hardware::usb::Usb *usb;
-};
-
-static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
-    char msg[UEVENT_MSG_LEN + 2];
-    char *cp;
-    int n;
+static void uevent_event(const Uevent &event, android::hardware::usb::Usb *usb) {
+    if (event.classes & UEVENT_CLASS_PARTNER_ADD) {
+        ALOGI("partner added");
+        pthread_mutex_lock(&usb->mPartnerLock);
+        usb->mPartnerUp = true;
+        pthread_cond_signal(&usb->mPartnerCV);
+        pthread_mutex_unlock(&usb->mPartnerLock);
+    }
 
-    n = uevent_kernel_multicast_recv(payload->uevent_fd, msg, UEVENT_MSG_LEN);
-    if (n <= 0)
-        return;
-    if (n >= UEVENT_MSG_LEN) /* overflow -- discard */
-        return;
+    if (event.classes & kUeventClassPortStatus) {
+        std::vector<PortStatus> currentPortStatus;
+        uint32_t changed = 0;
 
-    msg[n] = '\0';
-    msg[n + 1] = '\0';
-    cp = msg;
-
-    while (*cp) {
-        if (std::regex_match(cp, std::regex("(add)(.*)(-partner)"))) {
-            ALOGI("partner added");
-            pthread_mutex_lock(&payload->usb->mPartnerLock);
-            payload->usb->mPartnerUp = true;
-            pthread_cond_signal(&payload->usb->mPartnerCV);
-            pthread_mutex_unlock(&payload->usb->mPartnerLock);
-        } else if (!strncmp(cp, "DEVTYPE=typec_", strlen("DEVTYPE=typec_")) ||
-                   !strncmp(cp, "DRIVER=max77759tcpc",
-                            strlen("DRIVER=max77759tcpc")) ||
-                   !strncmp(cp, "DRIVER=pogo-transport",
-                            strlen("DRIVER=pogo-transport")) ||
-                   !strncmp(cp, "POWER_SUPPLY_NAME=usb",
-                            strlen("POWER_SUPPLY_NAME=usb"))) {
-            std::vector<PortStatus> currentPortStatus;
-            queryVersionHelper(payload->usb, &currentPortStatus);
-
-            // Role switch is not in progress and port is in disconnected state
-            if (!pthread_mutex_trylock(&payload->usb->mRoleSwitchLock)) {
-                for (unsigned long i = 0; i < currentPortStatus.size(); i++) {
-                    DIR *dp =
-                        opendir(string("/sys/class/typec/" +
-                                            string(currentPortStatus[i].portName.c_str()) +
-                                            "-partner").c_str());
-                    if (dp == NULL) {
-                        switchToDrp(currentPortStatus[i].portName);
-                    } else {
-                        closedir(dp);
-                    }
+        /*
+         * Contaminant detection state changes are reported by the tcpc driver.
+         * usb_limit_sink_enable is a tcpc attribute that the kernel also
+         * toggles on its own, the change shows up as a tcpc or usb power
+         * supply uevent.
+         */
+        if (event.classes & (UEVENT_CLASS_TYPEC | UEVENT_CLASS_TCPC_DRIVER))
+            changed |= PORT_STATUS_TYPEC | PORT_STATUS_CONTAMINANT | PORT_STATUS_POWER_LIMIT;
+        if (event.classes & UEVENT_CLASS_POGO)
+            changed |= PORT_STATUS_USB_DATA;
+        if (event.classes & UEVENT_CLASS_POWER_SUPPLY_USB)
+            changed |= PORT_STATUS_POWER_BRICK | PORT_STATUS_COMPLIANCE | PORT_STATUS_POWER_LIMIT;
+        queryVersionHelper(usb, &currentPortStatus, changed, false, event.timestampNs);
+
+        // Role switch is not in progress and port is in disconnected state
+        if (!pthread_mutex_trylock(&usb->mRoleSwitchLock)) {
+            for (unsigned long i = 0; i < currentPortStatus.size(); i++) {
+                DIR *dp =
+                    opendir(sysfsPath("/sys/class/typec/" +
+                                      string(currentPortStatus[i].portName.c_str()) +
+                                      "-partner").c_str());
+                if (dp == NULL) {
+                    switchToDrp(currentPortStatus[i].portName);
+                } else {
+                    closedir(dp);
                 }
-                pthread_mutex_unlock(&payload->usb->mRoleSwitchLock);
             }
-            break;
-        } else if (!strncmp(cp, kOverheatStatsDev, strlen(kOverheatStatsDev))) {
-            ALOGV("Overheat Cooling device suez update");
-            report_overheat_event(payload->usb);
-        }
-        /* advance to after the next \0 */
-        while (*cp++) {
+            pthread_mutex_unlock(&usb->mRoleSwitchLock);
         }
+    } else if (event.classes & UEVENT_CLASS_OVERHEAT) {
+        ALOGV("Overheat Cooling device suez update");
+        report_overheat_event(usb);
     }
 }
 
-void *work(void *param) {
-    int epoll_fd, uevent_fd;
-    struct epoll_event ev;
-    int nevents = 0;
-    struct data payload;
+UsbCommandQueue *Usb::getCommandQueue(const string &portName) {
+    std::lock_guard<std::mutex> lock(mCommandQueuesLock);
 
-    ALOGE("creating thread");
+    auto it = mCommandQueues.find(portName);
+    if (it != mCommandQueues.end())
+        return it->second.get();
 
-    uevent_fd = uevent_open_socket(64 * 1024, true);
-
-    if (uevent_fd < 0) {
-        ALOGE("uevent_init: uevent_open_socket failed\n");
+    // Only the typec ports get a queue, so a client cannot grow the map at will.
+    std::unordered_map<string, bool> names;
+    if (getTypeCPortNamesHelper(&names) != Status::SUCCESS || !names.count(portName)) {
+        ALOGE("Unknown port %s", portName.c_str());
         return NULL;
     }
+    it = mCommandQueues.emplace(portName, std::make_unique<UsbCommandQueue>(portName)).first;
+    return it->second.get();
+}
 
-    payload.uevent_fd = uevent_fd;
-    payload.usb = (::aidl::android::hardware::usb::Usb *)param;
-
-    fcntl(uevent_fd, F_SETFL, O_NONBLOCK);
-
-    ev.events = EPOLLIN;
-    ev.data.ptr = (void *)uevent_event;
-
-    epoll_fd = epoll_create(64);
-    if (epoll_fd == -1) {
-        ALOGE("epoll_create failed; errno=%d", errno);
-        goto error;
+void Usb::notifyUnknownPort(const char *command, const UnknownPortNotify &notify) {
+    shared_ptr<IUsbCallback> callback = getCallback();
+    if (callback != NULL) {
+        ScopedAStatus ret = notify(callback);
+        if (!ret.isOk())
+            ALOGE("%s error %s", command, ret.getDescription().c_str());
+    } else {
+        ALOGE("Not notifying the userspace. Callback is not set");
     }
+}
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uevent_fd, &ev) == -1) {
-        ALOGE("epoll_ctl failed; errno=%d", errno);
-        goto error;
+/*
+ * The AIDL entry points below only queue the command of the port and return;
+ * the result is reported through the matching notify*Status callback.
+ */
+ScopedAStatus Usb::enableUsbData(const string& in_portName, bool in_enable,
+        int64_t in_transactionId) {
+    UsbCommandQueue *queue = getCommandQueue(in_portName);
+    if (queue == NULL) {
+        notifyUnknownPort("enableUsbData", [&](const auto &callback) {
+            return callback->notifyEnableUsbDataStatus(
+                in_portName, in_enable, Status::ERROR, in_transactionId);
+        });
+        return ScopedAStatus::ok();
     }
+    queue->enqueue(
+        "enableUsbData", [this, in_portName, in_enable, in_transactionId] {
+            enableUsbDataCommand(in_portName, in_enable, in_transactionId);
+        });
+    return ScopedAStatus::ok();
+}
 
-    while (!destroyThread) {
-        struct epoll_event events[64];
-
-        nevents = epoll_wait(epoll_fd, events, 64, -1);
-        if (nevents == -1) {
-            if (errno == EINTR)
-                continue;
-            ALOGE("usb epoll_wait failed; errno=%d", errno);
-            break;
-        }
+ScopedAStatus Usb::enableUsbDataWhileDocked(const string& in_portName,
+        int64_t in_transactionId) {
+    UsbCommandQueue *queue = getCommandQueue(in_portName);
+    if (queue == NULL) {
+        notifyUnknownPort("enableUsbDataWhileDocked", [&](const auto &callback) {
+            return callback->notifyEnableUsbDataWhileDockedStatus(
+                in_portName, Status::ERROR, in_transactionId);
+        });
+        return ScopedAStatus::ok();
+    }
+    queue->enqueue(
+        "enableUsbDataWhileDocked", [this, in_portName, in_transactionId] {
+            enableUsbDataWhileDockedCommand(in_portName, in_transactionId);
+        });
+    return ScopedAStatus::ok();
+}
 
-        for (int n = 0; n < nevents; ++n) {
-            if (events[n].data.ptr)
-                (*(void (*)(int, struct data *payload))events[n].data.ptr)(events[n].events,
-                                                                           &payload);
-        }
+ScopedAStatus Usb::resetUsbPort(const string& in_portName, int64_t in_transactionId) {
+    UsbCommandQueue *queue = getCommandQueue(in_portName);
+    if (queue == NULL) {
+        notifyUnknownPort("resetUsbPort", [&](const auto &callback) {
+            return callback->notifyResetUsbPortStatus(
+                in_portName, Status::ERROR, in_transactionId);
+        });
+        return ScopedAStatus::ok();
     }
+    queue->enqueue(
+        "resetUsbPort", [this, in_portName, in_transactionId] {
+            resetUsbPortCommand(in_portName, in_transactionId);
+        });
+    return ScopedAStatus::ok();
+}
 
-    ALOGI("exiting worker thread");
-error:
-    close(uevent_fd);
+ScopedAStatus Usb::switchRole(const string& in_portName, const PortRole& in_role,
+        int64_t in_transactionId) {
+    UsbCommandQueue *queue = getCommandQueue(in_portName);
+    if (queue == NULL) {
+        notifyUnknownPort("switchRole", [&](const auto &callback) {
+            return callback->notifyRoleSwitchStatus(
+                in_portName, in_role, Status::ERROR, in_transactionId);
+        });
+        return ScopedAStatus::ok();
+    }
+    queue->enqueue(
+        "switchRole", [this, in_portName, in_role, in_transactionId] {
+            switchRoleCommand(in_portName, in_role, in_transactionId);
+        });
+    return ScopedAStatus::ok();
+}
 
-    if (epoll_fd >= 0)
-        close(epoll_fd);
+ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
+        int64_t in_transactionId) {
+    UsbCommandQueue *queue = getCommandQueue(in_portName);
+    if (queue == NULL) {
+        notifyUnknownPort("limitPowerTransfer", [&](const auto &callback) {
+            return callback->notifyLimitPowerTransferStatus(
+                in_portName, in_limit, Status::ERROR, in_transactionId);
+        });
+        return ScopedAStatus::ok();
+    }
+    queue->enqueue(
+        "limitPowerTransfer", [this, in_portName, in_limit, in_transactionId] {
+            limitPowerTransferCommand(in_portName, in_limit, in_transactionId);
+        });
+    return ScopedAStatus::ok();
+}
 
-    return NULL;
+ScopedAStatus Usb::enableContaminantPresenceDetection(const string& in_portName,
+        bool in_enable, int64_t in_transactionId) {
+    UsbCommandQueue *queue = getCommandQueue(in_portName);
+    if (queue == NULL) {
+        notifyUnknownPort("enableContaminantPresenceDetection", [&](const auto &callback) {
+            return callback->notifyContaminantEnabledStatus(
+                in_portName, in_enable, Status::ERROR, in_transactionId);
+        });
+        return ScopedAStatus::ok();
+    }
+    queue->enqueue(
+        "enableContaminantPresenceDetection", [this, in_portName, in_enable, in_transactionId] {
+            enableContaminantPresenceDetectionCommand(in_portName, in_enable, in_transactionId);
+        });
+    return ScopedAStatus::ok();
 }
 
-void sighandler(int sig) {
-    if (sig == SIGUSR1) {
-        destroyThread = true;
-        ALOGI("destroy set");
-        return;
+ScopedAStatus Usb::queryPortStatus(int64_t in_transactionId) {
+    /*
+     * Runs on the port queue so the reported status includes every command
+     * queued before the query. Back to back queries are answered by a single
+     * sysfs refresh.
+     */
+    UsbCommandQueue *queue = getCommandQueue(kQueryPort);
+    if (queue == NULL) {
+        notifyUnknownPort("queryPortStatus", [&](const auto &callback) {
+            return callback->notifyQueryPortStatus(kAllPorts, Status::ERROR, in_transactionId);
+        });
+        return ScopedAStatus::ok();
     }
-    signal(SIGUSR1, sighandler);
+    queue->enqueueCoalesced(
+        "queryPortStatus", [this] { queryPortStatusCommand(); },
+        [this, in_transactionId] {
+            // Behind the notifyPortStatusChange queued by the refresh.
+            mPortStatusNotifier.enqueue("notifyQueryPortStatus", [this, in_transactionId] {
+                notifyQueryPortStatus(in_transactionId);
+            });
+        });
+    return ScopedAStatus::ok();
 }
 
 ScopedAStatus Usb::setCallback(const shared_ptr<IUsbCallback>& in_callback) {
+    int subscription = -1;
+
     pthread_mutex_lock(&mLock);
-    if ((mCallback == NULL && in_callback == NULL) ||
-            (mCallback != NULL && in_callback != NULL)) {
-        mCallback = in_callback;
+    shared_ptr<const PortStatusSnapshot> previous = getSnapshot();
+    auto snapshot = std::make_shared<PortStatusSnapshot>(*previous);
+    snapshot->callback = in_callback;
+    std::atomic_store(&mSnapshot, shared_ptr<const PortStatusSnapshot>(snapshot));
+    // A new callback gets the next port status even if it is unchanged.
+    if (in_callback != NULL)
+        mForcePortStatusNotify = true;
+
+    if ((previous->callback == NULL && in_callback == NULL) ||
+            (previous->callback != NULL && in_callback != NULL)) {
         pthread_mutex_unlock(&mLock);
         return ScopedAStatus::ok();
     }
 
-    mCallback = in_callback;
     ALOGI("registering callback");
 
-    if (mCallback == NULL) {
-        if  (!pthread_kill(mPoll, SIGUSR1)) {
-            pthread_join(mPoll, NULL);
-            ALOGI("pthread destroyed");
-        }
+    if (in_callback == NULL) {
+        subscription = mUeventSubscription;
+        mUeventSubscription = -1;
         pthread_mutex_unlock(&mLock);
+        /*
+         * Unsubscribe outside of mLock: the uevent handler takes mLock and
+         * unsubscribe() waits for a running handler to return.
+         */
+        if (subscription >= 0) {
+            mUeventHub.unsubscribe(subscription);
+            ALOGI("uevent subscription removed");
+        }
         return ScopedAStatus::ok();
     }
 
-    destroyThread = false;
-    signal(SIGUSR1, sighandler);
-
     /*
-     * Create a background thread if the old callback value is NULL
+     * Start listening to uevents if the old callback value is NULL
      * and being updated with a new value.
      */
-    if (pthread_create(&mPoll, NULL, work, this)) {
-        ALOGE("pthread creation failed %d", errno);
-        mCallback = NULL;
-    }
+    subscribePortStatusUevents();
 
     pthread_mutex_unlock(&mLock);
     return ScopedAStatus::ok();
 }
 
+void Usb::subscribePortStatusUevents() {
+    UeventFilter filter;
+    filter.classes = UEVENT_CLASS_PARTNER_ADD | kUeventClassPortStatus | UEVENT_CLASS_OVERHEAT;
+    /*
+     * typec, tcpc and the usb power supply all live under the tcpc i2c
+     * client. The fuel gauge and the chargers on the same controller emit
+     * uevents all the time, so the whole controller is only listened to
+     * until the client is found, see handleI2cClientAdded().
+     */
+    string client = mI2cClient.clientUeventPrefix();
+    filter.devpathPrefixes = {client.empty() ? mI2cClient.controllerUeventPrefix() : client,
+                              kPogoUeventPrefix, kOverheatUeventPrefix};
+    mUeventSubscription = mUeventHub.subscribe(
+        filter, [this](const Uevent &event) { uevent_event(event, this); });
+}
+
+void Usb::handleI2cClientAdded() {
+    int subscription;
+
+    mI2cClient.rescan();
+    if (mI2cClient.path().empty())
+        return;
+
+    // Runs on the hub thread, where unsubscribing does not wait for the handler.
+    subscription = mI2cClientSubscription.exchange(-1);
+    if (subscription >= 0)
+        mUeventHub.unsubscribe(subscription);
+
+    // Narrow the port status subscription down to the client.
+    pthread_mutex_lock(&mLock);
+    if (mUeventSubscription >= 0) {
+        mUeventHub.unsubscribe(mUeventSubscription);
+        subscribePortStatusUevents();
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+binder_status_t Usb::dump(int fd, const char ** /* args */, uint32_t /* numArgs */) {
+    mUeventHub.dump(fd);
+    mSysfsAttributes.dump(fd);
+    mI2cClient.dump(fd);
+    dumpUsbTrace(fd);
+    {
+        std::lock_guard<std::mutex> lock(mRoleSwitchStatsLock);
+        dprintf(fd, "role switch latency:\n");
+        for (const auto &transition : mRoleSwitchLatency)
+            transition.second.dump(fd, transition.first.c_str());
+    }
+    {
+        std::lock_guard<std::mutex> lock(mCommandQueuesLock);
+        for (const auto &queue : mCommandQueues)
+            queue.second->dump(fd);
+    }
+    mPortStatusNotifier.dump(fd);
+    return STATUS_OK;
+}
+
 } // namespace usb
 } // namespace hardware
 } // namespace android
@@ -21,9 +21,19 @@
 #include <aidl/android/hardware/usb/BnUsbCallback.h>
 #include <pixelusb/UsbOverheatEvent.h>
 #include <utils/Log.h>
+#include <I2cClientResolver.h>
+#include <LatencyHistogram.h>
+#include <SysfsAttribute.h>
+#include <UeventHub.h>
+#include <UsbCommandQueue.h>
 #include <UsbDataSessionMonitor.h>
 
-#define UEVENT_MSG_LEN 2048
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
 // The type-c stack waits for 4.5 - 5.5 secs before declaring a port non-pd.
 // The -partner directory would not be created until this is done.
 // Having a margin of ~3 secs for the directory and other related bookeeping
@@ -55,8 +65,61 @@ constexpr char kGadgetName[] = "11110000.dwc3";
 #define VBUS_PATH NEW_UDC_PATH "dwc3_exynos_otg_b_sess"
 #define USB_DATA_PATH NEW_UDC_PATH "usb_data_enabled"
 
+// Parts of the port status that are refreshed independently, see queryVersionHelper().
+enum PortStatusPart : uint32_t {
+    // Port enumeration, roles and role swap capabilities from /sys/class/typec
+    PORT_STATUS_TYPEC = 1 << 0,
+    // Dock and userspace controlled usb data signaling
+    PORT_STATUS_USB_DATA = 1 << 1,
+    // Power brick detection from the usb power supply
+    PORT_STATUS_POWER_BRICK = 1 << 2,
+    PORT_STATUS_CONTAMINANT = 1 << 3,
+    // Sink power limit from the tcpc, set by limitPowerTransfer() or by the kernel
+    PORT_STATUS_POWER_LIMIT = 1 << 4,
+    // Non compliant charger reasons reported by the typec port
+    PORT_STATUS_COMPLIANCE = 1 << 5,
+    PORT_STATUS_ALL = (1 << 6) - 1,
+};
+
+/*
+ * Sysfs derived inputs of the port status. Each part is only re-read when it
+ * is reported as changed; the PortStatus sent to the framework is composed
+ * from these without any I/O.
+ */
+struct PortStatusCache {
+    // PortStatusPart bits that have been read at least once
+    uint32_t valid = 0;
+    Status typecStatus = Status::ERROR;
+    // Port names, roles and capabilities, without the other parts applied
+    std::vector<PortStatus> typec;
+    // Whether a partner is attached to the port at the same index in typec
+    std::vector<bool> connected;
+    std::vector<UsbDataStatus> usbDataStatus;
+    std::vector<PowerBrickStatus> powerBrickStatus;
+    // Holds the contaminant and power transfer limit fields that apply to port 0
+    PortStatus port0;
+    std::vector<std::vector<ComplianceWarning>> complianceWarnings;
+};
+
+/*
+ * Immutable port status together with the callback it is reported to. A new
+ * snapshot replaces the old one as a whole, so readers and notifiers never
+ * wait on a sysfs refresh in progress and binder calls are made without
+ * holding mLock.
+ */
+struct PortStatusSnapshot {
+    std::vector<PortStatus> portStatus;
+    Status status = Status::ERROR;
+    shared_ptr<IUsbCallback> callback;
+    // Reception time of the latest uevent that led to this status, 0 if none
+    int64_t eventNs = 0;
+};
+
 struct Usb : public BnUsb {
     Usb();
+    // Receives uevents from |ueventFd| instead of the kernel, see UeventHub.
+    explicit Usb(unique_fd ueventFd);
+    ~Usb();
 
     ScopedAStatus enableContaminantPresenceDetection(const std::string& in_portName,
             bool in_enable, int64_t in_transactionId) override;
@@ -71,9 +134,15 @@ struct Usb : public BnUsb {
     ScopedAStatus limitPowerTransfer(const string& in_portName, bool in_limit,
         int64_t in_transactionId) override;
     ScopedAStatus resetUsbPort(const string& in_portName, int64_t in_transactionId) override;
+    binder_status_t dump(int fd, const char **args, uint32_t numArgs) override;
+
+    // Snapshot of the port status and the callback, never NULL
+    shared_ptr<const PortStatusSnapshot> getSnapshot() const {
+        return std::atomic_load(&mSnapshot);
+    }
+    shared_ptr<IUsbCallback> getCallback() const { return getSnapshot()->callback; }
 
-    std::shared_ptr<::aidl::android::hardware::usb::IUsbCallback> mCallback;
-    // Protects mCallback variable
+    // Protects mPortStatusCache and serializes updates of mSnapshot
     pthread_mutex_t mLock;
     // Protects roleSwitch operation
     pthread_mutex_t mRoleSwitchLock;
@@ -83,7 +152,11 @@ struct Usb : public BnUsb {
     pthread_mutex_t mPartnerLock;
     // Variable to signal partner coming back online after type switch
     bool mPartnerUp;
+    // Set when power_role or data_role changed during a type switch, protected by mPartnerLock
+    bool mRoleChanged;
 
+    // Single uevent socket and epoll loop shared by all uevent consumers, started last in Usb()
+    UeventHub mUeventHub;
     // Report usb data session event and data incompliance warnings
     UsbDataSessionMonitor mUsbDataSessionMonitor;
     // Usb Overheat object for push suez event
@@ -92,13 +165,63 @@ struct Usb : public BnUsb {
     float mPluggedTemperatureCelsius;
     // Usb Data status
     bool mUsbDataEnabled;
-    int getI2cBusNumber();
-    std::string_view getI2cClientPath();
+    // Open handles of the sysfs attributes read or written on the port status paths
+    SysfsAttributeCache mSysfsAttributes;
+    // TCPC i2c client and its attributes (contaminant detection, power limits)
+    I2cClientResolver mI2cClient;
+    // Port status inputs, protected by mLock
+    PortStatusCache mPortStatusCache;
+    // Replaced under mLock, read with std::atomic_load without any lock
+    shared_ptr<const PortStatusSnapshot> mSnapshot;
+    // Last snapshot sent through notifyPortStatusChange, only used on mPortStatusNotifier
+    shared_ptr<const PortStatusSnapshot> mNotifiedSnapshot;
+    // eventNs of the last uevent traced up to its notification, only used on mPortStatusNotifier
+    int64_t mTracedEventNs;
+    // Set when the next notification has to be sent even if the status is unchanged
+    std::atomic<bool> mForcePortStatusNotify;
+    // Sends port status notifications in order, outside of mLock
+    UsbCommandQueue mPortStatusNotifier;
 
   private:
-    pthread_t mPoll;
-    int mI2cBusNumber;
-    std::string mI2cClientPath;
+    // Command bodies of the AIDL calls, run on the command queue of the port.
+    void enableUsbDataCommand(const string& in_portName, bool in_enable,
+            int64_t in_transactionId);
+    void enableUsbDataWhileDockedCommand(const string& in_portName, int64_t in_transactionId);
+    void resetUsbPortCommand(const string& in_portName, int64_t in_transactionId);
+    void switchRoleCommand(const string& in_portName, const PortRole& in_role,
+            int64_t in_transactionId);
+    void limitPowerTransferCommand(const string& in_portName, bool in_limit,
+            int64_t in_transactionId);
+    void enableContaminantPresenceDetectionCommand(const string& in_portName, bool in_enable,
+            int64_t in_transactionId);
+    void queryPortStatusCommand();
+    void notifyQueryPortStatus(int64_t in_transactionId);
+    void recordRoleSwitchLatency(const PortRole &role, bool success, int64_t ns);
+    /*
+     * Returns the command queue of |portName|, created on first use, or NULL
+     * if |portName| is not a port under /sys/class/typec.
+     */
+    UsbCommandQueue *getCommandQueue(const string &portName);
+    using UnknownPortNotify =
+            std::function<ScopedAStatus(const shared_ptr<IUsbCallback> &callback)>;
+    // Reports the Status::ERROR of |command| through |notify| when its port is unknown.
+    void notifyUnknownPort(const char *command, const UnknownPortNotify &notify);
+    // Subscribes the port status uevent handler. Called with mLock held.
+    void subscribePortStatusUevents();
+    // Hub handler of add uevents below the i2c controller while the TCPC client is unknown.
+    void handleI2cClientAdded();
+
+    // Protects mCommandQueues
+    std::mutex mCommandQueuesLock;
+    std::map<string, std::unique_ptr<UsbCommandQueue>> mCommandQueues;
+    // Protects mRoleSwitchLatency
+    std::mutex mRoleSwitchStatsLock;
+    // switchRole duration per "<tag>:<role>" transition
+    std::map<string, LatencyHistogram> mRoleSwitchLatency;
+    // Uevent subscription held while a callback is registered, -1 otherwise
+    int mUeventSubscription;
+    // Subscription waiting for the TCPC client to probe, -1 once it was found
+    std::atomic<int> mI2cClientSubscription;
 };
 
 } // namespace usb
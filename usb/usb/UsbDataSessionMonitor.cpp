@@ -19,105 +19,107 @@
 #include "UsbDataSessionMonitor.h"
 
 #include <aidl/android/frameworks/stats/IStats.h>
-#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android_hardware_usb_flags.h>
-#include <cutils/uevent.h>
 #include <pixelstats/StatsHelper.h>
 #include <pixelusb/CommonUtils.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 #include <utils/Log.h>
 
-#include <regex>
+#include "SysfsAttribute.h"
 
 namespace usb_flags = android::hardware::usb::flags;
 
 using aidl::android::frameworks::stats::IStats;
-using android::base::ReadFileToString;
 using android::hardware::google::pixel::getStatsService;
 using android::hardware::google::pixel::reportUsbDataSessionEvent;
 using android::hardware::google::pixel::PixelAtoms::VendorUsbDataSessionEvent;
-using android::hardware::google::pixel::usb::addEpollFd;
-using android::hardware::google::pixel::usb::BuildVendorUsbDataSessionEvent;
 
 namespace aidl {
 namespace android {
 namespace hardware {
 namespace usb {
 
-#define UEVENT_MSG_LEN 2048
 #define USB_STATE_MAX_LEN 20
 #define DATA_ROLE_MAX_LEN 10
-#define WARNING_SURFACE_DELAY_SEC 5
-#define ENUM_FAIL_DEFAULT_COUNT_THRESHOLD 3
-#define DEVICE_FLAKY_CONNECTION_CONFIGURED_COUNT_THRESHOLD 5
-
-constexpr char kUdcConfigfsPath[] = "/config/usb_gadget/g1/UDC";
-constexpr char kNotAttachedState[] = "not attached\n";
-constexpr char kAttachedState[] = "attached\n";
-constexpr char kPoweredState[] = "powered\n";
-constexpr char kDefaultState[] = "default\n";
-constexpr char kAddressedState[] = "addressed\n";
-constexpr char kConfiguredState[] = "configured\n";
-constexpr char kSuspendedState[] = "suspended\n";
-const std::set<std::string> kValidStates = {kNotAttachedState, kAttachedState,  kPoweredState,
-                                            kDefaultState,     kAddressedState, kConfiguredState,
-                                            kSuspendedState};
-
-static int addEpollFile(const int &epollFd, const std::string &filePath, unique_fd &fileFd) {
-    struct epoll_event ev;
-
-    unique_fd fd(open(filePath.c_str(), O_RDONLY));
+
+// Compared as int, comparing different enumeration types is a -Wenum-compare error.
+static_assert(static_cast<int>(USB_DEVICE_STATE_NOT_ATTACHED) ==
+                      static_cast<int>(VendorUsbDataSessionEvent::USB_STATE_NOT_ATTACHED) &&
+              static_cast<int>(USB_DEVICE_STATE_SUSPENDED) ==
+                      static_cast<int>(VendorUsbDataSessionEvent::USB_STATE_SUSPENDED));
+
+/*
+ * Fills |event| straight from the state history ring, without the string
+ * conversions BuildVendorUsbDataSessionEvent does on parallel vectors.
+ */
+static void buildUsbDataSessionEvent(bool isHost, boot_clock::time_point currentTime,
+                                     boot_clock::time_point startTime,
+                                     const UsbDeviceStateHistory &history,
+                                     VendorUsbDataSessionEvent *event) {
+    event->set_usb_role(isHost ? VendorUsbDataSessionEvent::USB_ROLE_HOST
+                               : VendorUsbDataSessionEvent::USB_ROLE_DEVICE);
+
+    event->mutable_usb_states()->Reserve(history.size());
+    event->mutable_elapsed_time_ms()->Reserve(history.size());
+    for (size_t i = 0; i < history.size(); i++) {
+        const UsbDeviceStateHistory::Record &record = history.at(i);
+
+        event->add_usb_states(static_cast<VendorUsbDataSessionEvent::UsbDeviceState>(record.state));
+        event->add_elapsed_time_ms(
+            std::chrono::duration_cast<std::chrono::milliseconds>(record.timestamp - startTime)
+                .count());
+    }
+
+    event->set_duration_ms(
+        std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - startTime).count());
+}
+
+int UsbDataSessionMonitor::addEpollFile(const std::string &filePath, unique_fd &fileFd,
+                                        UeventHub::FdHandler handler) {
+    unique_fd fd(open(sysfsPath(filePath).c_str(), O_RDONLY));
 
     if (fd.get() == -1) {
         ALOGI("Cannot open %s", filePath.c_str());
         return -1;
     }
 
-    ev.data.fd = fd.get();
-    ev.events = EPOLLPRI;
+    if (fileFd.get() != -1)
+        mUeventHub->removeFd(fileFd.get());
 
-    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd.get(), &ev) != 0) {
-        ALOGE("epoll_ctl failed; errno=%d", errno);
+    // Hand over the fd before registering it, the handler may run right away.
+    fileFd = std::move(fd);
+    if (mUeventHub->addFd(fileFd.get(), EPOLLPRI, std::move(handler)) != 0) {
+        fileFd.reset();
         return -1;
     }
 
-    fileFd = std::move(fd);
     ALOGI("epoll registered %s", filePath.c_str());
     return 0;
 }
 
-static void removeEpollFile(const int &epollFd, const std::string &filePath, unique_fd &fileFd) {
-    epoll_ctl(epollFd, EPOLL_CTL_DEL, fileFd.get(), NULL);
-    fileFd.release();
+void UsbDataSessionMonitor::removeEpollFile(const std::string &filePath, unique_fd &fileFd) {
+    mUeventHub->removeFd(fileFd.get());
+    fileFd.reset();
 
     ALOGI("epoll unregistered %s", filePath.c_str());
 }
 
 UsbDataSessionMonitor::UsbDataSessionMonitor(
-    const std::string &deviceUeventRegex, const std::string &deviceStatePath,
-    const std::string &host1UeventRegex, const std::string &host1StatePath,
-    const std::string &host2UeventRegex, const std::string &host2StatePath,
-    const std::string &dataRolePath, std::function<void()> updatePortStatusCb) {
-    struct epoll_event ev;
-    std::string udc;
-
-    unique_fd epollFd(epoll_create(8));
-    if (epollFd.get() == -1) {
-        ALOGE("epoll_create failed; errno=%d", errno);
-        abort();
-    }
-
-    unique_fd ueventFd(uevent_open_socket(64 * 1024, true));
-    if (ueventFd.get() == -1) {
-        ALOGE("uevent_open_socket failed");
-        abort();
-    }
-    fcntl(ueventFd, F_SETFL, O_NONBLOCK);
-
-    if (addEpollFd(epollFd, ueventFd))
-        abort();
+    UeventHub *ueventHub,
+    const std::string &deviceUeventPattern, const std::string &deviceStatePath,
+    const std::string &host1UeventPattern, const std::string &host1StatePath,
+    const std::string &host2UeventPattern, const std::string &host2StatePath,
+    const std::string &dataRolePath, std::function<void()> updatePortStatusCb)
+    : mUeventHub(ueventHub),
+      mComplianceRules(loadComplianceRules(sysfsPath(kComplianceRulesPath).c_str()),
+                       {&mDeviceState.history, &mHost1State.history, &mHost2State.history}),
+      mDataRole(PortDataRole::NONE),
+      mUdcBind(false),
+      mUdcTracker(ueventHub, deviceUeventPattern,
+                  [this](bool bound) { updateUdcBindStatus(bound); }) {
+    UeventFilter filter;
 
     unique_fd timerFd(timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK));
     if (timerFd.get() == -1) {
@@ -125,10 +127,15 @@ UsbDataSessionMonitor::UsbDataSessionMonitor(
         abort();
     }
 
-    if (addEpollFd(epollFd, timerFd))
+    mTimerFd = std::move(timerFd);
+    mUpdatePortStatusCb = updatePortStatusCb;
+
+    // The hub may already be running: register fds only once the state above is set up.
+    if (mUeventHub->addFd(mTimerFd.get(), EPOLLIN, [this](uint32_t) { handleTimerEvent(); }))
         abort();
 
-    if (addEpollFile(epollFd.get(), dataRolePath, mDataRoleFd) != 0) {
+    if (addEpollFile(dataRolePath, mDataRoleFd, [this](uint32_t) { handleDataRoleEvent(); }) !=
+        0) {
         ALOGE("monitor data role failed");
         abort();
     }
@@ -138,46 +145,63 @@ UsbDataSessionMonitor::UsbDataSessionMonitor(
      * and driver architecture. It's ok for addEpollFile to fail here, the file
      * will be monitored later when its presence is detected by uevent.
      */
+    mDeviceState.port = COMPLIANCE_PORT_DEVICE;
     mDeviceState.filePath = deviceStatePath;
-    mDeviceState.ueventRegex = deviceUeventRegex;
-    addEpollFile(epollFd.get(), mDeviceState.filePath, mDeviceState.fd);
+    mDeviceState.ueventPattern = deviceUeventPattern;
+    addEpollFile(mDeviceState.filePath, mDeviceState.fd,
+                 [this](uint32_t) { handleDeviceStateEvent(&mDeviceState); });
 
+    mHost1State.port = COMPLIANCE_PORT_HOST1;
     mHost1State.filePath = host1StatePath;
-    mHost1State.ueventRegex = host1UeventRegex;
-    addEpollFile(epollFd.get(), mHost1State.filePath, mHost1State.fd);
+    mHost1State.ueventPattern = host1UeventPattern;
+    addEpollFile(mHost1State.filePath, mHost1State.fd,
+                 [this](uint32_t) { handleDeviceStateEvent(&mHost1State); });
 
+    mHost2State.port = COMPLIANCE_PORT_HOST2;
     mHost2State.filePath = host2StatePath;
-    mHost2State.ueventRegex = host2UeventRegex;
-    addEpollFile(epollFd.get(), mHost2State.filePath, mHost2State.fd);
-
-    mEpollFd = std::move(epollFd);
-    mUeventFd = std::move(ueventFd);
-    mTimerFd = std::move(timerFd);
-    mUpdatePortStatusCb = updatePortStatusCb;
-
-    if (ReadFileToString(kUdcConfigfsPath, &udc) && !udc.empty())
-        mUdcBind = true;
-    else
-        mUdcBind = false;
-
-    if (pthread_create(&mMonitor, NULL, this->monitorThread, this)) {
-        ALOGE("pthread creation failed %d", errno);
-        abort();
+    mHost2State.ueventPattern = host2UeventPattern;
+    addEpollFile(mHost2State.filePath, mHost2State.fd,
+                 [this](uint32_t) { handleDeviceStateEvent(&mHost2State); });
+
+    for (auto e : {&mHost1State, &mHost2State}) {
+        filter = UeventFilter();
+        filter.actions = {"bind", "unbind"};
+        filter.devpathPattern = e->ueventPattern;
+        mSubscriptions.push_back(mUeventHub->subscribe(filter, [this, e](const Uevent &event) {
+            handleHostUevent(event, e);
+        }));
     }
 
+    mUdcTracker.start();
+    mUdcBind = mUdcTracker.bound();
+    // The data role attribute only signals changes, pick up the current role.
+    handleDataRoleEvent();
+
     ALOGI("feature flag enable_report_usb_data_compliance_warning: %d",
           usb_flags::enable_report_usb_data_compliance_warning());
 }
 
-UsbDataSessionMonitor::~UsbDataSessionMonitor() {}
+UsbDataSessionMonitor::~UsbDataSessionMonitor() {
+    // Quiesce every hub callback first, the hub outlives the monitor.
+    mUdcTracker.stop();
+    for (int id : mSubscriptions)
+        mUeventHub->unsubscribe(id);
+
+    for (auto e : {&mDeviceState, &mHost1State, &mHost2State}) {
+        if (e->fd.get() != -1)
+            mUeventHub->removeFd(e->fd.get());
+    }
+    mUeventHub->removeFd(mDataRoleFd.get());
+    mUeventHub->removeFd(mTimerFd.get());
+}
 
 void UsbDataSessionMonitor::reportUsbDataSessionMetrics() {
     std::vector<VendorUsbDataSessionEvent> events;
 
     if (mDataRole == PortDataRole::DEVICE) {
         VendorUsbDataSessionEvent event;
-        BuildVendorUsbDataSessionEvent(false /* is_host */, boot_clock::now(), mDataSessionStart,
-                                       &mDeviceState.states, &mDeviceState.timestamps, &event);
+        buildUsbDataSessionEvent(false /* is_host */, boot_clock::now(), mDataSessionStart,
+                                 mDeviceState.history, &event);
         events.push_back(event);
     } else if (mDataRole == PortDataRole::HOST) {
         bool empty = true;
@@ -186,11 +210,10 @@ void UsbDataSessionMonitor::reportUsbDataSessionMetrics() {
              * Host port will at least get an not_attached event after enablement,
              * skip upload if no additional state is added.
              */
-            if (e->states.size() > 1) {
+            if (e->history.total() > 1) {
                 VendorUsbDataSessionEvent event;
-                BuildVendorUsbDataSessionEvent(true /* is_host */, boot_clock::now(),
-                                               mDataSessionStart, &e->states, &e->timestamps,
-                                               &event);
+                buildUsbDataSessionEvent(true /* is_host */, boot_clock::now(),
+                                         mDataSessionStart, e->history, &event);
                 events.push_back(event);
                 empty = false;
             }
@@ -198,8 +221,8 @@ void UsbDataSessionMonitor::reportUsbDataSessionMetrics() {
         // All host ports have no state update, upload an event to reflect it
         if (empty) {
             VendorUsbDataSessionEvent event;
-            BuildVendorUsbDataSessionEvent(true /* is_host */, boot_clock::now(), mDataSessionStart,
-                                           &mHost1State.states, &mHost1State.timestamps, &event);
+            buildUsbDataSessionEvent(true /* is_host */, boot_clock::now(), mDataSessionStart,
+                                     mHost1State.history, &event);
             events.push_back(event);
         }
     } else {
@@ -240,45 +263,13 @@ void UsbDataSessionMonitor::notifyComplianceWarning() {
 
 void UsbDataSessionMonitor::evaluateComplianceWarning() {
     std::set<ComplianceWarning> newWarningSet;
-    int elapsedTimeSec;
-
-    elapsedTimeSec =
-        std::chrono::duration_cast<std::chrono::seconds>(boot_clock::now() - mDataSessionStart)
-            .count();
-
-    if (elapsedTimeSec >= WARNING_SURFACE_DELAY_SEC) {
-        if (mDataRole == PortDataRole::DEVICE && mUdcBind) {
-            int configuredCount = std::count(mDeviceState.states.begin(),
-                                             mDeviceState.states.end(), kConfiguredState);
-            int defaultCount =
-                std::count(mDeviceState.states.begin(), mDeviceState.states.end(), kDefaultState);
-
-            if (configuredCount == 0 && defaultCount > ENUM_FAIL_DEFAULT_COUNT_THRESHOLD)
-                newWarningSet.insert(ComplianceWarning::ENUMERATION_FAIL);
-
-            if (configuredCount > DEVICE_FLAKY_CONNECTION_CONFIGURED_COUNT_THRESHOLD)
-                newWarningSet.insert(ComplianceWarning::FLAKY_CONNECTION);
-        } else if (mDataRole == PortDataRole::HOST) {
-            int host1StateCount = mHost1State.states.size();
-            int host1ConfiguredCount =
-                std::count(mHost1State.states.begin(), mHost1State.states.end(), kConfiguredState);
-            int host1DefaultCount =
-                std::count(mHost1State.states.begin(), mHost1State.states.end(), kDefaultState);
-            int host2StateCount = mHost2State.states.size();
-            int host2ConfiguredCount =
-                std::count(mHost2State.states.begin(), mHost2State.states.end(), kConfiguredState);
-            int host2DefaultCount =
-                std::count(mHost2State.states.begin(), mHost2State.states.end(), kDefaultState);
-
-            if (host1ConfiguredCount == 0 && host2ConfiguredCount == 0 &&
-                (host1DefaultCount > ENUM_FAIL_DEFAULT_COUNT_THRESHOLD ||
-                 host2DefaultCount > ENUM_FAIL_DEFAULT_COUNT_THRESHOLD))
-                newWarningSet.insert(ComplianceWarning::ENUMERATION_FAIL);
-
-            if (host1StateCount == 1 && mHost1State.states.front() == kNotAttachedState &&
-                host2StateCount == 1 && mHost2State.states.front() == kNotAttachedState)
-                newWarningSet.insert(ComplianceWarning::MISSING_DATA_LINES);
-        }
+
+    if (mDataRole == PortDataRole::HOST || (mDataRole == PortDataRole::DEVICE && mUdcBind)) {
+        newWarningSet = mComplianceRules.evaluate(boot_clock::now());
+        armComplianceTimer(mComplianceRules.nextDeadline());
+    } else {
+        // Deadlines left from the session are not updated anymore, they would fire right away.
+        armComplianceTimer(boot_clock::time_point::max());
     }
 
     if (newWarningSet != mWarningSet) {
@@ -295,26 +286,29 @@ void UsbDataSessionMonitor::evaluateComplianceWarning() {
 }
 
 void UsbDataSessionMonitor::clearDeviceStateEvents(struct usbDeviceState *deviceState) {
-    deviceState->states.clear();
-    deviceState->timestamps.clear();
+    deviceState->history.clear();
 }
 
 void UsbDataSessionMonitor::handleDeviceStateEvent(struct usbDeviceState *deviceState) {
     int n;
-    char state[USB_STATE_MAX_LEN] = {0};
+    char state[USB_STATE_MAX_LEN + 1] = {0};
+    UsbDeviceState newState;
+    boot_clock::time_point now;
 
     lseek(deviceState->fd.get(), 0, SEEK_SET);
     n = read(deviceState->fd.get(), &state, USB_STATE_MAX_LEN);
 
-    if (kValidStates.find(state) == kValidStates.end()) {
+    newState = parseUsbDeviceState(std::string_view(state, n > 0 ? n : 0));
+    if (newState == USB_DEVICE_STATE_UNKNOWN) {
         ALOGE("Invalid state %s", state);
         return;
     }
 
     ALOGI("Update USB device state: %s", state);
 
-    deviceState->states.push_back(state);
-    deviceState->timestamps.push_back(boot_clock::now());
+    now = boot_clock::now();
+    deviceState->history.push(newState, now);
+    mComplianceRules.onStateChange(deviceState->port, newState, now);
     evaluateComplianceWarning();
 }
 
@@ -329,13 +323,27 @@ void UsbDataSessionMonitor::setupNewSession() {
         clearDeviceStateEvents(&mHost2State);
     }
 
-    if (mDataRole != PortDataRole::NONE) {
-        struct itimerspec delay = itimerspec();
-        delay.it_value.tv_sec = WARNING_SURFACE_DELAY_SEC;
-        int ret = timerfd_settime(mTimerFd.get(), 0, &delay, NULL);
-        if (ret < 0)
-            ALOGE("timerfd_settime failed err:%d", errno);
+    mComplianceRules.startSession(mDataRole, mDataSessionStart);
+    armComplianceTimer(mComplianceRules.nextDeadline());
+}
+
+/*
+ * Arms mTimerFd for |deadline|, the next time a compliance rule may change its
+ * result on its own, e.g. once the surface delay has elapsed. time_point::max()
+ * disarms it.
+ */
+void UsbDataSessionMonitor::armComplianceTimer(boot_clock::time_point deadline) {
+    struct itimerspec timer = itimerspec();
+
+    if (deadline != boot_clock::time_point::max()) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+
+        timer.it_value.tv_sec = ns.count() / 1000000000;
+        // A zero it_value would disarm the timer.
+        timer.it_value.tv_nsec = std::max<long>(ns.count() % 1000000000, 1);
     }
+    if (timerfd_settime(mTimerFd.get(), TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+        ALOGE("timerfd_settime failed err:%d", errno);
 }
 
 void UsbDataSessionMonitor::handleDataRoleEvent() {
@@ -367,28 +375,18 @@ void UsbDataSessionMonitor::handleDataRoleEvent() {
     }
 }
 
-void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &devname) {
-    std::string function;
-    bool newUdcBind;
+void UsbDataSessionMonitor::updateUdcBindStatus(bool newUdcBind) {
+    bool udcBind = mUdcBind;
 
-    /*
-     * /sys/class/udc/<udc>/function prints out name of currently running USB gadget driver
-     * Ref: https://www.kernel.org/doc/Documentation/ABI/stable/sysfs-class-udc
-     * Empty name string means the udc device is not bound and gadget is pulldown.
-     */
-    if (!ReadFileToString("/sys" + devname + "/function", &function))
+    if (newUdcBind == udcBind)
         return;
 
-    if (function == "")
-        newUdcBind = false;
-    else
-        newUdcBind = true;
-
-    if (newUdcBind == mUdcBind)
-        return;
+    ALOGI("Udc bind status changes from %b to %b", udcBind, newUdcBind);
+    // Updated first, the evaluation below must see the gadget unbound.
+    mUdcBind = newUdcBind;
 
     if (mDataRole == PortDataRole::DEVICE) {
-        if (mUdcBind && !newUdcBind) {
+        if (udcBind && !newUdcBind) {
             /*
              * Gadget soft pulldown: report metrics as the end of a data session and
              * re-evaluate compliance warnings to clear existing warnings if any.
@@ -396,59 +394,20 @@ void UsbDataSessionMonitor::updateUdcBindStatus(const std::string &devname) {
             reportUsbDataSessionMetrics();
             evaluateComplianceWarning();
 
-        } else if (!mUdcBind && newUdcBind) {
+        } else if (!udcBind && newUdcBind) {
             // Gadget soft pullup: reset and start accounting for a new data session.
             setupNewSession();
         }
     }
-
-    ALOGI("Udc bind status changes from %b to %b", mUdcBind, newUdcBind);
-    mUdcBind = newUdcBind;
 }
 
-void UsbDataSessionMonitor::handleUevent() {
-    char msg[UEVENT_MSG_LEN + 2];
-    char *cp;
-    int n;
-
-    n = uevent_kernel_multicast_recv(mUeventFd.get(), msg, UEVENT_MSG_LEN);
-    if (n <= 0)
-        return;
-    if (n >= UEVENT_MSG_LEN)
-        return;
-
-    msg[n] = '\0';
-    msg[n + 1] = '\0';
-    cp = msg;
-
-    while (*cp) {
-        for (auto e : {&mHost1State, &mHost2State}) {
-            if (std::regex_search(cp, std::regex(e->ueventRegex))) {
-                if (!strncmp(cp, "bind@", strlen("bind@"))) {
-                    addEpollFile(mEpollFd.get(), e->filePath, e->fd);
-                } else if (!strncmp(cp, "unbind@", strlen("unbind@"))) {
-                    removeEpollFile(mEpollFd.get(), e->filePath, e->fd);
-                }
-            }
-        }
-
-        // TODO: support bind@ unbind@ to detect dynamically allocated udc device
-        if (std::regex_search(cp, std::regex(mDeviceState.ueventRegex))) {
-            if (!strncmp(cp, "change@", strlen("change@"))) {
-                char *devname = cp + strlen("change@");
-                /*
-                 * Udc device emits a KOBJ_CHANGE event on configfs driver bind and unbind.
-                 * TODO: upstream udc driver emits KOBJ_CHANGE event BEFORE unbind is actually
-                 * executed. Add a short delay to get the correct state while working on a fix
-                 * upstream.
-                 */
-                usleep(50000);
-                updateUdcBindStatus(devname);
-            }
-        }
-        /* advance to after the next \0 */
-        while (*cp++) {
-        }
+void UsbDataSessionMonitor::handleHostUevent(const Uevent &event,
+                                             struct usbDeviceState *hostState) {
+    if (event.action == "bind") {
+        addEpollFile(hostState->filePath, hostState->fd,
+                     [this, hostState](uint32_t) { handleDeviceStateEvent(hostState); });
+    } else if (event.action == "unbind") {
+        removeEpollFile(hostState->filePath, hostState->fd);
     }
 }
 
@@ -469,39 +428,6 @@ void UsbDataSessionMonitor::handleTimerEvent() {
     evaluateComplianceWarning();
 }
 
-void *UsbDataSessionMonitor::monitorThread(void *param) {
-    UsbDataSessionMonitor *monitor = (UsbDataSessionMonitor *)param;
-    struct epoll_event events[64];
-    int nevents = 0;
-
-    while (true) {
-        nevents = epoll_wait(monitor->mEpollFd.get(), events, 64, -1);
-        if (nevents == -1) {
-            if (errno == EINTR)
-                continue;
-            ALOGE("usb epoll_wait failed; errno=%d", errno);
-            break;
-        }
-
-        for (int n = 0; n < nevents; ++n) {
-            if (events[n].data.fd == monitor->mUeventFd.get()) {
-                monitor->handleUevent();
-            } else if (events[n].data.fd == monitor->mTimerFd.get()) {
-                monitor->handleTimerEvent();
-            } else if (events[n].data.fd == monitor->mDataRoleFd.get()) {
-                monitor->handleDataRoleEvent();
-            } else if (events[n].data.fd == monitor->mDeviceState.fd.get()) {
-                monitor->handleDeviceStateEvent(&monitor->mDeviceState);
-            } else if (events[n].data.fd == monitor->mHost1State.fd.get()) {
-                monitor->handleDeviceStateEvent(&monitor->mHost1State);
-            } else if (events[n].data.fd == monitor->mHost2State.fd.get()) {
-                monitor->handleDeviceStateEvent(&monitor->mHost2State);
-            }
-        }
-    }
-    return NULL;
-}
-
 }  // namespace usb
 }  // namespace hardware
 }  // namespace android
@@ -25,6 +25,11 @@
 #include <string>
 #include <vector>
 
+#include "ComplianceRules.h"
+#include "UdcTracker.h"
+#include "UeventHub.h"
+#include "UsbDeviceStateHistory.h"
+
 namespace aidl {
 namespace android {
 namespace hardware {
@@ -47,15 +52,18 @@ class UsbDataSessionMonitor {
      * The host mode high-speed port and super-speed port can be assigned to either host1 or
      * host2 without affecting functionality.
      *
-     * UeventRegex: name regex of the device that's being monitored. The regex is matched against
-     *              uevent to detect dynamic creation/deletion/change of the device.
+     * ueventHub: uevent and epoll loop the monitor registers its subscriptions and fds with.
+     * UeventPattern: DEVPATH pattern of the device that's being monitored, see DevpathPattern.
+     *               It is matched against uevents to detect dynamic creation/deletion/change
+     *               of the device.
      * StatePath: usb device state sysfs path of the device, monitored by epoll.
      * dataRolePath: path to the usb data role sysfs, monitored by epoll.
      * updatePortStatusCb: the callback is invoked when the compliance warings changes.
      */
-    UsbDataSessionMonitor(const std::string &deviceUeventRegex, const std::string &deviceStatePath,
-                          const std::string &host1UeventRegex, const std::string &host1StatePath,
-                          const std::string &host2UeventRegex, const std::string &host2StatePath,
+    UsbDataSessionMonitor(UeventHub *ueventHub,
+                          const std::string &deviceUeventPattern, const std::string &deviceStatePath,
+                          const std::string &host1UeventPattern, const std::string &host1StatePath,
+                          const std::string &host2UeventPattern, const std::string &host2StatePath,
                           const std::string &dataRolePath,
                           std::function<void()> updatePortStatusCb);
     ~UsbDataSessionMonitor();
@@ -65,16 +73,17 @@ class UsbDataSessionMonitor {
   private:
     struct usbDeviceState {
         unique_fd fd;
+        CompliancePort port;
         std::string filePath;
-        std::string ueventRegex;
-        // Usb device states reported by state sysfs
-        std::vector<std::string> states;
-        // Timestamps of when the usb device states were captured
-        std::vector<boot_clock::time_point> timestamps;
+        std::string ueventPattern;
+        // Usb device states reported by state sysfs and when they were captured
+        UsbDeviceStateHistory history;
     };
 
-    static void *monitorThread(void *param);
-    void handleUevent();
+    int addEpollFile(const std::string &filePath, unique_fd &fileFd,
+                     UeventHub::FdHandler handler);
+    void removeEpollFile(const std::string &filePath, unique_fd &fileFd);
+    void handleHostUevent(const Uevent &event, struct usbDeviceState *hostState);
     void handleTimerEvent();
     void handleDataRoleEvent();
     void handleDeviceStateEvent(struct usbDeviceState *deviceState);
@@ -82,18 +91,21 @@ class UsbDataSessionMonitor {
     void setupNewSession();
     void reportUsbDataSessionMetrics();
     void evaluateComplianceWarning();
+    void armComplianceTimer(boot_clock::time_point deadline);
     void notifyComplianceWarning();
-    void updateUdcBindStatus(const std::string &devname);
+    void updateUdcBindStatus(bool newUdcBind);
 
-    pthread_t mMonitor;
-    unique_fd mEpollFd;
-    unique_fd mUeventFd;
+    UeventHub *mUeventHub;
+    // Host bind/unbind subscriptions, dropped by the destructor
+    std::vector<int> mSubscriptions;
     unique_fd mTimerFd;
     unique_fd mDataRoleFd;
     struct usbDeviceState mDeviceState;
     struct usbDeviceState mHost1State;
     struct usbDeviceState mHost2State;
     std::set<ComplianceWarning> mWarningSet;
+    // Rules from kComplianceRulesPath, or the default ones, deciding mWarningSet
+    ComplianceRuleEngine mComplianceRules;
     // Callback function to notify the caller when there's a change in compliance warnings.
     std::function<void()> mUpdatePortStatusCb;
     /*
@@ -109,6 +121,8 @@ class UsbDataSessionMonitor {
      * function switch, the udc device usually go through unbind and bind.
      */
     bool mUdcBind;
+    // Reports changes of mUdcBind for the udcs matching the device uevent pattern
+    UdcTracker mUdcTracker;
 };
 
 }  // namespace usb
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UsbDeviceStateHistory.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+namespace {
+
+// Sysfs content of each UsbDeviceState, indexed by state.
+constexpr std::string_view kStateNames[USB_DEVICE_STATE_COUNT] = {
+    "",           "not attached\n", "attached\n",   "powered\n",
+    "default\n",  "addressed\n",    "configured\n", "suspended\n",
+};
+
+}  // namespace
+
+UsbDeviceState parseUsbDeviceState(std::string_view state) {
+    for (int i = USB_DEVICE_STATE_NOT_ATTACHED; i < USB_DEVICE_STATE_COUNT; i++) {
+        if (state == kStateNames[i])
+            return static_cast<UsbDeviceState>(i);
+    }
+    return USB_DEVICE_STATE_UNKNOWN;
+}
+
+void UsbDeviceStateHistory::clear() {
+    mCounts.fill(0);
+    mTotal = 0;
+    mFirst = USB_DEVICE_STATE_UNKNOWN;
+}
+
+void UsbDeviceStateHistory::push(UsbDeviceState state, boot_clock::time_point timestamp) {
+    if (mTotal == 0)
+        mFirst = state;
+    mRing[mTotal % kCapacity] = {timestamp, state};
+    mCounts[state]++;
+    mTotal++;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
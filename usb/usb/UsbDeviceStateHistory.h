@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/chrono_utils.h>
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::boot_clock;
+
+/*
+ * Usb device states reported by the state sysfs. The values follow
+ * VendorUsbDataSessionEvent.UsbDeviceState so that they can be reported as is.
+ */
+enum UsbDeviceState : uint8_t {
+    USB_DEVICE_STATE_UNKNOWN = 0,
+    USB_DEVICE_STATE_NOT_ATTACHED,
+    USB_DEVICE_STATE_ATTACHED,
+    USB_DEVICE_STATE_POWERED,
+    USB_DEVICE_STATE_DEFAULT,
+    USB_DEVICE_STATE_ADDRESSED,
+    USB_DEVICE_STATE_CONFIGURED,
+    USB_DEVICE_STATE_SUSPENDED,
+    USB_DEVICE_STATE_COUNT,
+};
+
+// Parses the content of a usb device state sysfs, e.g. "configured\n".
+UsbDeviceState parseUsbDeviceState(std::string_view state);
+
+/*
+ * State transitions of a usb device within a data session. The most recent
+ * kCapacity transitions are kept in a fixed ring of packed records, so a
+ * flapping cable cannot grow the history without bound. Per-state counters
+ * cover the whole session, including records the ring has overwritten, and
+ * make the whole session counts of the compliance rules O(1).
+ */
+class UsbDeviceStateHistory {
+  public:
+    static constexpr size_t kCapacity = 64;
+
+    struct Record {
+        boot_clock::time_point timestamp;
+        UsbDeviceState state;
+    };
+
+    void clear();
+    void push(UsbDeviceState state, boot_clock::time_point timestamp);
+
+    // Number of transitions since clear(), overwritten ones included.
+    uint32_t total() const { return mTotal; }
+    uint32_t count(UsbDeviceState state) const { return mCounts[state]; }
+    // First transition since clear(), kept even when the ring has wrapped.
+    UsbDeviceState first() const { return mFirst; }
+
+    // Number of records retained in the ring.
+    size_t size() const { return mTotal < kCapacity ? mTotal : kCapacity; }
+    // i-th retained record, oldest first.
+    const Record &at(size_t i) const { return mRing[(mTotal - size() + i) % kCapacity]; }
+
+  private:
+    std::array<Record, kCapacity> mRing;
+    std::array<uint32_t, USB_DEVICE_STATE_COUNT> mCounts{};
+    uint32_t mTotal = 0;
+    UsbDeviceState mFirst = USB_DEVICE_STATE_UNKNOWN;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
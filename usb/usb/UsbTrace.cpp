@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UsbTrace.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+namespace {
+
+constexpr const char *kStageNames[TRACE_STAGE_COUNT] = {
+    "uevent_recv",
+    "uevent_classify",
+    "getPortStatusHelper",
+    "queryMoistureDetectionStatus",
+    "queryPowerTransferStatus",
+    "queryNonCompliantChargerStatus",
+    "queryUsbDataSession",
+    "notifyPortStatusChange",
+    "uevent_to_callback",
+};
+
+// Number of recent stages kept for dumpsys
+constexpr size_t kRingSize = 128;
+
+}  // namespace
+
+StageTracer *usbTracer() {
+    static StageTracer *sTracer = new StageTracer(kStageNames, TRACE_STAGE_COUNT, kRingSize);
+    return sTracer;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
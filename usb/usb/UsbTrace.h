@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <StageTrace.h>
+
+#include <cstdint>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+// Stages of the path from a uevent to notifyPortStatusChange.
+enum UsbTraceStage {
+    TRACE_UEVENT_RECV,
+    // Parsing and classification of a received uevent
+    TRACE_UEVENT_CLASSIFY,
+    // getPortStatusHelper
+    TRACE_TYPEC_STATUS,
+    TRACE_MOISTURE_DETECTION,
+    TRACE_POWER_TRANSFER,
+    TRACE_NON_COMPLIANT_CHARGER,
+    TRACE_USB_DATA_SESSION,
+    // Outbound notifyPortStatusChange binder call
+    TRACE_NOTIFY_CALLBACK,
+    // From the reception of a uevent to the end of the notification it caused
+    TRACE_UEVENT_TO_CALLBACK,
+    TRACE_STAGE_COUNT,
+};
+
+// Tracer of the UsbTraceStage stages, keeps a ring of the recent ones.
+StageTracer *usbTracer();
+
+/*
+ * Traces a stage for the lifetime of the object: an ATRACE section, a sample
+ * in the per-stage latency histogram and an entry in the in-memory ring of
+ * recent stages, all printed by dumpUsbTrace().
+ */
+class ScopedUsbTrace : public ScopedStageTrace {
+  public:
+    explicit ScopedUsbTrace(UsbTraceStage stage) : ScopedStageTrace(usbTracer(), stage) {}
+};
+
+// Records a stage measured by the caller, e.g. one spanning threads. CLOCK_MONOTONIC.
+inline void recordUsbTrace(UsbTraceStage stage, int64_t startNs, int64_t endNs) {
+    usbTracer()->record(stage, startNs, endNs);
+}
+
+inline void dumpUsbTrace(int fd) {
+    usbTracer()->dump(fd);
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "SysfsAttribute.h"
+#include "UeventSequences.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::TemporaryDir;
+using ::android::base::unique_fd;
+using ::android::base::WriteStringToFd;
+using ::android::base::WriteStringToFile;
+
+// Same paths as Usb.cpp
+constexpr char kUdcStatePath[] =
+    "/sys/devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3/state";
+constexpr char kHost1StatePath[] = "/sys/bus/usb/devices/usb2/2-0:1.0/usb2-port1/state";
+constexpr char kHost2StatePath[] = "/sys/bus/usb/devices/usb3/3-0:1.0/usb3-port1/state";
+constexpr char kDataRolePath[] = "/sys/devices/platform/11110000.usb/new_data_role";
+constexpr char kComplianceRulesFile[] = "/vendor/etc/usb_compliance_rules.json";
+
+/*
+ * sysfs of a gs101 port below a temporary sysfs root: port0 of the TCPC i2c
+ * client with the attributes of portStatusAttributes(), the usb power supply
+ * and the dwc3 udc, linked from /sys/class like the kernel does. Nothing is
+ * attached and the udc is unbound.
+ *
+ * sysfs attributes signal changes with POLLPRI, tmpfs files cannot even be
+ * added to an epoll set. The data role is a fifo instead, holding |dataRole|
+ * for the data session monitor to read when it starts; it never changes.
+ */
+class FakeUsbTree {
+  public:
+    explicit FakeUsbTree(const std::string &dataRole) {
+        std::string port0 = std::string("/sys") + kPort0Devpath;
+        std::string fifo = rooted(kDataRolePath);
+
+        makeDirs(port0 + "/port0-partner");
+        link("/sys/class/typec/port0", classLinkTarget(kPort0Devpath));
+        for (const auto &[path, value] : portStatusAttributes())
+            write(path, value);
+        write("/sys/class/typec/port0/port_type", "[dual] source sink\n");
+        write(port0 + "/port0-partner/accessory_mode", "none\n");
+        write(port0 + "/port0-partner/supports_usb_power_delivery", "yes\n");
+
+        write(std::string("/sys") + kUdcDevpath + "/function", "");
+        link("/sys/class/udc/11110000.dwc3", classLinkTarget(kUdcDevpath));
+
+        // Kept open for writing, so that opening it for reading does not block.
+        makeDirs(parent(kDataRolePath));
+        if (mkfifo(fifo.c_str(), 0644))
+            abort();
+        mDataRole.reset(open(fifo.c_str(), O_RDWR | O_CLOEXEC));
+        if (!WriteStringToFd(dataRole, mDataRole.get()))
+            abort();
+
+        setSysfsRoot(mRoot.path);
+    }
+
+    ~FakeUsbTree() { setSysfsRoot(""); }
+
+    // Rules the data session monitor loads instead of the default ones.
+    void setComplianceRules(const std::string &json) { write(kComplianceRulesFile, json); }
+
+    // Adds or removes /sys/class/typec/port0-partner, the partner directory stays.
+    void attachPartner(bool attached) {
+        if (attached)
+            link("/sys/class/typec/port0-partner",
+                 classLinkTarget(std::string(kPort0Devpath) + "/port0-partner"));
+        else
+            remove("/sys/class/typec/port0-partner");
+    }
+
+    // Adds or removes /sys/class/typec/<name>, a port of the TCPC next to port0 without a partner.
+    void attachPort(const std::string &name, bool attached) {
+        std::string devpath = std::string(kTcpcDevpath) + "/typec/" + name;
+
+        if (attached) {
+            makeDirs("/sys" + devpath);
+            link("/sys/class/typec/" + name, classLinkTarget(devpath));
+        } else {
+            remove("/sys/class/typec/" + name);
+        }
+    }
+
+    // Binds the configfs gadget to the udc or unbinds it, as the function attribute shows.
+    void bindUdc(bool bound) {
+        write(std::string("/sys") + kUdcDevpath + "/function", bound ? "g1\n" : "");
+    }
+
+    void write(const std::string &path, const std::string &value) {
+        makeDirs(parent(path));
+        WriteStringToFile(value, rooted(path));
+    }
+
+    void remove(const std::string &path) { unlink(rooted(path).c_str()); }
+
+  private:
+    static std::string parent(const std::string &path) { return path.substr(0, path.rfind('/')); }
+    // Relative target of a /sys/class/<class>/<name> link to the device at |devpath|
+    static std::string classLinkTarget(const std::string &devpath) { return "../.." + devpath; }
+
+    std::string rooted(const std::string &path) { return mRoot.path + path; }
+
+    void link(const std::string &path, const std::string &target) {
+        makeDirs(parent(path));
+        symlink(target.c_str(), rooted(path).c_str());
+    }
+
+    void makeDirs(const std::string &path) {
+        std::string dir = rooted(path);
+
+        for (size_t slash = dir.find('/', strlen(mRoot.path) + 1); slash != std::string::npos;
+             slash = dir.find('/', slash + 1))
+            mkdir(dir.substr(0, slash).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+    }
+
+    TemporaryDir mRoot;
+    unique_fd mDataRole;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/usb/BnUsbCallback.h>
+
+#include <string>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::ndk::ScopedAStatus;
+
+// Callback accepting every notification, tests override the ones they look at.
+class TestUsbCallback : public BnUsbCallback {
+  public:
+    ScopedAStatus notifyPortStatusChange(const std::vector<PortStatus> &, Status) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyRoleSwitchStatus(const std::string &, const PortRole &, Status,
+                                         int64_t) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyEnableUsbDataStatus(const std::string &, bool, Status,
+                                            int64_t) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyEnableUsbDataWhileDockedStatus(const std::string &, Status,
+                                                       int64_t) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyContaminantEnabledStatus(const std::string &, bool, Status,
+                                                 int64_t) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyQueryPortStatus(const std::string &, Status, int64_t) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyLimitPowerTransferStatus(const std::string &, bool, Status,
+                                                 int64_t) override {
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyResetUsbPortStatus(const std::string &, Status, int64_t) override {
+        return ScopedAStatus::ok();
+    }
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
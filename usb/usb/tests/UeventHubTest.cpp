@@ -0,0 +1,516 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DevpathPattern.h"
+#include "SysfsAttribute.h"
+#include "UeventClassifier.h"
+#include "UeventHub.h"
+#include "UeventInjector.h"
+#include "UeventSequences.h"
+#include "UsbCommandQueue.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace {
+
+using ::android::base::ReadFileToString;
+using ::android::base::TemporaryDir;
+using ::android::base::WriteStringToFile;
+using namespace std::chrono_literals;
+
+constexpr char kFenceDevpath[] = "/devices/virtual/fence";
+
+// Classifies |action|@|devpath| with |keyValues| the way the hub receives it.
+uint32_t classify(const std::string &action, const std::string &devpath,
+                  const std::vector<std::string> &keyValues) {
+    std::string msg = action + "@" + devpath;
+
+    for (const auto &keyValue : keyValues)
+        msg.append(1, '\0').append(keyValue);
+    return classifyUevent(msg.data(), msg.size());
+}
+
+// Devpaths delivered to a subscription, in order.
+class UeventRecorder {
+  public:
+    UeventHub::UeventHandler handler() {
+        return [this](const Uevent &event) {
+            std::lock_guard<std::mutex> lock(mLock);
+            mDevpaths.emplace_back(event.devpath);
+            mCV.notify_all();
+        };
+    }
+
+    std::vector<std::string> devpaths() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mDevpaths;
+    }
+
+    bool waitFor(size_t count) {
+        std::unique_lock<std::mutex> lock(mLock);
+        return mCV.wait_for(lock, 5s, [this, count] { return mDevpaths.size() >= count; });
+    }
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCV;
+    std::vector<std::string> mDevpaths;
+};
+
+class UeventHubTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mHub = std::make_unique<UeventHub>(mInjector.takeHubFd());
+        UeventFilter fence;
+        fence.devpathPrefixes = {kFenceDevpath};
+        mHub->subscribe(fence, mFences.handler());
+    }
+
+    // Returns once every uevent sent before was dispatched.
+    void flush() {
+        size_t fences = mFences.devpaths().size();
+
+        ASSERT_TRUE(mInjector.send("change", kFenceDevpath));
+        ASSERT_TRUE(mFences.waitFor(fences + 1));
+    }
+
+    // Value of |counter| in the dump of the hub.
+    uint64_t dumpCounter(const std::string &counter) {
+        std::string dump;
+        unsigned long long value = 0;
+        FILE *file = tmpfile();
+
+        mHub->dump(fileno(file));
+        ReadFileToString("/proc/self/fd/" + std::to_string(fileno(file)), &dump);
+        fclose(file);
+        size_t pos = dump.find(counter + ": ");
+        if (pos != std::string::npos)
+            sscanf(dump.c_str() + pos + counter.size() + 2, "%llu", &value);
+        return value;
+    }
+
+    UeventInjector mInjector;
+    std::unique_ptr<UeventHub> mHub;
+    UeventRecorder mFences;
+};
+
+TEST(DevpathPatternTest, MatchesLiteralPrefixAndChildren) {
+    DevpathPattern pattern;
+
+    ASSERT_TRUE(pattern.compile(kUdcDevpath));
+    // '.' matches any character, so the literal prefix stops at the first one.
+    EXPECT_EQ(pattern.literalPrefix(), "/devices/platform/11110000");
+    EXPECT_TRUE(pattern.matches(kUdcDevpath));
+    EXPECT_TRUE(pattern.matches(std::string(kUdcDevpath) + "/power"));
+    EXPECT_FALSE(pattern.matches("/devices/platform/11110000.usb/11110000.dwc3/udc"));
+    EXPECT_FALSE(pattern.matches("/devices/platform/11210000.usb/11110000.dwc3/udc/11110000.dwc3"));
+}
+
+TEST(DevpathPatternTest, MatchesClassesAndWildcards) {
+    DevpathPattern pattern;
+
+    ASSERT_TRUE(pattern.compile("/devices/platform/11110000\\.usb/xhci-hcd-exynos\\.[0-9]\\.auto/"
+                                "usb[^0]/."));
+    EXPECT_EQ(pattern.literalPrefix(), "/devices/platform/11110000.usb/xhci-hcd-exynos.");
+    EXPECT_TRUE(pattern.matches("/devices/platform/11110000.usb/xhci-hcd-exynos.4.auto/usb2/2"));
+    EXPECT_FALSE(pattern.matches("/devices/platform/11110000.usb/xhci-hcd-exynos.a.auto/usb2/2"));
+    EXPECT_FALSE(pattern.matches("/devices/platform/11110000.usb/xhci-hcd-exynos.4.auto/usb0/2"));
+    // Shorter than the pattern.
+    EXPECT_FALSE(pattern.matches("/devices/platform/11110000.usb/xhci-hcd-exynos.4.auto/usb2/"));
+}
+
+TEST(DevpathPatternTest, RejectsUnsupportedSyntax) {
+    DevpathPattern pattern;
+
+    EXPECT_FALSE(pattern.compile("/devices/.*"));
+    EXPECT_FALSE(pattern.compile("/devices/(a|b)"));
+    EXPECT_FALSE(pattern.compile("/devices/[0-9"));
+    EXPECT_FALSE(pattern.compile("/devices/\\"));
+    EXPECT_TRUE(pattern.compile(""));
+    EXPECT_TRUE(pattern.matches("/devices/anything"));
+}
+
+/*
+ * DevpathPattern replaced std::regex_search of the uevent header. Both have
+ * to agree on every recorded uevent and on each of its parent devices, which
+ * are shorter than the patterns.
+ */
+TEST(DevpathPatternTest, AgreesWithRegexOnRecordedSequences) {
+    int matched = 0;
+
+    for (const char *monitored : kMonitorUeventPatterns) {
+        DevpathPattern pattern;
+        std::regex regex(monitored);
+
+        ASSERT_TRUE(pattern.compile(monitored));
+        for (const auto &sequence : ueventSequences()) {
+            for (const auto &uevent : sequence.uevents) {
+                std::string devpath = uevent.devpath;
+
+                for (size_t end = devpath.size(); end > 0; end = devpath.rfind('/', end - 1)) {
+                    std::string parent = devpath.substr(0, end);
+                    bool matches = pattern.matches(parent);
+
+                    EXPECT_EQ(matches,
+                              std::regex_search(std::string(uevent.action) + "@" + parent, regex))
+                        << monitored << " on " << parent;
+                    matched += matches;
+                }
+            }
+        }
+    }
+    // The udc change uevents and the two host binds.
+    EXPECT_EQ(matched, 5);
+}
+
+TEST(UeventClassifierTest, ClassifiesPortStatusUevents) {
+    EXPECT_EQ(classify("add", std::string(kPort0Devpath) + "/port0-partner",
+                       {"DEVTYPE=typec_partner"}),
+              UEVENT_CLASS_PARTNER_ADD | UEVENT_CLASS_TYPEC);
+    EXPECT_EQ(classify("change", kPort0Devpath, {"DEVTYPE=typec_port"}), UEVENT_CLASS_TYPEC);
+    EXPECT_EQ(classify("change", kTcpcDevpath, {"DRIVER=max77759tcpc"}),
+              UEVENT_CLASS_TCPC_DRIVER);
+    EXPECT_EQ(classify("change", std::string(kTcpcDevpath) + "/power_supply/usb",
+                       {"POWER_SUPPLY_NAME=usb"}),
+              UEVENT_CLASS_POWER_SUPPLY_USB);
+    EXPECT_EQ(classify("change", "/devices/platform/google,usbc_port_cooling_dev",
+                       {"DRIVER=google,usbc_port_cooling_dev"}),
+              UEVENT_CLASS_OVERHEAT);
+}
+
+TEST(UeventClassifierTest, IgnoresOtherUevents) {
+    // Only the exact "usb" power supply, not one whose name starts with it.
+    EXPECT_EQ(classify("change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0036/power_supply/maxfg",
+                       {"POWER_SUPPLY_NAME=maxfg"}),
+              UEVENT_CLASS_NONE);
+    EXPECT_EQ(classify("remove", std::string(kPort0Devpath) + "/port0-partner", {}),
+              UEVENT_CLASS_NONE);
+    EXPECT_EQ(classify("change", kUdcDevpath, {"SUBSYSTEM=udc"}), UEVENT_CLASS_NONE);
+}
+
+TEST(UeventClassifierTest, StopsAtLength) {
+    std::string msg = std::string("change@") + kPort0Devpath + '\0' + "DEVTYPE=typec_port";
+
+    EXPECT_EQ(classifyUevent(msg.data(), msg.size()), UEVENT_CLASS_TYPEC);
+    // The key is cut short and must not be read past |len|.
+    EXPECT_EQ(classifyUevent(msg.data(), msg.size() - 6), UEVENT_CLASS_NONE);
+}
+
+TEST_F(UeventHubTest, DispatchesNothingBeforeStart) {
+    UeventRecorder recorder;
+    UeventFilter filter;
+
+    filter.devpathPrefixes = {kTcpcDevpath};
+    mHub->subscribe(filter, recorder.handler());
+    ASSERT_TRUE(mInjector.send("change", kTcpcDevpath));
+    std::this_thread::sleep_for(50ms);
+    EXPECT_TRUE(recorder.devpaths().empty());
+
+    mHub->start();
+    flush();
+    EXPECT_EQ(recorder.devpaths(), std::vector<std::string>{kTcpcDevpath});
+}
+
+TEST_F(UeventHubTest, FiltersOnClassActionPrefixAndKeys) {
+    UeventRecorder typec, udc, partner, limited;
+    UeventFilter filter;
+
+    filter.classes = kUeventClassPortStatus;
+    filter.devpathPrefixes = {kTcpcDevpath};
+    mHub->subscribe(filter, typec.handler());
+
+    filter = UeventFilter();
+    filter.actions = {"change"};
+    filter.devpathPattern = kUdcDevpath;
+    mHub->subscribe(filter, udc.handler());
+
+    filter = UeventFilter();
+    filter.classes = UEVENT_CLASS_PARTNER_ADD;
+    filter.devpathPrefixes = {kTcpcDevpath};
+    mHub->subscribe(filter, partner.handler());
+
+    filter = UeventFilter();
+    filter.devpathPrefixes = {kTcpcDevpath};
+    filter.keyValues = {{"CONTAMINANT_DETECTED", "1"}};
+    mHub->subscribe(filter, limited.handler());
+
+    mHub->start();
+    for (const auto &sequence : ueventSequences()) {
+        for (const auto &uevent : sequence.uevents)
+            ASSERT_TRUE(mInjector.send(uevent.action, uevent.devpath, uevent.keyValues));
+    }
+    flush();
+
+    std::string port0(kPort0Devpath), usb = std::string(kTcpcDevpath) + "/power_supply/usb";
+    std::string partnerPath = port0 + "/port0-partner";
+    EXPECT_EQ(typec.devpaths(),
+              (std::vector<std::string>{usb, partnerPath, port0, usb, partnerPath, usb, port0, port0,
+                                        usb, kTcpcDevpath, port0, kTcpcDevpath}));
+    EXPECT_EQ(udc.devpaths(), std::vector<std::string>(3, kUdcDevpath));
+    EXPECT_EQ(partner.devpaths(), std::vector<std::string>{port0 + "/port0-partner"});
+    EXPECT_EQ(limited.devpaths(), std::vector<std::string>{kTcpcDevpath});
+}
+
+TEST_F(UeventHubTest, SocketFilterDropsUeventsNobodyWants) {
+    UeventRecorder recorder;
+    UeventFilter filter;
+
+    filter.devpathPrefixes = {kUdcDevpath};
+    mHub->subscribe(filter, recorder.handler());
+    mHub->start();
+
+    ASSERT_TRUE(mInjector.send("change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0036"));
+    ASSERT_TRUE(mInjector.send("change", kUdcDevpath));
+    ASSERT_TRUE(mInjector.send("change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0069"));
+    flush();
+
+    EXPECT_EQ(recorder.devpaths(), std::vector<std::string>{kUdcDevpath});
+    // The uevent between two received ones shows up as a SEQNUM gap.
+    EXPECT_EQ(dumpCounter("received"), 2u);
+    EXPECT_EQ(dumpCounter("filtered in kernel"), 1u);
+}
+
+TEST_F(UeventHubTest, UnsubscribeStopsDelivery) {
+    UeventRecorder recorder;
+    UeventFilter filter;
+
+    filter.devpathPrefixes = {kUdcDevpath};
+    int id = mHub->subscribe(filter, recorder.handler());
+    mHub->start();
+
+    ASSERT_TRUE(mInjector.send("change", kUdcDevpath));
+    flush();
+    mHub->unsubscribe(id);
+    ASSERT_TRUE(mInjector.send("change", kUdcDevpath));
+    flush();
+
+    EXPECT_EQ(recorder.devpaths().size(), 1u);
+}
+
+TEST_F(UeventHubTest, RunsFdHandlersOnTheHubThread) {
+    unique_fd event(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    std::mutex lock;
+    std::condition_variable cv;
+    bool called = false;
+    uint64_t value = 1;
+
+    ASSERT_EQ(mHub->addFd(event.get(), EPOLLIN, [&](uint32_t) {
+        uint64_t count;
+        ASSERT_EQ(read(event.get(), &count, sizeof(count)), sizeof(count));
+        std::lock_guard<std::mutex> guard(lock);
+        called = true;
+        cv.notify_all();
+    }), 0);
+    mHub->start();
+
+    ASSERT_EQ(write(event.get(), &value, sizeof(value)), sizeof(value));
+    std::unique_lock<std::mutex> guard(lock);
+    EXPECT_TRUE(cv.wait_for(guard, 5s, [&] { return called; }));
+    guard.unlock();
+    mHub->removeFd(event.get());
+}
+
+TEST_F(UeventHubTest, StopEndsDispatch) {
+    UeventRecorder recorder;
+    UeventFilter filter;
+
+    filter.devpathPrefixes = {kUdcDevpath};
+    mHub->subscribe(filter, recorder.handler());
+    mHub->start();
+    mHub->stop();
+    mHub->stop();
+
+    ASSERT_TRUE(mInjector.send("change", kUdcDevpath));
+    std::this_thread::sleep_for(50ms);
+    EXPECT_TRUE(recorder.devpaths().empty());
+}
+
+TEST(UsbCommandQueueTest, RunsCommandsInOrder) {
+    UsbCommandQueue queue("test");
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<int> order;
+
+    for (int i = 0; i < 8; i++) {
+        queue.enqueue("command", [&, i] {
+            std::lock_guard<std::mutex> guard(lock);
+            order.push_back(i);
+            cv.notify_all();
+        });
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    ASSERT_TRUE(cv.wait_for(guard, 5s, [&] { return order.size() == 8; }));
+    EXPECT_EQ(order, (std::vector<int>{0, 1, 2, 3, 4, 5, 6, 7}));
+}
+
+// Blocks the worker of a queue until released, so that commands pile up behind it.
+class QueueBlocker {
+  public:
+    explicit QueueBlocker(UsbCommandQueue *queue) : mReleased(false) {
+        queue->enqueue("blocker", [this] {
+            std::unique_lock<std::mutex> lock(mLock);
+            mCV.wait(lock, [this] { return mReleased; });
+        });
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mReleased = true;
+        mCV.notify_all();
+    }
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCV;
+    bool mReleased;
+};
+
+TEST(UsbCommandQueueTest, CoalescesPendingQueries) {
+    std::atomic<int> executed = 0, completed = 0;
+    {
+        UsbCommandQueue queue("test");
+        QueueBlocker blocker(&queue);
+
+        for (int i = 0; i < 4; i++)
+            queue.enqueueCoalesced("query", [&] { executed++; }, [&] { completed++; });
+        blocker.release();
+    }
+    // The destructor drained the queue.
+    EXPECT_EQ(executed, 1);
+    EXPECT_EQ(completed, 4);
+}
+
+TEST(UsbCommandQueueTest, SupersedesPendingSwitches) {
+    std::vector<int> executed, superseded;
+    {
+        UsbCommandQueue queue("test");
+        QueueBlocker blocker(&queue);
+
+        for (int i = 0; i < 4; i++) {
+            queue.enqueueSuperseding(
+                "switch", [&, i] { executed.push_back(i); },
+                [&, i] { superseded.push_back(i); });
+        }
+        blocker.release();
+    }
+    EXPECT_EQ(executed, std::vector<int>{3});
+    EXPECT_EQ(superseded, (std::vector<int>{0, 1, 2}));
+}
+
+class SysfsAttributeTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        setSysfsRoot(mRoot.path);
+        for (const auto &[path, value] : portStatusAttributes())
+            ASSERT_TRUE(create(path, value));
+    }
+
+    void TearDown() override { setSysfsRoot(""); }
+
+    // Creates |path| below the root, with its parent directories.
+    bool create(const std::string &path, const std::string &value) {
+        std::string rooted = sysfsPath(path);
+
+        for (size_t slash = rooted.find('/', strlen(mRoot.path) + 1);
+             slash != std::string::npos; slash = rooted.find('/', slash + 1))
+            mkdir(rooted.substr(0, slash).c_str(), 0755);
+        return WriteStringToFile(value, rooted);
+    }
+
+    TemporaryDir mRoot;
+};
+
+TEST_F(SysfsAttributeTest, ReadsTrimmedValues) {
+    SysfsAttribute attribute("/sys/class/typec/port0/data_role");
+    char buf[64];
+    std::string_view value;
+
+    ASSERT_TRUE(attribute.read(buf, sizeof(buf), &value));
+    EXPECT_EQ(value, "host [device]");
+}
+
+TEST_F(SysfsAttributeTest, ReadsRewrittenValuesThroughTheKeptFd) {
+    SysfsAttribute attribute("/sys/class/typec/port0/power_role");
+    char buf[64];
+    std::string_view value;
+
+    ASSERT_TRUE(attribute.read(buf, sizeof(buf), &value));
+    EXPECT_EQ(value, "source [sink]");
+    ASSERT_TRUE(WriteStringToFile("[source] sink\n", sysfsPath(attribute.path())));
+    ASSERT_TRUE(attribute.read(buf, sizeof(buf), &value));
+    EXPECT_EQ(value, "[source] sink");
+}
+
+TEST_F(SysfsAttributeTest, WritesValues) {
+    SysfsAttribute attribute(
+        "/sys/devices/platform/10d50000.hsi2c/i2c-12/12-0025/usb_limit_sink_enable");
+    std::string content;
+
+    ASSERT_TRUE(attribute.write("1"));
+    ASSERT_TRUE(ReadFileToString(sysfsPath(attribute.path()), &content));
+    // Unlike a sysfs attribute, the regular file keeps the rest of the old value.
+    EXPECT_EQ(content, "1\n");
+}
+
+TEST_F(SysfsAttributeTest, OpensAttributesThatAppearLater) {
+    SysfsAttribute attribute("/sys/class/typec/port0/port0-partner/usb_power_delivery_revision");
+    char buf[64];
+    std::string_view value;
+
+    EXPECT_FALSE(attribute.read(buf, sizeof(buf), &value));
+    ASSERT_TRUE(create(attribute.path(), "3.0\n"));
+    ASSERT_TRUE(attribute.read(buf, sizeof(buf), &value));
+    EXPECT_EQ(value, "3.0");
+}
+
+TEST_F(SysfsAttributeTest, CacheKeepsOneAttributePerPath) {
+    SysfsAttributeCache cache;
+    char buf[64];
+    std::string_view value;
+
+    EXPECT_EQ(cache.get("/sys/class/power_supply/usb/usb_type"),
+              cache.get("/sys/class/power_supply/usb/usb_type"));
+    ASSERT_TRUE(cache.read("/sys/class/power_supply/usb/usb_type", buf, sizeof(buf), &value));
+    EXPECT_EQ(value, "Unknown [SDP] CDP DCP");
+}
+
+}  // namespace
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
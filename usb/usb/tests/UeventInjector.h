@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/unique_fd.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+using ::android::base::unique_fd;
+
+/*
+ * Feeds uevents to a UeventHub through a socketpair, in the kernel wire
+ * format "<action>@<devpath>\0ACTION=...\0DEVPATH=...\0KEY=VALUE...\0SEQNUM=n".
+ * The datagram socket keeps one uevent per recv() like the netlink socket.
+ */
+class UeventInjector {
+  public:
+    UeventInjector() : mSeqnum(0) {
+        int fds[2];
+
+        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) == 0) {
+            mHubFd.reset(fds[0]);
+            mFd.reset(fds[1]);
+        }
+    }
+
+    // End to pass to the UeventHub constructor.
+    unique_fd takeHubFd() { return std::move(mHubFd); }
+
+    // Sends |action|@|devpath| with |keyValues|, e.g. {"DEVTYPE=typec_port"}.
+    bool send(std::string_view action, std::string_view devpath,
+              const std::vector<std::string> &keyValues = {}) {
+        std::string msg;
+
+        msg.append(action).append("@").append(devpath).push_back('\0');
+        msg.append("ACTION=").append(action).push_back('\0');
+        msg.append("DEVPATH=").append(devpath).push_back('\0');
+        for (const auto &keyValue : keyValues)
+            msg.append(keyValue).push_back('\0');
+        msg.append("SEQNUM=").append(std::to_string(++mSeqnum));
+        return sendRaw(msg);
+    }
+
+    // Sends |msg| as is, e.g. a captured uevent.
+    bool sendRaw(std::string_view msg) {
+        return TEMP_FAILURE_RETRY(::send(mFd.get(), msg.data(), msg.size(), 0)) ==
+               static_cast<ssize_t>(msg.size());
+    }
+
+  private:
+    unique_fd mHubFd;
+    unique_fd mFd;
+    uint64_t mSeqnum;
+};
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
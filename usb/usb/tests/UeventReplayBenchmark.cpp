@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <android-base/file.h>
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "DevpathPattern.h"
+#include "FakeUsbTree.h"
+#include "LatencyHistogram.h"
+#include "TestUsbCallback.h"
+#include "UeventClassifier.h"
+#include "UeventHub.h"
+#include "UeventInjector.h"
+#include "UeventSequences.h"
+#include "Usb.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace {
+
+using ::android::base::ReadFileToString;
+
+constexpr char kFenceDevpath[] = "/devices/virtual/fence";
+
+std::vector<std::string> rawUevents() {
+    std::vector<std::string> raw;
+
+    for (const auto &sequence : ueventSequences()) {
+        for (const auto &uevent : sequence.uevents) {
+            std::string msg = std::string(uevent.action) + "@" + uevent.devpath;
+            for (const auto &keyValue : uevent.keyValues)
+                msg.append(1, '\0').append(keyValue);
+            raw.push_back(msg);
+        }
+    }
+    return raw;
+}
+
+// Records when the port status was last notified and which queries were answered.
+class ReplayCallback : public TestUsbCallback {
+  public:
+    ScopedAStatus notifyPortStatusChange(const std::vector<PortStatus> &, Status) override {
+        std::lock_guard<std::mutex> lock(mLock);
+        mNotifiedNs = LatencyHistogram::now();
+        mNotifications++;
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyQueryPortStatus(const std::string &, Status,
+                                        int64_t transactionId) override {
+        std::lock_guard<std::mutex> lock(mLock);
+        mAnswered = transactionId;
+        mCV.notify_all();
+        return ScopedAStatus::ok();
+    }
+
+    // Returns the time of the last notification, 0 if none came since the last call.
+    int64_t takeNotifiedNs() {
+        std::lock_guard<std::mutex> lock(mLock);
+        int64_t notifiedNs = mNotifiedNs;
+
+        mNotifiedNs = 0;
+        return notifiedNs;
+    }
+
+    uint64_t notifications() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mNotifications;
+    }
+
+    void waitForQuery(int64_t transactionId) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCV.wait(lock, [this, transactionId] { return mAnswered >= transactionId; });
+    }
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCV;
+    int64_t mNotifiedNs = 0;
+    uint64_t mNotifications = 0;
+    int64_t mAnswered = -1;
+};
+
+/*
+ * The USB HAL on a fake sysfs tree, fed with a recorded sequence: a Usb and
+ * its UsbDataSessionMonitor receive the uevents through their UeventHub and
+ * the port status handler runs as on a device, uevent_event() ->
+ * queryVersionHelper() -> notifyPortStatusChange(), up to a test callback.
+ *
+ * Each uevent is sent once the attributes it reports were changed and after
+ * the previous one was fully handled, see sendAndWait(). The latency of a
+ * uevent is the time from its send to the notification it caused, if any.
+ */
+class ReplayHarness {
+  public:
+    explicit ReplayHarness(const UeventSequence &sequence)
+        : mSequence(sequence), mTree("none"), mQueries(0), mSent(0) {
+        mUsb = ndk::SharedRefBase::make<Usb>(mInjector.takeHubFd());
+        mCallback = ndk::SharedRefBase::make<ReplayCallback>();
+        mUsb->setCallback(mCallback);
+
+        UeventFilter filter;
+        filter.devpathPrefixes = {kFenceDevpath};
+        mUsb->mUeventHub.subscribe(filter, [this](const Uevent &) {
+            // Behind the notifications of the uevents handled before the fence.
+            mUsb->mPortStatusNotifier.enqueue("fence", [this] {
+                std::lock_guard<std::mutex> lock(mLock);
+                mFences++;
+                mCV.notify_all();
+            });
+        });
+    }
+
+    ~ReplayHarness() { mUsb->setCallback(nullptr); }
+
+    // Puts the tree back to the start of the sequence and waits until the HAL reported it.
+    void reset() {
+        mTree.attachPartner(mSequence.partnerAttached);
+        for (const auto &[path, value] : portStatusAttributes())
+            mTree.write(path, value);
+        for (const auto &[path, value] : mSequence.attributes)
+            mTree.write(path, value);
+
+        mUsb->queryPortStatus(++mQueries);
+        mCallback->waitForQuery(mQueries);
+        mCallback->takeNotifiedNs();
+    }
+
+    void replay() {
+        for (const auto &uevent : mSequence.uevents) {
+            for (const auto &keyValue : uevent.keyValues) {
+                if (keyValue == "DEVTYPE=typec_partner")
+                    mTree.attachPartner(std::string_view(uevent.action) == "add");
+            }
+            for (const auto &[path, value] : uevent.attributes)
+                mTree.write(path, value);
+            sendAndWait(uevent);
+        }
+    }
+
+    void report(benchmark::State &state) {
+        std::vector<int64_t> latencies = mLatencies;
+        uint64_t received = dumpCounter("received");
+
+        std::sort(latencies.begin(), latencies.end());
+        if (!latencies.empty()) {
+            state.counters["p50_us"] = latencies[latencies.size() / 2] / 1000.0;
+            state.counters["p99_us"] = latencies[latencies.size() * 99 / 100] / 1000.0;
+            state.counters["max_us"] = latencies.back() / 1000.0;
+        }
+        state.counters["notified_per_event"] = static_cast<double>(latencies.size()) / mSent;
+        // Fences are received too, one per uevent sent.
+        state.counters["recv_per_event"] = static_cast<double>(received) / mSent - 1;
+    }
+
+  private:
+    // Sends |uevent| followed by a fence and waits until the fence passed the notifier.
+    void sendAndWait(const RecordedUevent &uevent) {
+        uint64_t fences;
+        int64_t sentNs;
+
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            fences = mFences;
+        }
+        sentNs = LatencyHistogram::now();
+        mInjector.send(uevent.action, uevent.devpath, uevent.keyValues);
+        mInjector.send("change", kFenceDevpath);
+        mSent++;
+
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            mCV.wait(lock, [this, fences] { return mFences > fences; });
+        }
+        int64_t notifiedNs = mCallback->takeNotifiedNs();
+        if (notifiedNs)
+            mLatencies.push_back(notifiedNs - sentNs);
+    }
+
+    uint64_t dumpCounter(const std::string &counter) {
+        std::string dump;
+        unsigned long long value = 0;
+        FILE *file = tmpfile();
+
+        mUsb->mUeventHub.dump(fileno(file));
+        ReadFileToString("/proc/self/fd/" + std::to_string(fileno(file)), &dump);
+        fclose(file);
+        size_t pos = dump.find(counter + ": ");
+        if (pos != std::string::npos)
+            sscanf(dump.c_str() + pos + counter.size() + 2, "%llu", &value);
+        return value;
+    }
+
+    const UeventSequence &mSequence;
+    FakeUsbTree mTree;
+    UeventInjector mInjector;
+    shared_ptr<Usb> mUsb;
+    shared_ptr<ReplayCallback> mCallback;
+    int64_t mQueries;
+    uint64_t mSent;
+    std::vector<int64_t> mLatencies;
+    // Protects everything below
+    std::mutex mLock;
+    std::condition_variable mCV;
+    uint64_t mFences = 0;
+};
+
+void BM_ClassifyUevent(benchmark::State &state) {
+    std::vector<std::string> raw = rawUevents();
+
+    for (auto _ : state) {
+        for (const auto &msg : raw)
+            benchmark::DoNotOptimize(classifyUevent(msg.data(), msg.size()));
+    }
+    state.SetItemsProcessed(state.iterations() * raw.size());
+}
+BENCHMARK(BM_ClassifyUevent);
+
+// "<action>@<devpath>" of every recorded uevent, the string the HAL used to search.
+std::vector<std::string> ueventHeaders() {
+    std::vector<std::string> headers;
+
+    for (const auto &sequence : ueventSequences()) {
+        for (const auto &uevent : sequence.uevents)
+            headers.push_back(std::string(uevent.action) + "@" + uevent.devpath);
+    }
+    return headers;
+}
+
+void BM_DevpathPatternMatch(benchmark::State &state) {
+    std::vector<DevpathPattern> patterns;
+    std::vector<std::string> devpaths;
+
+    for (const char *monitored : kMonitorUeventPatterns) {
+        patterns.emplace_back();
+        patterns.back().compile(monitored);
+    }
+    for (const auto &sequence : ueventSequences()) {
+        for (const auto &uevent : sequence.uevents)
+            devpaths.push_back(uevent.devpath);
+    }
+
+    for (auto _ : state) {
+        for (const auto &devpath : devpaths) {
+            for (const auto &pattern : patterns)
+                benchmark::DoNotOptimize(pattern.matches(devpath));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * devpaths.size() * patterns.size());
+}
+BENCHMARK(BM_DevpathPatternMatch);
+
+/*
+ * What DevpathPattern replaced: std::regex_search of the same patterns over
+ * the uevent header, with the regexes compiled once as the hub did at
+ * subscription time.
+ */
+void BM_DevpathRegexSearch(benchmark::State &state) {
+    std::vector<std::regex> regexes;
+    std::vector<std::string> headers = ueventHeaders();
+
+    for (const char *monitored : kMonitorUeventPatterns)
+        regexes.emplace_back(monitored);
+
+    for (auto _ : state) {
+        for (const auto &header : headers) {
+            for (const auto &regex : regexes)
+                benchmark::DoNotOptimize(std::regex_search(header, regex));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * headers.size() * regexes.size());
+}
+BENCHMARK(BM_DevpathRegexSearch);
+
+// Replays the sequence numbered by the argument through the HAL, see ueventSequences().
+void BM_UeventReplay(benchmark::State &state) {
+    const UeventSequence &sequence = ueventSequences()[state.range(0)];
+    ReplayHarness harness(sequence);
+
+    state.SetLabel(sequence.name);
+    for (auto _ : state) {
+        state.PauseTiming();
+        harness.reset();
+        state.ResumeTiming();
+        harness.replay();
+    }
+    state.SetItemsProcessed(state.iterations() * sequence.uevents.size());
+    harness.report(state);
+}
+BENCHMARK(BM_UeventReplay)->DenseRange(0, 2)->UseRealTime();
+
+}  // namespace
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
+
+BENCHMARK_MAIN();
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+
+/*
+ * Uevent sequences of a gs101 port in the order the kernel emits them, in the
+ * shape "udevadm monitor --kernel --property" prints, trimmed to the keys the
+ * HAL looks at. SEQNUM is left out, the injector numbers the uevents as it
+ * sends them. The fuel gauge (12-0036) and the charger (12-0069) share the i2c
+ * controller with the TCPC (12-0025); their uevents are interleaved as noise.
+ *
+ * Along with the uevents go the attributes the port status depends on, so
+ * that the sequences can be played against the HAL on a fake sysfs tree.
+ * The port0 partner comes and goes with the add and remove uevents of the
+ * typec_partner.
+ */
+using SysfsAttributes = std::vector<std::pair<std::string, std::string>>;
+
+struct RecordedUevent {
+    const char *action;
+    const char *devpath;
+    std::vector<std::string> keyValues;
+    // Attributes below the sysfs root the kernel changed before emitting the uevent
+    SysfsAttributes attributes;
+};
+
+struct UeventSequence {
+    const char *name;
+    std::vector<RecordedUevent> uevents;
+    // Whether the port0 partner is attached when the sequence starts
+    bool partnerAttached;
+    // Attributes at the start of the sequence, on top of portStatusAttributes()
+    SysfsAttributes attributes;
+};
+
+constexpr char kTcpcDevpath[] = "/devices/platform/10d50000.hsi2c/i2c-12/12-0025";
+constexpr char kPort0Devpath[] = "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/typec/port0";
+constexpr char kUdcDevpath[] = "/devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3";
+// Same patterns as Usb.cpp, which searched uevents with them as std::regex before DevpathPattern
+constexpr char kHost1UeventPattern[] =
+    "/devices/platform/11110000.usb/11110000.dwc3/xhci-hcd-exynos.[0-9].auto/usb2/2-0:1.0";
+constexpr char kHost2UeventPattern[] =
+    "/devices/platform/11110000.usb/11110000.dwc3/xhci-hcd-exynos.[0-9].auto/usb3/3-0:1.0";
+// DEVPATH patterns the data session monitor subscribes with
+constexpr const char *kMonitorUeventPatterns[] = {kUdcDevpath, kHost1UeventPattern,
+                                                  kHost2UeventPattern};
+
+inline const std::vector<UeventSequence> &ueventSequences() {
+    static const std::vector<UeventSequence> sSequences = {
+        {"hotplug",
+         {
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/power_supply/usb",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=usb", "POWER_SUPPLY_PRESENT=1"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0036/power_supply/maxfg",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=maxfg"}},
+             {"add", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/typec/port0/port0-partner",
+              {"SUBSYSTEM=typec", "DEVTYPE=typec_partner"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/typec/port0",
+              {"SUBSYSTEM=typec", "DEVTYPE=typec_port", "TYPEC_PORT=port0"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0069/power_supply/main-charger",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=main-charger"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/power_supply/usb",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=usb", "POWER_SUPPLY_USB_TYPE=SDP"},
+              {{"/sys/class/power_supply/usb/usb_type", "Unknown [SDP] CDP DCP\n"}}},
+             {"change", "/devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3",
+              {"SUBSYSTEM=udc"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0036/power_supply/battery",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=battery"}},
+             {"change", "/devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3",
+              {"SUBSYSTEM=udc"}},
+             {"remove", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/typec/port0/port0-partner",
+              {"SUBSYSTEM=typec", "DEVTYPE=typec_partner"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/power_supply/usb",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=usb", "POWER_SUPPLY_PRESENT=0"},
+              {{"/sys/class/power_supply/usb/usb_type", "[Unknown] SDP CDP DCP\n"}}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0036/power_supply/maxfg",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=maxfg"}},
+         },
+         false,
+         {{"/sys/class/power_supply/usb/usb_type", "[Unknown] SDP CDP DCP\n"}}},
+        {"role_swap",
+         {
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/typec/port0",
+              {"SUBSYSTEM=typec", "DEVTYPE=typec_port", "TYPEC_PORT=port0"},
+              {{"/sys/class/typec/port0/data_role", "[host] device\n"},
+               {"/sys/class/typec/port0/power_role", "[source] sink\n"}}},
+             {"change", "/devices/platform/11110000.usb/11110000.dwc3/udc/11110000.dwc3",
+              {"SUBSYSTEM=udc"}},
+             {"add", "/devices/platform/11110000.usb/11110000.dwc3/xhci-hcd-exynos.4.auto",
+              {"SUBSYSTEM=platform", "DRIVER=xhci-hcd-exynos"}},
+             {"bind",
+              "/devices/platform/11110000.usb/11110000.dwc3/xhci-hcd-exynos.4.auto/usb2/2-0:1.0",
+              {"SUBSYSTEM=usb", "DEVTYPE=usb_interface", "DRIVER=hub"}},
+             {"bind",
+              "/devices/platform/11110000.usb/11110000.dwc3/xhci-hcd-exynos.4.auto/usb3/3-0:1.0",
+              {"SUBSYSTEM=usb", "DEVTYPE=usb_interface", "DRIVER=hub"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0069/power_supply/main-charger",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=main-charger"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/typec/port0",
+              {"SUBSYSTEM=typec", "DEVTYPE=typec_port", "TYPEC_PORT=port0"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/power_supply/usb",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=usb"}},
+         },
+         true,
+         {}},
+        {"contaminant",
+         {
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025",
+              {"SUBSYSTEM=i2c", "DRIVER=max77759tcpc", "CONTAMINANT_DETECTED=1"},
+              {{"/sys/devices/platform/10d50000.hsi2c/i2c-12/12-0025/contaminant_detection_status",
+                "1\n"}}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0036/power_supply/maxfg",
+              {"SUBSYSTEM=power_supply", "POWER_SUPPLY_NAME=maxfg"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025/typec/port0",
+              {"SUBSYSTEM=typec", "DEVTYPE=typec_port", "TYPEC_PORT=port0"}},
+             {"change", "/devices/platform/google,usbc_port_cooling_dev",
+              {"SUBSYSTEM=platform", "DRIVER=google,usbc_port_cooling_dev"}},
+             {"change", "/devices/platform/10d50000.hsi2c/i2c-12/12-0025",
+              {"SUBSYSTEM=i2c", "DRIVER=max77759tcpc", "CONTAMINANT_DETECTED=0"},
+              {{"/sys/devices/platform/10d50000.hsi2c/i2c-12/12-0025/contaminant_detection_status",
+                "0\n"}}},
+         },
+         false,
+         {}},
+    };
+
+    return sSequences;
+}
+
+// Attributes the port status refresh reads, below the sysfs root, with plausible values.
+inline const SysfsAttributes &portStatusAttributes() {
+    static const SysfsAttributes sAttributes = {
+        {"/sys/class/typec/port0/data_role", "host [device]\n"},
+        {"/sys/class/typec/port0/power_role", "source [sink]\n"},
+        {"/sys/class/typec/port0/power_operation_mode", "default\n"},
+        {"/sys/class/power_supply/usb/usb_type", "Unknown [SDP] CDP DCP\n"},
+        {"/sys/devices/platform/10d50000.hsi2c/i2c-12/12-0025/contaminant_detection", "1\n"},
+        {"/sys/devices/platform/10d50000.hsi2c/i2c-12/12-0025/contaminant_detection_status",
+         "0\n"},
+        {"/sys/devices/platform/10d50000.hsi2c/i2c-12/12-0025/usb_limit_sink_enable", "0\n"},
+    };
+
+    return sAttributes;
+}
+
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl
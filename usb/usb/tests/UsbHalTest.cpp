@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <android_hardware_usb_flags.h>
+#include <gtest/gtest.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FakeUsbTree.h"
+#include "TestUsbCallback.h"
+#include "UeventHub.h"
+#include "UeventInjector.h"
+#include "Usb.h"
+#include "UsbDataSessionMonitor.h"
+
+namespace aidl {
+namespace android {
+namespace hardware {
+namespace usb {
+namespace {
+
+namespace usb_flags = ::android::hardware::usb::flags;
+using namespace std::chrono_literals;
+
+// CPU time used by every thread of the process.
+std::chrono::nanoseconds processCpuTime() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+/*
+ * Data session monitor of a port in device role. ENUMERATION_FAIL is raised
+ * kShortDelay after the gadget is bound, FLAKY_CONNECTION kLongDelay after,
+ * unless the session ended before.
+ */
+class UsbDataSessionMonitorTest : public ::testing::Test {
+  protected:
+    static constexpr auto kShortDelay = 50ms;
+    static constexpr auto kLongDelay = 1000ms;
+
+    UsbDataSessionMonitorTest() : mTree("device"), mWarningChanges(0) {}
+
+    void SetUp() override {
+        if (!usb_flags::enable_report_usb_data_compliance_warning())
+            GTEST_SKIP() << "compliance warnings are not reported";
+
+        mTree.setComplianceRules(R"({"rules": [
+            {"warning": "ENUMERATION_FAIL", "role": "device", "delay_ms": 50, "conditions": [
+                {"metric": "state_count", "state": "configured", "op": "==", "value": 0}]},
+            {"warning": "FLAKY_CONNECTION", "role": "device", "delay_ms": 1000, "conditions": [
+                {"metric": "state_count", "state": "configured", "op": "==", "value": 0}]}]})");
+        mHub = std::make_unique<UeventHub>(mInjector.takeHubFd());
+        mMonitor = std::make_unique<UsbDataSessionMonitor>(
+            mHub.get(), kUdcDevpath, kUdcStatePath, kHost1UeventPattern, kHost1StatePath,
+            kHost2UeventPattern, kHost2StatePath, kDataRolePath, [this] {
+                std::lock_guard<std::mutex> lock(mLock);
+                mWarningChanges++;
+                mCV.notify_all();
+            });
+        mHub->start();
+    }
+
+    void TearDown() override {
+        mMonitor.reset();
+        if (mHub)
+            mHub->stop();
+    }
+
+    // Binds or unbinds the gadget and sends the change@ the udc core sends.
+    void bindUdc(bool bound) {
+        mTree.bindUdc(bound);
+        ASSERT_TRUE(mInjector.send("change", kUdcDevpath, {"SUBSYSTEM=udc"}));
+    }
+
+    // Waits until the compliance warnings changed |count| times in total.
+    bool waitForWarningChanges(int count) {
+        std::unique_lock<std::mutex> lock(mLock);
+        return mCV.wait_for(lock, 5s, [this, count] { return mWarningChanges >= count; });
+    }
+
+    int warningChanges() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mWarningChanges;
+    }
+
+    FakeUsbTree mTree;
+    UeventInjector mInjector;
+    std::unique_ptr<UeventHub> mHub;
+    std::unique_ptr<UsbDataSessionMonitor> mMonitor;
+    std::mutex mLock;
+    std::condition_variable mCV;
+    int mWarningChanges;
+};
+
+/*
+ * Rules are not evaluated while the gadget is unbound, so their deadlines
+ * stay where the session left them. The timer must not be armed for them: a
+ * deadline in the past fires right away, again and again.
+ */
+TEST_F(UsbDataSessionMonitorTest, UnbindDisarmsPendingDeadlines) {
+    auto sessionStart = std::chrono::steady_clock::now();
+
+    bindUdc(true);
+    // ENUMERATION_FAIL raised, FLAKY_CONNECTION still pending.
+    ASSERT_TRUE(waitForWarningChanges(1));
+    bindUdc(false);
+    // Cleared by the end of the session.
+    ASSERT_TRUE(waitForWarningChanges(2));
+    ASSERT_LT(std::chrono::steady_clock::now() - sessionStart, kLongDelay);
+
+    std::this_thread::sleep_until(sessionStart + kLongDelay + 100ms);
+    auto cpuTime = processCpuTime();
+    std::this_thread::sleep_for(300ms);
+    EXPECT_LT(processCpuTime() - cpuTime, 100ms);
+    EXPECT_EQ(warningChanges(), 2);
+
+    // The next session is timed again.
+    bindUdc(true);
+    EXPECT_TRUE(waitForWarningChanges(3));
+}
+
+/*
+ * The port status moves through four states, each one differing from the
+ * previous one by a single symlink that appears or goes away at once: bit 0
+ * is the port0 partner, bit 1 a second port. A refresh thus never reads a
+ * mix of two steps, and a stale state two steps back is told apart from the
+ * next one.
+ */
+constexpr int kPortStates[] = {0b00, 0b01, 0b11, 0b10};
+
+int portState(int64_t generation) {
+    return kPortStates[generation % std::size(kPortStates)];
+}
+
+/*
+ * Returns the port state |portStatus| shows, or -1 if it is not one of them,
+ * e.g. because parts of two refreshes were mixed.
+ */
+int decodePortState(const std::vector<PortStatus> &portStatus) {
+    int state = -1;
+
+    if (portStatus.empty() || portStatus.size() > 2)
+        return -1;
+    for (const PortStatus &port : portStatus) {
+        if (port.portName == "port0") {
+            bool connected = port.currentPowerRole == PortPowerRole::SINK &&
+                             port.currentDataRole == PortDataRole::DEVICE &&
+                             port.currentMode == PortMode::UFP;
+            bool disconnected = port.currentPowerRole == PortPowerRole::NONE &&
+                                port.currentDataRole == PortDataRole::NONE &&
+                                port.currentMode == PortMode::NONE;
+
+            if (connected == disconnected ||
+                port.powerBrickStatus != PowerBrickStatus::NOT_CONNECTED)
+                return -1;
+            state = connected ? 0b01 : 0b00;
+        } else if (port.portName != "port1" ||
+                   port.currentPowerRole != PortPowerRole::NONE) {
+            return -1;
+        }
+    }
+    if (state == -1)
+        return -1;
+    return portStatus.size() == 2 ? state | 0b10 : state;
+}
+
+class PortStatusCallback : public TestUsbCallback {
+  public:
+    PortStatusCallback() : mNotifiedState(-1), mQueries(0) {}
+
+    ScopedAStatus notifyPortStatusChange(const std::vector<PortStatus> &portStatus,
+                                         Status status) override {
+        std::lock_guard<std::mutex> lock(mLock);
+        mNotifiedState = status == Status::SUCCESS ? decodePortState(portStatus) : -1;
+        mCV.notify_all();
+        return ScopedAStatus::ok();
+    }
+    ScopedAStatus notifyQueryPortStatus(const std::string &, Status, int64_t) override {
+        std::lock_guard<std::mutex> lock(mLock);
+        mQueries++;
+        mCV.notify_all();
+        return ScopedAStatus::ok();
+    }
+
+    // Waits until the last port status notified shows |state|.
+    bool waitForNotifiedState(int state) {
+        std::unique_lock<std::mutex> lock(mLock);
+        return mCV.wait_for(lock, 5s, [this, state] { return mNotifiedState == state; });
+    }
+
+    // Waits until |count| queries were answered in total.
+    bool waitForQueries(int64_t count) {
+        std::unique_lock<std::mutex> lock(mLock);
+        return mCV.wait_for(lock, 5s, [this, count] { return mQueries >= count; });
+    }
+
+  private:
+    std::mutex mLock;
+    std::condition_variable mCV;
+    int mNotifiedState;
+    int64_t mQueries;
+};
+
+/*
+ * Usb serving the fake port through its real uevent handler: uevents sent
+ * with the injector go through the UeventHub to uevent_event(), which
+ * refreshes the port status and notifies |mCallback|.
+ */
+class UsbPortStatusTest : public ::testing::Test {
+  protected:
+    UsbPortStatusTest() : mTree("device") {}
+
+    void SetUp() override {
+        mUsb = ndk::SharedRefBase::make<Usb>(mInjector.takeHubFd());
+        mCallback = ndk::SharedRefBase::make<PortStatusCallback>();
+        ASSERT_TRUE(mUsb->setCallback(mCallback).isOk());
+    }
+
+    void TearDown() override {
+        if (mUsb)
+            mUsb->setCallback(nullptr);
+        mUsb.reset();
+    }
+
+    // Moves the fake port from |from| to |to| and sends the uevent of the typec port.
+    void setPortState(int from, int to) {
+        if ((from ^ to) & 0b01)
+            mTree.attachPartner(to & 0b01);
+        if ((from ^ to) & 0b10)
+            mTree.attachPort("port1", to & 0b10);
+        ASSERT_TRUE(mInjector.send("change", kPort0Devpath,
+                                   {"SUBSYSTEM=typec", "DEVTYPE=typec_port", "TYPEC_PORT=port0"}));
+    }
+
+    FakeUsbTree mTree;
+    UeventInjector mInjector;
+    shared_ptr<Usb> mUsb;
+    shared_ptr<PortStatusCallback> mCallback;
+};
+
+/*
+ * Readers take snapshots and issue queryPortStatus from several threads
+ * while uevents move the port through its states. Every snapshot has to be
+ * one whole refresh, and once a state was notified no reader may see an
+ * older one.
+ */
+TEST_F(UsbPortStatusTest, ConcurrentQueriesSeeWholeAndCurrentSnapshots) {
+    constexpr int64_t kSteps = 200;
+    constexpr int kReaders = 4;
+    // Generation of the last state notified to the callback
+    std::atomic<int64_t> notified(0);
+    std::atomic<bool> done(false);
+    std::atomic<int64_t> queries(0);
+    std::atomic<int64_t> torn(0);
+    std::atomic<int64_t> stale(0);
+    std::atomic<int64_t> checked(0);
+    std::vector<std::thread> readers;
+
+    ASSERT_TRUE(mUsb->queryPortStatus(queries++).isOk());
+    ASSERT_TRUE(mCallback->waitForNotifiedState(portState(0)));
+
+    for (int r = 0; r < kReaders; r++) {
+        readers.emplace_back([&, r] {
+            for (int64_t n = 0; !done; n++) {
+                int64_t before = notified.load();
+                shared_ptr<const PortStatusSnapshot> snapshot = mUsb->getSnapshot();
+                int64_t after = notified.load();
+                int state = snapshot->status == Status::SUCCESS
+                                    ? decodePortState(snapshot->portStatus)
+                                    : -1;
+
+                if (state == -1 || snapshot->callback != mCallback) {
+                    torn++;
+                } else if (after - before < 2) {
+                    // The state of |before| or a later one, up to the one being moved to.
+                    bool current = false;
+
+                    for (int64_t g = before; g <= after + 1; g++)
+                        current |= state == portState(g);
+                    if (!current)
+                        stale++;
+                    checked++;
+                }
+                if (mUsb->getCallback() != mCallback)
+                    torn++;
+                if (n % 16 == r) {
+                    EXPECT_TRUE(mUsb->queryPortStatus(queries++).isOk());
+                }
+            }
+        });
+    }
+
+    for (int64_t g = 1; g <= kSteps; g++) {
+        setPortState(portState(g - 1), portState(g));
+        if (!mCallback->waitForNotifiedState(portState(g))) {
+            ADD_FAILURE() << "state " << portState(g) << " of step " << g << " not notified";
+            break;
+        }
+        notified = g;
+    }
+
+    done = true;
+    for (std::thread &reader : readers)
+        reader.join();
+
+    EXPECT_EQ(torn, 0);
+    EXPECT_EQ(stale, 0);
+    EXPECT_GT(checked, 0);
+    // Coalesced queries are still answered one by one.
+    EXPECT_TRUE(mCallback->waitForQueries(queries));
+}
+
+}  // namespace
+}  // namespace usb
+}  // namespace hardware
+}  // namespace android
+}  // namespace aidl